@@ -2,6 +2,7 @@
 #ifndef GAUSSIAN_HPP
 #define GAUSSIAN_HPP
 #include "filter_model.hpp"
+#include "../utility/pool.hpp"
 //---------------------------------------------------------------------------
 namespace tipl
 {
@@ -20,7 +21,8 @@ public:
     template<typename image_type>
     void operator()(image_type& src)
     {
-        std::vector<manip_type> dest(src.size());
+        buffer_arena arena;
+        auto dest = arena.get<manip_type>(src.size());
         add_weight<1>(dest,src,1);
         add_weight<1>(dest,src,-1);
         add_weight<2>(dest,src,0);
@@ -39,7 +41,8 @@ public:
     template<typename image_type>
     void operator()(image_type& src)
     {
-        std::vector<manip_type> dest(src.size());
+        buffer_arena arena;
+        auto dest = arena.get<manip_type>(src.size());
         int w = src.width();
 
         add_weight<1>(dest,src,-1);
@@ -62,7 +65,8 @@ public:
     template<typename image_type>
     void operator()(image_type& src)
     {
-        std::vector<manip_type> dest(src.size());
+        buffer_arena arena;
+        auto dest = arena.get<manip_type>(src.size());
         int w = src.width();
         int wh = src.width()*src.height();
         add_weight<1>(dest,src,-1);
@@ -89,7 +93,8 @@ public:
     template<typename image_type>
     void operator()(image_type& src)
     {
-        std::vector<manip_type> dest(src.size());
+        buffer_arena arena;
+        auto dest = arena.get<manip_type>(src.size());
         add_weight<1>(dest,src,2);
         add_weight<1>(dest,src,-2);
         add_weight<2>(dest,src,1);
@@ -109,7 +114,8 @@ public:
     template<typename image_type>
     void operator()(image_type& src)
     {
-        std::vector<manip_type> dest(src.size());
+        buffer_arena arena;
+        auto dest = arena.get<manip_type>(src.size());
         int w = src.width();
         add_weight<1>(dest,src,-1-w);
         add_weight<1>(dest,src,-1+w);
@@ -141,7 +147,8 @@ public:
     template<typename image_type>
     void operator()(image_type& src)
     {
-        std::vector<manip_type> dest(src.size());
+        buffer_arena arena;
+        auto dest = arena.get<manip_type>(src.size());
         int w = src.width();
         int wh = src.width()*src.height();
         add_weight<1>(dest,src,-1-w);
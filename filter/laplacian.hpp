@@ -2,6 +2,7 @@
 #define LAPLACIAN_FILTER_HPP
 #include <cmath>
 #include "filter_model.hpp"
+#include "../utility/pool.hpp"
 namespace tipl{
 
 
@@ -26,7 +27,8 @@ public:
     template<typename image_type>
     void operator()(image_type& src)
     {
-        std::vector<manip_type> dest(src.size());
+        buffer_arena arena;
+        auto dest = arena.get<manip_type>(src.size());
         add_weight<1>(dest,src,1);
         add_weight<1>(dest,src,-1);
         minus_weight<2>(dest,src,0);
@@ -50,7 +52,8 @@ public:
     template<typename image_type>
     void operator()(image_type& src)
     {
-        std::vector<manip_type> dest(src.size());
+        buffer_arena arena;
+        auto dest = arena.get<manip_type>(src.size());
         int w = src.width();
         add_weight<1>(dest,src,-1);
         add_weight<1>(dest,src,1);
@@ -76,7 +79,8 @@ public:
     template<typename image_type>
     void operator()(image_type& src)
     {
-        std::vector<manip_type> dest(src.size());
+        buffer_arena arena;
+        auto dest = arena.get<manip_type>(src.size());
         int w = src.width();
         int wh = src.width()*src.height();
         add_weight<1>(dest,src,1);
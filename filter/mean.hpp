@@ -2,6 +2,7 @@
 #ifndef MEAN_FILTER_HPP
 #define MEAN_FILTER_HPP
 #include "filter_model.hpp"
+#include "../utility/pool.hpp"
 //---------------------------------------------------------------------------
 namespace tipl
 {
@@ -21,7 +22,9 @@ public:
     template<typename image_type>
     void operator()(image_type& src)
     {
-        std::vector<manip_type> dest(src.begin(),src.end());
+        buffer_arena arena;
+        auto dest = arena.get<manip_type>(src.size(),false);
+        std::copy(src.begin(),src.end(),dest.begin());
         add_weight<1>(dest,src,1);
         add_weight<1>(dest,src,-1);
         divide_constant(dest.begin(),dest.end(),3);
@@ -37,7 +40,9 @@ public:
     template<typename image_type>
     void operator()(image_type& src)
     {
-        std::vector<manip_type> dest(src.begin(),src.end());
+        buffer_arena arena;
+        auto dest = arena.get<manip_type>(src.size(),false);
+        std::copy(src.begin(),src.end(),dest.begin());
         int w = src.width();
         add_weight<1>(dest,src,-1-w);
         add_weight<1>(dest,src,-w);
@@ -61,7 +66,9 @@ public:
     template<typename image_type>
     void operator()(image_type& src)
     {
-        std::vector<manip_type> dest(src.begin(),src.end());
+        buffer_arena arena;
+        auto dest = arena.get<manip_type>(src.size(),false);
+        std::copy(src.begin(),src.end(),dest.begin());
         int w = src.width();
         int wh = src.shape().plane_size();
 
@@ -35,7 +35,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <algorithm>
 #include <memory>
 #include <locale>
+#include <functional>
 #include "../numerical/basic_op.hpp"
+#include "../utility/multi_thread.hpp"
 //---------------------------------------------------------------------------
 namespace tipl
 {
@@ -45,443 +47,313 @@ namespace io
 
 //---------------------------------------------------------------------------
 // decode_1_2_840_10008_1_2_4_70
-// modified from https://www.mccauslandcenter.sc.edu/crnl/tools/jpeg-formats
+// lossless JPEG (ITU-T81 process 14), after the decoder in
+// https://www.mccauslandcenter.sc.edu/crnl/tools/jpeg-formats
 //---------------------------------------------------------------------------
-struct HufTables {
-    uint8_t SSSSszRA[18];
-    uint8_t LookUpRA[256];
-    int DHTliRA[32];
-    int DHTstartRA[32];
-    int HufSz[32];
-    int HufCode[32];
-    int HufVal[32];
-    int MaxHufSi;
-    int MaxHufVal;
-}; //end HufTables()
-const int bitMask[16] = {0, 1, 3, 7, 15, 31, 63, 127, 255, 511, 1023, 2047, 4095, 8191, 16383, 32767 };
+struct ljpeg_huffman
+{
+    static const int fast_bits = 9;
+    // (code length << 8) | ssss for codes up to fast_bits long, 0 for longer codes
+    uint16_t fast[1 << fast_bits];
+    int max_code[17];   // the largest code of each length, -1 if there is none
+    int min_code[17];
+    int first_value[17];
+    int max_length = 0;
+    uint8_t values[17];
+    int value_count = 0;
+    // counts[l-1] codes of length l, symbols in code order (Annex C of ITU-T81)
+    bool build(const uint8_t* counts,const uint8_t* symbols)
+    {
+        value_count = 0;
+        for(int l = 0;l < 16;++l)
+            value_count += counts[l];
+        if(value_count == 0 || value_count > 17)
+            return false;
+        std::fill(fast,fast+(1 << fast_bits),uint16_t(0));
+        max_length = 0;
+        int code = 0,k = 0;
+        for(int l = 1;l <= 16;++l,code <<= 1)
+        {
+            max_code[l] = -1;
+            if(!counts[l-1])
+                continue;
+            // the codes of length l must fit in l bits
+            if(code+counts[l-1] > (1 << l))
+                return false;
+            max_length = l;
+            min_code[l] = code;
+            first_value[l] = k;
+            for(int i = 0;i < counts[l-1];++i,++code,++k)
+            {
+                if(symbols[k] > 16)
+                    return false;
+                values[k] = symbols[k];
+                if(l <= fast_bits)
+                {
+                    int from = code << (fast_bits-l);
+                    std::fill(fast+from,fast+from+(1 << (fast_bits-l)),uint16_t((l << 8) | symbols[k]));
+                }
+            }
+            max_code[l] = code-1;
+        }
+        return true;
+    }
+};
 
-inline int dcm_decode_pixel(unsigned char *buf_ptr, long *buf_pos, int *bit_pos, struct HufTables l)
+// entropy-coded bits, stuffed zero bytes are removed and zeros are fed after a marker
+class ljpeg_bit_reader
 {
-    int lByte = (buf_ptr[*buf_pos] << *bit_pos) + (buf_ptr[*buf_pos+1] >> (8- *bit_pos));
-    lByte = lByte & 255;
-    int lHufValSSSS = l.LookUpRA[lByte];
-    if (lHufValSSSS < 255) {
-        *bit_pos = l.SSSSszRA[lHufValSSSS] + *bit_pos;
-        *buf_pos = *buf_pos + (*bit_pos >> 3);
-        *bit_pos = *bit_pos & 7;
-    } else { //full SSSS is not in the first 8-bits
-        int lInput = lByte;
-        int lInputBits = 8;
-        (*buf_pos)++; // forward 8 bits = precisely 1 byte
-        do {
-            lInputBits++;
-            lInput = (lInput << 1);
-            //Read the next single bit
+    const unsigned char* ptr;
+    const unsigned char* end;
+    uint64_t bits = 0;  // left aligned
+    int count = 0;
+    void fill(void)
+    {
+        while(count <= 56)
+        {
+            unsigned int b = 0;
+            if(ptr < end)
             {
-                lInput += (buf_ptr[*buf_pos] >> (7 - *bit_pos)) & 1;
-                (*bit_pos)++;
-                if (*bit_pos == 8) {
-                    (*buf_pos)++;
-                    *bit_pos = 0;
+                b = *ptr++;
+                if(b == 0xFF)
+                {
+                    if(ptr < end && *ptr == 0)
+                        ++ptr;
+                    else
+                    {
+                        end = ptr;
+                        b = 0;
+                    }
                 }
             }
-            if (l.DHTliRA[lInputBits] != 0) { //if any entries with this length
-                for (int lI = l.DHTstartRA[lInputBits]; lI <= (l.DHTstartRA[lInputBits]+l.DHTliRA[lInputBits]-1); lI++) {
-                    if (lInput == l.HufCode[lI])
-                        lHufValSSSS = l.HufVal[lI];
-                } //check each code
-            } //if any entries with this length
-            if ((lInputBits >= l.MaxHufSi) && (lHufValSSSS > 254)) //exhausted options CR: added rev13
-                lHufValSSSS = l.MaxHufVal;
-        } while (!(lHufValSSSS < 255)); // found;
-    } //answer in first 8 bits
-    //The HufVal is referred to as the SSSS in the Codec, so it is called 'lHufValSSSS'
-    if (lHufValSSSS == 0) //NO CHANGE
-      return 0;
-    else if (lHufValSSSS == 16) { //ALL CHANGE 16 bit difference: Codec H.1.2.2 "No extra bits are appended after SSSS = 16 is encoded." Osiris Cornell Libraries fail here
-        return 32768; //see H.1.2.2 and table H.2 of ISO 10918-1
-    }
-    //to get here - there is a 1..15 bit difference
-    int lDiff = buf_ptr[*buf_pos];
-    lDiff = (lDiff << 8) + buf_ptr[(*buf_pos)+1];
-    lDiff = (lDiff << 8) + buf_ptr[(*buf_pos)+2];
-    lDiff = (lDiff >> (24 - *bit_pos -lHufValSSSS)) & bitMask[lHufValSSSS]; //bit_pos is incremented from 1, so -1
-    *bit_pos = *bit_pos + lHufValSSSS;
-    if (*bit_pos > 7) {
-            *buf_pos = *buf_pos + (*bit_pos >> 3); // div 8
-            *bit_pos = *bit_pos & 7; //mod 8
-    }
-    if (lDiff <= bitMask[lHufValSSSS-1] )//add
-        lDiff = lDiff - bitMask[lHufValSSSS];
-    return lDiff;
-} //end dcm_decode_pixel()
+            bits |= uint64_t(b) << (56-count);
+            count += 8;
+        }
+    }
+    unsigned int peek(int n) const{return (unsigned int)(bits >> (64-n));}
+    void skip(int n)
+    {
+        bits <<= n;
+        count -= n;
+    }
+public:
+    ljpeg_bit_reader(const unsigned char* ptr_,const unsigned char* end_):ptr(ptr_),end(end_){}
+    // the difference of the next sample, see H.1.2.2
+    int decode(const ljpeg_huffman& h)
+    {
+        if(count < 32)
+            fill();
+        int ssss;
+        if(uint16_t entry = h.fast[peek(ljpeg_huffman::fast_bits)])
+        {
+            skip(entry >> 8);
+            ssss = entry & 255;
+        }
+        else
+        {
+            // the last symbol for a code not in the table, as the reference decoder does
+            ssss = h.values[h.value_count-1];
+            int length = h.max_length;
+            for(int l = ljpeg_huffman::fast_bits+1;l <= h.max_length;++l)
+                if(h.max_code[l] >= 0 && int(peek(l)) <= h.max_code[l])
+                {
+                    ssss = h.values[h.first_value[l]+int(peek(l))-h.min_code[l]];
+                    length = l;
+                    break;
+                }
+            skip(length);
+        }
+        if(ssss == 0)
+            return 0;
+        if(ssss == 16)
+            return 32768;
+        int v = int(peek(ssss));
+        skip(ssss);
+        return v < (1 << (ssss-1)) ? v-(1 << ssss)+1 : v;
+    }
+};
 
-inline uint16_t dcm_read_word(unsigned char *buf_ptr, long *buf_pos) {
-    uint16_t ret = (uint16_t(buf_ptr[*buf_pos]) << 8) + uint16_t(buf_ptr[*buf_pos+1]);
-    (*buf_pos) += 2;
-    return ret;
-} //end dcm_read_word()
+// Table H.1, ra: left, rb: above, rc: above left
+template<int predictor>
+inline int ljpeg_predict(int ra,int rb,int rc)
+{
+    switch(predictor)
+    {
+        case 1: return ra;
+        case 2: return rb;
+        case 3: return rc;
+        case 4: return ra+rb-rc;
+        case 5: return ra+((rb-rc) >> 1);
+        case 6: return rb+((ra-rc) >> 1);
+        default: return (ra+rb) >> 1;
+    }
+}
 
+/*
+ * decodes nf interleaved components into planes of w*h samples. The first row
+ * is predicted from the left and the first column from above, so the inner
+ * loop has one predictor and no boundary checks.
+ */
+template<int predictor,typename T>
+void ljpeg_decode_scan(ljpeg_bit_reader& in,const ljpeg_huffman* const* tables,
+                       T* out,int w,int h,int nf,int initial)
+{
+    size_t plane = size_t(w)*size_t(h);
+    for(int c = 0;c < nf;++c)
+        out[c*plane] = T(initial+in.decode(*tables[c]));
+    for(int x = 1;x < w;++x)
+        for(int c = 0;c < nf;++c)
+        {
+            T* p = out+c*plane+x;
+            *p = T(p[-1]+in.decode(*tables[c]));
+        }
+    for(int y = 1;y < h;++y)
+    {
+        T* row = out+size_t(y)*size_t(w);
+        for(int c = 0;c < nf;++c)
+        {
+            T* p = row+c*plane;
+            *p = T(p[-w]+in.decode(*tables[c]));
+        }
+        for(int x = 1;x < w;++x)
+            for(int c = 0;c < nf;++c)
+            {
+                T* p = row+c*plane+x;
+                *p = T(ljpeg_predict<predictor>(p[-1],p[-w],p[-w-1])+in.decode(*tables[c]));
+            }
+    }
+}
+
+template<typename T>
+void ljpeg_decode_scan(int predictor,ljpeg_bit_reader& in,const ljpeg_huffman* const* tables,
+                       T* out,int w,int h,int nf,int initial)
+{
+    switch(predictor)
+    {
+        case 2: ljpeg_decode_scan<2>(in,tables,out,w,h,nf,initial);return;
+        case 3: ljpeg_decode_scan<3>(in,tables,out,w,h,nf,initial);return;
+        case 4: ljpeg_decode_scan<4>(in,tables,out,w,h,nf,initial);return;
+        case 5: ljpeg_decode_scan<5>(in,tables,out,w,h,nf,initial);return;
+        case 6: ljpeg_decode_scan<6>(in,tables,out,w,h,nf,initial);return;
+        case 7: ljpeg_decode_scan<7>(in,tables,out,w,h,nf,initial);return;
+        default:ljpeg_decode_scan<1>(in,tables,out,w,h,nf,initial);return;
+    }
+}
+
+/*
+ * decodes a lossless JPEG frame into buf: 16-bit samples for precision above
+ * 8 bits, otherwise bytes. RGB (8-bit only) is stored plane by plane.
+ * Returns false for other JPEG processes, restart intervals, and corrupted
+ * headers.
+ */
 inline bool decode_1_2_840_10008_1_2_4_70(unsigned char *buf_ptr, long buf_size, std::vector<unsigned char>& buf,
                                        int *dimX, int *dimY, int *bits, int *frames)
 {
-    unsigned char *lImgRA8 = nullptr;
-    if ((buf_ptr[0] != 0xFF) || (buf_ptr[1] != 0xD8) || (buf_ptr[2] != 0xFF))
+    if(buf_size < 4 || buf_ptr[0] != 0xFF || buf_ptr[1] != 0xD8)
         return false;
-    //next: read header
-    long buf_pos = 2; //Skip initial 0xFFD8, begin with third byte
-    unsigned char btS1, SOSss(0), SOSahal, SOSpttrans(0), btMarkerType, SOSns = 0x00; //tag
-    uint8_t SOFnf(0), SOFprecision(0);
-    uint16_t SOFydim(0), SOFxdim(0); //, lRestartSegmentSz;
-    int lnHufTables = 0;
-    const int kmaxFrames = 4;
-    struct HufTables l[kmaxFrames+1];
-    do { //read each marker in the header
-        do {
-            btS1 = buf_ptr[buf_pos++];
-            if (btS1 != 0xFF) {
-                printf("JPEG header tag must begin with 0xFF\n");
-                return false;
-            }
-            btMarkerType =  buf_ptr[buf_pos++];
-            if ((btMarkerType == 0x01) || (btMarkerType == 0xFF) || ((btMarkerType >= 0xD0) && (btMarkerType <= 0xD7) ) )
-                btMarkerType = 0;//only process segments with length fields
-
-        } while ((buf_pos < buf_size) && (btMarkerType == 0));
-        uint16_t lSegmentLength = dcm_read_word (buf_ptr, &buf_pos); //read marker length
-        long lSegmentEnd = buf_pos+(lSegmentLength - 2);
-        if (lSegmentEnd > buf_size)  {
+    ljpeg_huffman tables[4];
+    bool table_defined[4] = {false,false,false,false};
+    int precision = 0,w = 0,h = 0,nf = 0,predictor = 1,point_transform = 0;
+    int table_id[3] = {0,0,0};
+    long pos = 2;
+    for(bool scan_found = false;!scan_found;)
+    {
+        if(pos+4 > buf_size || buf_ptr[pos] != 0xFF)
             return false;
+        int marker = buf_ptr[pos+1];
+        pos += 2;
+        if(marker == 0xFF)      // fill byte
+        {
+            --pos;
+            continue;
         }
-        if ( ((btMarkerType >= 0xC0) && (btMarkerType <= 0xC3)) || ((btMarkerType >= 0xC5) && (btMarkerType <= 0xCB)) || ((btMarkerType >= 0xCD) && (btMarkerType <= 0xCF)) )  {
-            //if Start-Of-Frame (SOF) marker
-            SOFprecision = buf_ptr[buf_pos++];
-            SOFydim = dcm_read_word(buf_ptr, &buf_pos);
-            SOFxdim = dcm_read_word(buf_ptr, &buf_pos);
-            SOFnf = buf_ptr[buf_pos++];
-            buf_pos = (lSegmentEnd);
-            if (btMarkerType != 0xC3) { //lImgTypeC3 = true;
-                printf("This JPEG decoder can only decompress lossless JPEG ITU-T81 images (SoF must be 0XC3, not %#02X)\n",btMarkerType );
+        if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8))   // no length field
+            continue;
+        long length = (long(buf_ptr[pos]) << 8) | buf_ptr[pos+1];
+        long segment_end = pos+length;
+        if(length < 2 || segment_end > buf_size)
+            return false;
+        const unsigned char* p = buf_ptr+pos+2;
+        switch(marker)
+        {
+        case 0xC3:  // SOF, lossless sequential
+            if(length < 8)
                 return false;
-            }
-            if ( (SOFprecision < 1) || (SOFprecision > 16) || (SOFnf < 1) || (SOFnf == 2) || (SOFnf > 3)
-                || ((SOFnf == 3) &&  (SOFprecision > 8))   ) {
-                printf("Scalar data must be 1..16 bit, RGB data must be 8-bit (%d-bit, %d frames)\n", SOFprecision, SOFnf);
+            precision = p[0];
+            h = (int(p[1]) << 8) | p[2];
+            w = (int(p[3]) << 8) | p[4];
+            nf = p[5];
+            if(precision < 1 || precision > 16 || (nf != 1 && nf != 3) || (nf == 3 && precision > 8) || !w || !h)
                 return false;
+            break;
+        case 0xC4:  // DHT
+            while(p+17 <= buf_ptr+segment_end)
+            {
+                int id = p[0] & 3;
+                int count = 0;
+                for(int l = 0;l < 16;++l)
+                    count += p[1+l];
+                if(p+17+count > buf_ptr+segment_end || !tables[id].build(p+1,p+17))
+                    return false;
+                table_defined[id] = true;
+                p += 17+count;
             }
-        } else if (btMarkerType == 0xC4) {//if SOF marker else if define-Huffman-tables marker (DHT)
-            int lFrameCount = 1;
-            do {
-                uint8_t DHTnLi = buf_ptr[buf_pos++]; //we read but ignore DHTtcth.
-                DHTnLi = 0;
-                for (int lInc = 1; lInc <= 16; lInc++) {
-                    l[lFrameCount].DHTliRA[lInc] = buf_ptr[buf_pos++];
-                    DHTnLi = DHTnLi +  l[lFrameCount].DHTliRA[lInc];
-                    if (l[lFrameCount].DHTliRA[lInc] != 0) l[lFrameCount].MaxHufSi = lInc;
-                }
-                if (DHTnLi > 17) {
-                    printf("Huffman table corrupted.\n");
+            break;
+        case 0xDD:  // DRI
+            if(length < 4 || ((int(p[0]) << 8) | p[1]))
+                return false;
+            break;
+        case 0xDA:  // SOS
+            {
+                int ns = p[0];
+                if(ns != nf || length < 6+2*ns)
                     return false;
-                }
-                int lIncY = 0; //frequency
-                for (int lInc = 0; lInc <= 31; lInc++) {//lInc := 0 to 31 do begin
-                    l[lFrameCount].HufVal[lInc] = -1;
-                    l[lFrameCount].HufSz[lInc] = -1;
-                    l[lFrameCount].HufCode[lInc] = -1;
-                }
-                for (int lInc = 1; lInc <= 16; lInc++) {//set the huffman size values
-                    if (l[lFrameCount].DHTliRA[lInc] > 0) {
-                        l[lFrameCount].DHTstartRA[lInc] = lIncY+1;
-                        for (int lIncX = 1; lIncX <= l[lFrameCount].DHTliRA[lInc]; lIncX++) {
-                            lIncY++;
-                            btS1 = buf_ptr[buf_pos++];
-                            l[lFrameCount].HufVal[lIncY] = btS1;
-                            l[lFrameCount].MaxHufVal = btS1;
-                            if (btS1 <= 16)
-                                l[lFrameCount].HufSz[lIncY] = lInc;
-                            else {
-                                printf("Huffman size array corrupted.\n");
-                                return false;
-                            }
-                        }
-                    }
-                } //set huffman size values
-                int K = 1;
-                int Code = 0;
-                int Si = l[lFrameCount].HufSz[K];
-                do {
-                    while (Si == l[lFrameCount].HufSz[K]) {
-                        l[lFrameCount].HufCode[K] = Code;
-                        Code = Code + 1;
-                        K++;
-                    }
-                    if (K <= DHTnLi) {
-                        while (l[lFrameCount].HufSz[K] > Si) {
-                            Code = Code << 1; //Shl!!!
-                            Si = Si + 1;
-                        }//while Si
-                    }//K <= 17
-
-                } while (K <= DHTnLi);
-                lFrameCount++;
-            } while ((lSegmentEnd-buf_pos) >= 18);
-            lnHufTables = lFrameCount - 1;
-            buf_pos = (lSegmentEnd);
-        } else if (btMarkerType == 0xDD) {  //if DHT marker else if Define restart interval (DRI) marker
-            printf("This image uses Restart Segments - please contact Chris Rorden to add support for this format.\n");
-            return false;
-            //lRestartSegmentSz = dcm_read_word(buf_ptr, &buf_pos, buf_size);
-            //buf_pos = lSegmentEnd;
-        } else if (btMarkerType == 0xDA) {  //if DRI marker else if read Start of Scan (SOS) marker
-            SOSns = buf_ptr[buf_pos++];
-            //if Ns = 1 then NOT interleaved, else interleaved: see B.2.3
-            if (SOSns > 0) {
-                for (int lInc = 1; lInc <= SOSns; lInc++) {
-                    btS1 = buf_ptr[buf_pos++]; //component identifier 1=Y,2=Cb,3=Cr,4=I,5=Q
-                    buf_pos++; //horizontal and vertical sampling factors
-                }
+                for(int c = 0;c < ns;++c)
+                    table_id[c] = p[2+2*c] >> 4 & 3;
+                predictor = p[1+2*ns];
+                point_transform = p[3+2*ns] & 15;
+                scan_found = true;
             }
-            SOSss = buf_ptr[buf_pos++]; //predictor selection B.3
-            buf_pos++;
-            SOSahal = buf_ptr[buf_pos++]; //lower 4bits= pointtransform
-            SOSpttrans = SOSahal & 16;
-            buf_pos = (lSegmentEnd);
-        } else  //if SOS marker else skip marker
-            buf_pos = (lSegmentEnd);
-    } while ((buf_pos < buf_size) && (btMarkerType != 0xDA)); //0xDA=Start of scan: loop for reading header
-    //NEXT: Huffman decoding
-    if (lnHufTables < 1)
+            break;
+        default:
+            if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+                return false;   // other JPEG processes
+        }
+        pos = segment_end;
+    }
+    if(!nf)
         return false;
-    // Decoding error: no Huffman tables
-    //NEXT: unpad data - delete byte that follows $FF
-    long lIncI = buf_pos; //input position
-    long lIncO = buf_pos; //output position
-    do {
-        buf_ptr[lIncO] = buf_ptr[lIncI];
-        if (buf_ptr[lIncI] == 255) {
-            if (buf_ptr[lIncI+1] == 0)
-                lIncI = lIncI+1;
-            else if (buf_ptr[lIncI+1] == 0xD9)
-                lIncO = -666; //end of padding
-        }
-        lIncI++;
-        lIncO++;
-    } while (lIncO > 0);
-    //NEXT: some RGB images use only a single Huffman table for all 3 colour planes. In this case, replicate the correct values
-    //NEXT: prepare lookup table
-
-    for (int lFrameCount = 1; lFrameCount <= lnHufTables; lFrameCount ++) {
-        for (int lInc = 0; lInc <= 17; lInc ++)
-            l[lFrameCount].SSSSszRA[lInc] = 123; //Impossible value for SSSS, suggests 8-bits can not describe answer
-        for (int lInc = 0; lInc <= 255; lInc ++)
-            l[lFrameCount].LookUpRA[lInc] = 255; //Impossible value for SSSS, suggests 8-bits can not describe answer
+    const ljpeg_huffman* component_tables[3];
+    for(int c = 0;c < nf;++c)
+    {
+        int id = table_id[c];
+        if(!table_defined[id])  // some RGB images use one table for all components
+            id = int(std::find(table_defined,table_defined+4,true)-table_defined);
+        if(id == 4)
+            return false;
+        component_tables[c] = tables+id;
     }
-    //NEXT: fill lookuptable
-
-
-    for (int lFrameCount = 1; lFrameCount <= lnHufTables; lFrameCount ++) {
-        int lIncY = 0;
-        for (int lSz = 1; lSz <= 8; lSz ++) { //set the huffman lookup table for keys with lengths <=8
-            if (l[lFrameCount].DHTliRA[lSz]> 0) {
-                for (int lIncX = 1; lIncX <= l[lFrameCount].DHTliRA[lSz]; lIncX ++) {
-                    lIncY++;
-                    int lHufVal = l[lFrameCount].HufVal[lIncY]; //SSSS
-                    l[lFrameCount].SSSSszRA[lHufVal] = lSz;
-                    int k = (l[lFrameCount].HufCode[lIncY] << (8-lSz )) & 255; //K= most sig bits for hufman table
-                    if (lSz < 8) { //fill in all possible bits that exceed the huffman table
-                        int lInc = bitMask[8-lSz];
-                        for (int bit_pos = 0; bit_pos <= lInc; bit_pos++) {
-                            l[lFrameCount].LookUpRA[k+bit_pos] = lHufVal;
-                        }
-                    } else
-                        l[lFrameCount].LookUpRA[k] = lHufVal; //SSSS
-                    //printf("Frame %d SSSS %d Size %d Code %d SHL %d EmptyBits %ld\n", lFrameCount, lHufRA[lFrameCount][lIncY].HufVal, lHufRA[lFrameCount][lIncY].HufSz,lHufRA[lFrameCount][lIncY].HufCode, k, lInc);
-                } //Set SSSS
-            } //Length of size lInc > 0
-        } //for lInc := 1 to 8
-    } //For each frame, e.g. once each for Red/Green/Blue
-    //NEXT: some RGB images use only a single Huffman table for all 3 colour planes. In this case, replicate the correct values
-    if (lnHufTables < SOFnf) { //use single Hufman table for each frame
-        for (int lFrameCount = 2; lFrameCount <= SOFnf; lFrameCount++) {
-            l[lFrameCount] = l[1];
-        } //for each frame
-    } // if lnHufTables < SOFnf
-    //NEXT: uncompress data: different loops for different predictors
-    int lItems =  SOFxdim*SOFydim*SOFnf;
-    // buf_pos++;// <- only for Pascal where array is indexed from 1 not 0 first byte of data
-    int bit_pos = 0; //read in a new byte
-
-    //depending on SOSss, we see Table H.1
-    int lPredA = 0;
-    int lPredB = 0;
-    int lPredC = 0;
-    if (SOSss == 2) //predictor selection 2: above
-        lPredA = SOFxdim-1;
-    else if (SOSss == 3) //predictor selection 3: above+left
-        lPredA = SOFxdim;
-    else if ((SOSss == 4) || (SOSss == 5)) { //these use left, above and above+left WEIGHT LEFT
-        lPredA = 0; //Ra left
-        lPredB = SOFxdim-1; //Rb directly above
-        lPredC = SOFxdim; //Rc UpperLeft:above and to the left
-    } else if (SOSss == 6) { //also use left, above and above+left, WEIGHT ABOVE
-        lPredB = 0;
-        lPredA = SOFxdim-1; //Rb directly above
-        lPredC = SOFxdim; //Rc UpperLeft:above and to the left
-    }   else
-        lPredA = 0; //Ra: directly to left)
-    if (SOFprecision > 8) { //start - 16 bit data
+    if(precision-1-point_transform < 0)
+        return false;
+    int initial = 1 << (precision-1-point_transform);
+    size_t items = size_t(w)*size_t(h)*size_t(nf);
+    ljpeg_bit_reader in(buf_ptr+pos,buf_ptr+buf_size);
+    if(precision > 8)
+    {
+        buf.resize(items*2);
+        ljpeg_decode_scan(predictor,in,component_tables,reinterpret_cast<uint16_t*>(&buf[0]),w,h,nf,initial);
         *bits = 16;
-        int lPx = -1; //pixel position
-        int lPredicted =  1 << (SOFprecision-1-SOSpttrans);
-        buf.resize(lItems*2);
-        lImgRA8 = &buf[0];
-        uint16_t *lImgRA16 = (uint16_t*) lImgRA8;
-        for (int i = 0; i < lItems; i++)
-            lImgRA16[i] = 0; //zero array
-        int frame = 1;
-        for (int lIncX = 1; lIncX <= SOFxdim; lIncX++) { //for first row - here we ALWAYS use LEFT as predictor
-            lPx++; //writenext voxel
-            if (lIncX > 1) lPredicted = lImgRA16[lPx-1];
-            lImgRA16[lPx] = lPredicted+ dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[frame]);
-        }
-        for (int lIncY = 2; lIncY <= SOFydim; lIncY++) {//for all subsequent rows
-            lPx++; //write next voxel
-            lPredicted = lImgRA16[lPx-SOFxdim]; //use ABOVE
-            lImgRA16[lPx] = lPredicted+dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[frame]);
-            if (SOSss == 4) {
-                for (int lIncX = 2; lIncX <= SOFxdim; lIncX++) {
-                    lPredicted = lImgRA16[lPx-lPredA]+lImgRA16[lPx-lPredB]-lImgRA16[lPx-lPredC];
-                    lPx++; //writenext voxel
-                    lImgRA16[lPx] = lPredicted+dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[frame]);
-                } //for lIncX
-            } else if ((SOSss == 5) || (SOSss == 6)) {
-                for (int lIncX = 2; lIncX <= SOFxdim; lIncX++) {
-                    lPredicted = lImgRA16[lPx-lPredA]+ ((lImgRA16[lPx-lPredB]-lImgRA16[lPx-lPredC]) >> 1);
-                    lPx++; //writenext voxel
-                    lImgRA16[lPx] = lPredicted+dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[frame]);
-                } //for lIncX
-            } else if (SOSss == 7) {
-                for (int lIncX = 2; lIncX <= SOFxdim; lIncX++) {
-                    lPx++; //writenext voxel
-                    lPredicted = (lImgRA16[lPx-1]+lImgRA16[lPx-SOFxdim]) >> 1;
-                    lImgRA16[lPx] = lPredicted+dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[frame]);
-                } //for lIncX
-            } else { //SOSss 1,2,3 read single values
-                for (int lIncX = 2; lIncX <= SOFxdim; lIncX++) {
-                    lPredicted = lImgRA16[lPx-lPredA];
-                    lPx++; //writenext voxel
-                    lImgRA16[lPx] = lPredicted+dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[frame]);
-                } //for lIncX
-            } // if..else possible predictors
-        }//for lIncY
-    } else if (SOFnf == 3) { //if 16-bit data; else 8-bit 3 frames
-        *bits = 8;
-        buf.resize(lItems);
-        lImgRA8 = &buf[0];
-
-        int lPx[kmaxFrames+1], lPredicted[kmaxFrames+1]; //pixel position
-        for (int f = 1; f <= SOFnf; f++) {
-            lPx[f] = ((f-1) * (SOFxdim * SOFydim) ) -1;
-            lPredicted[f] = 1 << (SOFprecision-1-SOSpttrans);
-        }
-        for (int i = 0; i < lItems; i++)
-            lImgRA8[i] = 255; //zero array
-        for (int lIncX = 1; lIncX <= SOFxdim; lIncX++) { //for first row - here we ALWAYS use LEFT as predictor
-            for (int f = 1; f <= SOFnf; f++) {
-                lPx[f]++; //writenext voxel
-                if (lIncX > 1) lPredicted[f] = lImgRA8[lPx[f]-1];
-                lImgRA8[lPx[f]] = lPredicted[f] + dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[f]);
-            }
-        } //first row always predicted by LEFT
-        for (int lIncY = 2; lIncY <= SOFydim; lIncY++) {//for all subsequent rows
-            for (int f = 1; f <= SOFnf; f++) {
-                lPx[f]++; //write next voxel
-                lPredicted[f] = lImgRA8[lPx[f]-SOFxdim]; //use ABOVE
-                lImgRA8[lPx[f]] = lPredicted[f] + dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[f]);
-            }//first column of row always predicted by ABOVE
-            if (SOSss == 4) {
-                for (int lIncX = 2; lIncX <= SOFxdim; lIncX++) {
-                    for (int f = 1; f <= SOFnf; f++) {
-                        lPredicted[f] = lImgRA8[lPx[f]-lPredA]+lImgRA8[lPx[f]-lPredB]-lImgRA8[lPx[f]-lPredC];
-                        lPx[f]++; //writenext voxel
-                        lImgRA8[lPx[f]] = lPredicted[f]+dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[f]);
-                    }
-                } //for lIncX
-            } else if ((SOSss == 5) || (SOSss == 6)) {
-                for (int lIncX = 2; lIncX <= SOFxdim; lIncX++) {
-                    for (int f = 1; f <= SOFnf; f++) {
-                        lPredicted[f] = lImgRA8[lPx[f]-lPredA]+ ((lImgRA8[lPx[f]-lPredB]-lImgRA8[lPx[f]-lPredC]) >> 1);
-                        lPx[f]++; //writenext voxel
-                        lImgRA8[lPx[f]] = lPredicted[f] + dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[f]);
-                    }
-                } //for lIncX
-            } else if (SOSss == 7) {
-                for (int lIncX = 2; lIncX <= SOFxdim; lIncX++) {
-                    for (int f = 1; f <= SOFnf; f++) {
-                        lPx[f]++; //writenext voxel
-                        lPredicted[f] = (lImgRA8[lPx[f]-1]+lImgRA8[lPx[f]-SOFxdim]) >> 1;
-                        lImgRA8[lPx[f]] = lPredicted[f] + dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[f]);
-                    }
-                } //for lIncX
-            } else { //SOSss 1,2,3 read single values
-                for (int lIncX = 2; lIncX <= SOFxdim; lIncX++) {
-                    for (int f = 1; f <= SOFnf; f++) {
-                        lPredicted[f] = lImgRA8[lPx[f]-lPredA];
-                        lPx[f]++; //writenext voxel
-                        lImgRA8[lPx[f]] = lPredicted[f] + dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[f]);
-                    }
-                } //for lIncX
-            } // if..else possible predictors
-        }//for lIncY
-    }else { //if 8-bit data 3frames; else 8-bit 1 frames
+    }
+    else
+    {
+        buf.resize(items);
+        ljpeg_decode_scan(predictor,in,component_tables,&buf[0],w,h,nf,initial);
         *bits = 8;
-        buf.resize(lItems);
-        lImgRA8 = &buf[0];
-        int lPx = -1; //pixel position
-        int lPredicted =  1 << (SOFprecision-1-SOSpttrans);
-        for (int i = 0; i < lItems; i++)
-            lImgRA8[i] = 0; //zero array
-        for (int lIncX = 1; lIncX <= SOFxdim; lIncX++) { //for first row - here we ALWAYS use LEFT as predictor
-            lPx++; //writenext voxel
-            if (lIncX > 1) lPredicted = lImgRA8[lPx-1];
-            int dx = dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[1]);
-            lImgRA8[lPx] = lPredicted+dx;
-        }
-        for (int lIncY = 2; lIncY <= SOFydim; lIncY++) {//for all subsequent rows
-            lPx++; //write next voxel
-            lPredicted = lImgRA8[lPx-SOFxdim]; //use ABOVE
-            lImgRA8[lPx] = lPredicted+dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[1]);
-            if (SOSss == 4) {
-                for (int lIncX = 2; lIncX <= SOFxdim; lIncX++) {
-                    lPredicted = lImgRA8[lPx-lPredA]+lImgRA8[lPx-lPredB]-lImgRA8[lPx-lPredC];
-                    lPx++; //writenext voxel
-                    lImgRA8[lPx] = lPredicted+dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[1]);
-                } //for lIncX
-            } else if ((SOSss == 5) || (SOSss == 6)) {
-                for (int lIncX = 2; lIncX <= SOFxdim; lIncX++) {
-                    lPredicted = lImgRA8[lPx-lPredA]+ ((lImgRA8[lPx-lPredB]-lImgRA8[lPx-lPredC]) >> 1);
-                    lPx++; //writenext voxel
-                    lImgRA8[lPx] = lPredicted+dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[1]);
-                } //for lIncX
-            } else if (SOSss == 7) {
-                for (int lIncX = 2; lIncX <= SOFxdim; lIncX++) {
-                    lPx++; //writenext voxel
-                    lPredicted = (lImgRA8[lPx-1]+lImgRA8[lPx-SOFxdim]) >> 1;
-                    lImgRA8[lPx] = lPredicted+dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[1]);
-                } //for lIncX
-            } else { //SOSss 1,2,3 read single values
-                for (int lIncX = 2; lIncX <= SOFxdim; lIncX++) {
-                    lPredicted = lImgRA8[lPx-lPredA];
-                    lPx++; //writenext voxel
-                    lImgRA8[lPx] = lPredicted+dcm_decode_pixel(buf_ptr, &buf_pos, &bit_pos, l[1]);
-                } //for lIncX
-            } // if..else possible predictors
-        }//for lIncY
-    } //if 16bit else 8bit
-    *dimX = SOFxdim;
-    *dimY = SOFydim;
-    *frames = SOFnf;
-    return lImgRA8;
+    }
+    *dimX = w;
+    *dimY = h;
+    *frames = nf;
+    return true;
 }
 //---------------------------------------------------------------------------
 
@@ -529,12 +401,24 @@ public:
     std::vector<unsigned char> data;
     // for VR=SQ
     std::vector<dicom_group_element> sq_data;
+    // values of lazy_threshold bytes or more are not read, only their file offset and size are kept
+    static const size_t lazy_threshold = 1 << 20;
+    size_t lazy_offset = 0;
+    size_t lazy_size = 0;
+    // a lazy value is byte-swapped when it is read
+    bool lazy_big_endian = false;
+    // the elements of a sequence or item of undefined length follow it until the delimiter
+    bool undefined_length = false;
 private:
     void assign(const dicom_group_element& rhs)
     {
         std::copy(rhs.gel,rhs.gel+8,gel);
         data = rhs.data;
         sq_data = rhs.sq_data;
+        lazy_offset = rhs.lazy_offset;
+        lazy_size = rhs.lazy_size;
+        lazy_big_endian = rhs.lazy_big_endian;
+        undefined_length = rhs.undefined_length;
     }
     bool flag_contains(const char* flag,unsigned int flag_size)
     {
@@ -636,7 +520,10 @@ public:
             }
         }
         if (read_length == 0xFFFFFFFF)
+        {
+            undefined_length = true;
             read_length = 0;
+        }
         if (read_length)
         {
             // handle SQ here
@@ -654,24 +541,36 @@ public:
                 }
             }
             else
+            if(read_length >= lazy_threshold)
+            {
+                lazy_offset = size_t(in.tellg());
+                lazy_size = read_length;
+                lazy_big_endian = (transfer_syntax == bee);
+                in.seekg(read_length,std::ios::cur);
+            }
+            else
             {
                 data.resize(read_length);
                 in.read((char*)&*(data.begin()),read_length);
             }
             if(transfer_syntax == bee)
-            {
-                if (is_float()) // float
-                    change_endian<float>(&*data.begin(),data.size()/sizeof(float));
-                if (is_double()) // double
-                    change_endian<double>(&*data.begin(),data.size()/sizeof(double));
-                if (is_int16()) // uint16type
-                    change_endian<short>(&*data.begin(),data.size()/sizeof(short));
-                if (is_int32() && data.size() >= 4)
-                    change_endian<int>(&*data.begin(),data.size()/sizeof(int));
-            }
+                swap_endian(data);
         }
         return !(!in);
     }
+    void swap_endian(std::vector<unsigned char>& buf) const
+    {
+        if(buf.empty())
+            return;
+        if (is_float()) // float
+            change_endian<float>(&*buf.begin(),buf.size()/sizeof(float));
+        if (is_double()) // double
+            change_endian<double>(&*buf.begin(),buf.size()/sizeof(double));
+        if (is_int16()) // uint16type
+            change_endian<short>(&*buf.begin(),buf.size()/sizeof(short));
+        if (is_int32() && buf.size() >= 4)
+            change_endian<int>(&*buf.begin(),buf.size()/sizeof(int));
+    }
 
     unsigned int get_order(void) const
     {
@@ -684,6 +583,10 @@ public:
     {
         return data;
     }
+    bool is_lazy(void) const
+    {
+        return lazy_size != 0;
+    }
     unsigned short get_vr(void) const
     {
         return vr;
@@ -964,10 +867,21 @@ public:
     }
 };
 
+// per-frame attributes of an enhanced multi-frame image
+struct dicom_frame_info
+{
+    float position[3] = {0.0f,0.0f,0.0f};     // (0020,0032) image position
+    int stack_position = 0;                     // (0020,9057) in-stack position number
+    int temporal_index = 0;                     // (0020,9128) temporal position index
+};
+
 class dicom
 {
 private:
     std::shared_ptr<std::ifstream> input_io;
+    // reopens the file after close(), pixel_offset is where the pixel data start
+    std::function<std::shared_ptr<std::ifstream>(void)> reopen_file;
+    size_t pixel_offset = 0;
     unsigned int image_size = 0;
     transfer_syntax_type transfer_syntax;
 public:
@@ -982,6 +896,8 @@ public:
     std::vector<dicom_csa_data> csa_data;
     bool is_mosaic,is_big_endian;
 private:
+    mutable std::map<size_t,std::vector<unsigned char> > lazy_data;
+    mutable std::mutex lazy_lock;   // slices of a dicom_volume may be read concurrently
     void assign(const dicom& rhs)
     {
         ge_map = rhs.ge_map;
@@ -1048,8 +964,17 @@ public:
     {
         ge_map.clear();
         data.clear();
+        lazy_data.clear();
         transfer_syntax = lee;
-        input_io.reset(new std::ifstream(file_name,std::ios::binary));
+        pixel_offset = 0;
+        {
+            std::basic_string<char_type> name(file_name);
+            reopen_file = [name](void)
+            {
+                return std::make_shared<std::ifstream>(name.c_str(),std::ios::binary);
+            };
+        }
+        input_io = reopen_file();
         if (!(*input_io))
             return false;
         input_io->seekg(128);
@@ -1084,6 +1009,7 @@ public:
                     is_mosaic = get_int(0x0019,0x100A) > 1 ||   // multiple frame (new version)
                             (get_text(0x0008,0x0008,image_type) && image_type.find("MOSAIC") != std::string::npos);
                 }
+                pixel_offset = size_t(input_io->tellg());
                 if(is_compressed)
                 {
                     buf_size = ge.length;
@@ -1155,6 +1081,16 @@ public:
         return true;
     }
 
+    // releases the file handle, the pixel data are read by reopening the file
+    void close(void)
+    {
+        input_io.reset();
+    }
+    bool has_pixel_data(void) const
+    {
+        return input_io.get() ? bool(*input_io) : pixel_offset != 0;
+    }
+
     const char* get_csa_data(const std::string& name,unsigned int index) const
     {
         std::map<std::string,unsigned int>::const_iterator iter = csa_map.find(name);
@@ -1163,6 +1099,26 @@ public:
         return csa_data[iter->second].get_value(index);
     }
 
+    // the value of an element, a lazy element is read from the file when it is first used
+    const std::vector<unsigned char>& get_element_data(const dicom_group_element& ge) const
+    {
+        if(!ge.is_lazy())
+            return ge.get();
+        std::lock_guard<std::mutex> lock(lazy_lock);
+        auto& buf = lazy_data[ge.lazy_offset];
+        if(buf.empty() && reopen_file)
+        {
+            auto in = reopen_file();
+            in->seekg(std::streamoff(ge.lazy_offset));
+            buf.resize(ge.lazy_size);
+            if(!in->read((char*)&buf[0],std::streamsize(buf.size())))
+                buf.clear();
+            else
+            if(ge.lazy_big_endian)
+                ge.swap_endian(buf);
+        }
+        return buf;
+    }
     const unsigned char* get_data(unsigned short group,unsigned short element,unsigned int& length) const
     {
         std::map<unsigned int,unsigned int>::const_iterator iter =
@@ -1172,10 +1128,11 @@ public:
             length = 0;
             return 0;
         }
-        length = (unsigned int)data[iter->second].get().size();
+        const std::vector<unsigned char>& buf = get_element_data(data[iter->second]);
+        length = (unsigned int)buf.size();
         if (!length)
             return 0;
-        return (const unsigned char*)&*data[iter->second].get().begin();
+        return (const unsigned char*)&*buf.begin();
     }
 
     bool get_text(unsigned short group,unsigned short element,std::string& result) const
@@ -1194,7 +1151,7 @@ public:
         for(int i = 0;i < data.size();++i)
             if(data[i].group == group && data[i].element == element)
             {
-                auto& buf = data[i].get();
+                auto& buf = get_element_data(data[i]);
                 re += std::string(buf.begin(),buf.end());
             }
         result = re;
@@ -1439,6 +1396,119 @@ public:
         return get_int(0x0028,0x0103);
     }
 
+    // (0028,0008) number of frames
+    unsigned int get_frame_count(void) const
+    {
+        std::string frames;
+        if(!get_text(0x0028,0x0008,frames))
+            return 1;
+        unsigned int count = 1;
+        std::istringstream(frames) >> count;
+        return count ? count : 1;
+    }
+    // the first (group,element) in a list of elements and their sequences
+    static const dicom_group_element* find_element(const std::vector<dicom_group_element>& list,
+                                                   unsigned short group,unsigned short element)
+    {
+        for(const auto& ge : list)
+        {
+            if(ge.group == group && ge.element == element)
+                return &ge;
+            if(auto result = find_element(ge.sq_data,group,element))
+                return result;
+        }
+        return nullptr;
+    }
+    template<typename value_type>
+    static bool get_numbers(const std::vector<dicom_group_element>& list,
+                            unsigned short group,unsigned short element,value_type* values,int count)
+    {
+        auto ge = find_element(list,group,element);
+        if(!ge || ge->get().empty())
+            return false;
+        if(!ge->is_string())
+        {
+            ge->get_value(values[0]);
+            return true;
+        }
+        std::string text(ge->get().begin(),ge->get().end());
+        std::replace(text.begin(),text.end(),'\\',' ');
+        std::istringstream in(text);
+        for(int i = 0;i < count;++i)
+            in >> values[i];
+        return true;
+    }
+    /*
+     * the elements of each item of a sequence, starting at list[from]. An item
+     * holds its elements when it has a defined length, otherwise they follow
+     * it, and nested sequences of undefined length are skipped to their
+     * delimiters.
+     */
+    static void split_items(const std::vector<dicom_group_element>& list,size_t from,
+                            std::vector<std::vector<dicom_group_element> >& items)
+    {
+        int depth = 0;
+        for(size_t i = from;i < list.size();++i)
+        {
+            const dicom_group_element& ge = list[i];
+            if(ge.group == 0xFFFE && depth == 0)
+            {
+                if(ge.element == 0xE0DD)
+                    break;
+                if(ge.element == 0xE000)
+                    items.push_back(ge.sq_data);
+                continue;
+            }
+            if(ge.group == 0xFFFE && ge.element == 0xE0DD)
+                --depth;
+            else
+            if(ge.group != 0xFFFE && ge.undefined_length)
+                ++depth;
+            if(!items.empty())
+                items.back().push_back(ge);
+        }
+    }
+    // the items of a top-level sequence
+    bool get_items(unsigned short group,unsigned short element,std::vector<std::vector<dicom_group_element> >& items) const
+    {
+        items.clear();
+        auto iter = ge_map.find(((unsigned int)group << 16) | (unsigned int)element);
+        if(iter == ge_map.end())
+            return false;
+        if(data[iter->second].undefined_length)
+            split_items(data,iter->second+1,items);
+        else
+            split_items(data[iter->second].sq_data,0,items);
+        return !items.empty();
+    }
+    /*
+     * the items of the per-frame functional groups sequence (5200,9230), one
+     * per frame. Returns false if the image has no per-frame groups.
+     */
+    bool get_frame_info(std::vector<dicom_frame_info>& frames) const
+    {
+        frames.clear();
+        std::vector<std::vector<dicom_group_element> > items;
+        if(!get_items(0x5200,0x9230,items))
+            return false;
+        frames.resize(items.size());
+        for(size_t i = 0;i < items.size();++i)
+        {
+            get_numbers(items[i],0x0020,0x0032,frames[i].position,3);
+            get_numbers(items[i],0x0020,0x9057,&frames[i].stack_position,1);
+            get_numbers(items[i],0x0020,0x9128,&frames[i].temporal_index,1);
+        }
+        return !frames.empty();
+    }
+    // an attribute of the shared functional groups (5200,9229) or the per-frame groups of the first frame
+    template<typename value_type>
+    bool get_functional_group_numbers(unsigned short group,unsigned short element,value_type* values,int count) const
+    {
+        std::vector<std::vector<dicom_group_element> > items;
+        return (get_items(0x5200,0x9229,items) && get_numbers(items[0],group,element,values,count)) ||
+               (get_items(0x5200,0x9230,items) && get_numbers(items[0],group,element,values,count));
+    }
+
     void get_image_dimension(tipl::shape<2>& geo) const
     {
         geo[0] = width();
@@ -1473,11 +1543,16 @@ public:
     template<typename pointer_type>
     void save_to_buffer(pointer_type ptr,unsigned int pixel_count) const
     {
-        typedef typename std::iterator_traits<pointer_type>::value_type value_type;
+        std::shared_ptr<std::ifstream> in(input_io);
+        if(!in.get())
+        {
+            in = reopen_file();
+            in->seekg(std::streamoff(pixel_offset));
+        }
         if(is_compressed)
         {
             compressed_buf.resize(buf_size);
-            input_io->read((char*)&*(compressed_buf.begin()),buf_size);
+            in->read((char*)&*(compressed_buf.begin()),buf_size);
             if(encoding == "1.2.840.10008.1.2.4.70")
             {
                 std::vector<unsigned char> buf;
@@ -1495,46 +1570,73 @@ public:
             return;
         }
 
+        read_pixels(*in,ptr,pixel_count);
+    }
+    // reads one frame of an uncompressed multi-frame image through its own stream, so frames can be read in parallel
+    template<typename pointer_type>
+    bool save_frame_to_buffer(size_t frame,pointer_type ptr,size_t pixel_count) const
+    {
+        if(is_compressed || !pixel_offset || !reopen_file)
+            return false;
+        auto in = reopen_file();
+        in->seekg(std::streamoff(pixel_offset+frame*pixel_count*(get_bit_count()/8)));
+        read_pixels(*in,ptr,pixel_count);
+        return bool(*in);
+    }
+private:
+    // stored pixels are converted a chunk at a time, without a copy of the whole pixel data
+    template<typename pointer_type>
+    void read_pixels(std::istream& in,pointer_type ptr,size_t pixel_count) const
+    {
+        typedef typename std::iterator_traits<pointer_type>::value_type value_type;
         if(sizeof(value_type) == get_bit_count()/8)
-            input_io->read((char*)&*ptr,pixel_count*sizeof(value_type));
-        else
         {
-            std::vector<char> data(pixel_count*get_bit_count()/8);
-            input_io->read((char*)&(data[0]),data.size());
+            in.read((char*)&*ptr,pixel_count*sizeof(value_type));
+            return;
+        }
+        const size_t chunk_size = 1 << 16;
+        std::vector<char> data(std::min(pixel_count,chunk_size)*get_bit_count()/8);
+        for(size_t pos = 0;pos < pixel_count;pos += chunk_size)
+        {
+            size_t n = std::min(chunk_size,pixel_count-pos);
+            in.read((char*)&(data[0]),n*get_bit_count()/8);
+            pointer_type out = ptr+pos;
             switch (get_bit_count()) //bit count
             {
             case 8://DT_UNSIGNED_CHAR 2
-                std::copy((const unsigned char*)&(data[0]),(const unsigned char*)&(data[0])+pixel_count,ptr);
-                return;
+                std::copy((const unsigned char*)&(data[0]),(const unsigned char*)&(data[0])+n,out);
+                break;
             case 16://DT_SIGNED_SHORT 4
                 if(is_big_endian)
-                    change_endian((unsigned short*)&(data[0]),pixel_count);
+                    change_endian((unsigned short*)&(data[0]),n);
                 if(is_signed())
-                    std::copy((const short*)&(data[0]),(const short*)&(data[0])+pixel_count,ptr);
+                    std::copy((const short*)&(data[0]),(const short*)&(data[0])+n,out);
                 else
-                    std::copy((const unsigned short*)&(data[0]),(const unsigned short*)&(data[0])+pixel_count,ptr);
-                return;
+                    std::copy((const unsigned short*)&(data[0]),(const unsigned short*)&(data[0])+n,out);
+                break;
             case 32://DT_SIGNED_INT 8
                 if(is_big_endian)
-                    change_endian((unsigned int*)&(data[0]),pixel_count);
+                    change_endian((unsigned int*)&(data[0]),n);
                 if(is_signed())
-                    std::copy((const int*)&(data[0]),(const int*)&(data[0])+pixel_count,ptr);
+                    std::copy((const int*)&(data[0]),(const int*)&(data[0])+n,out);
                 else
-                    std::copy((const unsigned int*)&(data[0]),(const unsigned int*)&(data[0])+pixel_count,ptr);
-                return;
+                    std::copy((const unsigned int*)&(data[0]),(const unsigned int*)&(data[0])+n,out);
+                break;
             case 64://DT_DOUBLE 64
                 if(is_big_endian)
-                    change_endian((double*)&(data[0]),pixel_count);
-                std::copy((const double*)&(data[0]),(const double*)&(data[0])+pixel_count,ptr);
+                    change_endian((double*)&(data[0]),n);
+                std::copy((const double*)&(data[0]),(const double*)&(data[0])+n,out);
+                break;
+            default:
                 return;
             }
         }
     }
-
+public:
     template<typename image_type>
     void save_to_image(image_type& out) const
     {
-        if(!input_io.get() || !(*input_io))
+        if(!has_pixel_data())
             return;
         tipl::shape<image_type::dimension> geo;
         get_image_dimension(geo);
@@ -1677,6 +1779,11 @@ public:
 
             out << group_element_str << "=";
 
+            if(data[i].is_lazy())
+            {
+                out << data[i].lazy_size << " bytes";
+            }
+            else
             if(data[i].data.empty())
             {
                 out << "empty";
@@ -1723,10 +1830,16 @@ public:
     uint8_t dim_order[3]; // used to rotate the volume to axial view
     uint8_t flip[3];        // used to rotate the volume to axial view
     std::string error_msg;
+    // the frames of a multi-frame image in slice order, empty for one file per slice
+    std::vector<uint32_t> frame_order;
+    // the slices whose headers are read with their pixel data, see load_from_sorted_files
+    std::vector<std::string> file_names;
 
     void free_all(void)
     {
         dicom_reader.clear();
+        frame_order.clear();
+        file_names.clear();
     }
     void change_orientation(bool x,bool y,bool z)
     {
@@ -1751,42 +1864,50 @@ public:
     {
         std::copy(orientation_matrix,orientation_matrix+9,image_row_orientation);
     }
+    /*
+     * the headers are scanned in parallel up to the pixel data and the files
+     * are closed afterwards, get_untouched_image reopens them to read the
+     * pixel data of each slice in parallel
+     */
     bool load_from_files(const std::vector<std::string>& files)
     {
         if(files.empty())
             return false;
         free_all();
-        std::vector<int> image_num;
-        unsigned int w,h;
-        for (unsigned int index = 0;index < files.size();++index)
+        dicom_reader.resize(files.size());
+        std::vector<char> loaded(files.size());
+        par_for(files.size(),[&](size_t index)
         {
             std::shared_ptr<dicom> d(new dicom);
-            if (!d->load_from_file(files[index]))
+            loaded[index] = d->load_from_file(files[index]);
+            d->close();
+            dicom_reader[index] = d;
+        });
+        std::vector<int> image_num(files.size());
+        unsigned int w = dicom_reader.front()->width();
+        unsigned int h = dicom_reader.front()->height();
+        for (unsigned int index = 0;index < files.size();++index)
+        {
+            if (!loaded[index])
             {
                 error_msg = "failed to read ";
                 error_msg += files[index];
+                dicom_reader.clear();
                 return false;
             }
-            if(index)
+            if(dicom_reader[index]->width() != w || dicom_reader[index]->height() != h)
             {
-                if(d->width() != w || d->height() != h)
-                {
-                    error_msg = "inconsistent image dimension at ";
-                    error_msg += files[index];
-                    return false;
-                }
-            }
-            else
-            {
-                w = d->width();
-                h = d->height();
+                error_msg = "inconsistent image dimension at ";
+                error_msg += files[index];
+                dicom_reader.clear();
+                return false;
             }
-
             // get image sequence
-            image_num.push_back(0);
-            std::istringstream(d->get_image_num()) >> image_num.back();
-            dicom_reader.push_back(d);
+            std::istringstream(dicom_reader[index]->get_image_num()) >> image_num[index];
         }
+        if(dicom_reader.size() == 1 && dicom_reader.front()->get_frame_count() > 1 &&
+           !dicom_reader.front()->is_mosaic && !dicom_reader.front()->is_compressed)
+            return load_frames();
         // sort dicom according to the image num
         {
             auto order = tipl::arg_sort(image_num.size(),[&](uint32_t i,uint32_t j){return image_num[i] < image_num[j];});
@@ -1795,59 +1916,185 @@ public:
                 new_dicom_reader[i] = dicom_reader[order[i]];
             new_dicom_reader.swap(dicom_reader);
         }
-
+        dim = tipl::shape<3>(dicom_reader.front()->width(),
+                             dicom_reader.front()->height(),
+                             uint32_t(dicom_reader.size()));
+        dicom_reader.front()->get_voxel_size(vs);
+        dicom_reader.front()->get_image_orientation(orientation_matrix);
+        if(vs[2] == 0.0f)
+            vs[2] = std::fabs(dicom_reader[1]->get_slice_location()-
+                                              dicom_reader[0]->get_slice_location());
+        tipl::vector<3> pos1,pos2;
+        dicom_reader[0]->get_left_upper_pos(pos1.begin());
+        dicom_reader[1]->get_left_upper_pos(pos2.begin());
+        return set_slice_direction(pos1,pos2);
+    }
+    /*
+     * a series already sorted by image number, with the size and slice positions
+     * known (e.g. from dicom_index): only the header of the first file is read here.
+     * The headers of the other files are parsed by get_untouched_image when their
+     * pixel data are read, so get_dicom returns null for them. A slice that cannot
+     * be read or does not have the given size is left zero.
+     */
+    bool load_from_sorted_files(const std::vector<std::string>& files,unsigned int w,unsigned int h,
+                                const std::vector<tipl::vector<3> >& positions)
+    {
+        if(files.size() < 2 || positions.size() != files.size())
+            return load_from_files(files);
+        free_all();
+        std::shared_ptr<dicom> d(new dicom);
+        if(!d->load_from_file(files.front()) || d->width() != w || d->height() != h)
         {
-            dim = tipl::shape<3>(dicom_reader.front()->width(),
-                                 dicom_reader.front()->height(),
-                                 uint32_t(dicom_reader.size()));
-            dicom_reader.front()->get_voxel_size(vs);
-            dicom_reader.front()->get_image_orientation(orientation_matrix);
-            if(vs[2] == 0.0f)
-                vs[2] = std::fabs(dicom_reader[1]->get_slice_location()-
-                                                  dicom_reader[0]->get_slice_location());
-            // the last row of the orientation matrix should be derived from slice location
-            // otherwise, could be flipped in the saggital slices
-            {
-                tipl::vector<3> pos1,pos2;
-                dicom_reader[0]->get_left_upper_pos(pos1.begin());
-                dicom_reader[1]->get_left_upper_pos(pos2.begin());
-                if(pos1 == pos2)
-                {
-                    error_msg = "duplicated slices found.";
-                    return false;
-                }
-                orientation_matrix[6] = pos2[0]-pos1[0];
-                orientation_matrix[7] = pos2[1]-pos1[1];
-                orientation_matrix[8] = pos2[2]-pos1[2];
-            }
-            tipl::get_orientation(3,orientation_matrix,dim_order,flip);
-
+            error_msg = "failed to read ";
+            error_msg += files.front();
+            return false;
+        }
+        d->close();
+        dicom_reader.resize(files.size());
+        dicom_reader.front() = d;
+        file_names = files;
+        dim = tipl::shape<3>(w,h,uint32_t(files.size()));
+        d->get_voxel_size(vs);
+        d->get_image_orientation(orientation_matrix);
+        if(vs[2] == 0.0f)
+            vs[2] = float((positions[1]-positions[0]).length());
+        return set_slice_direction(positions[0],positions[1]);
+    }
+private:
+    // the last row of the orientation matrix should be derived from slice location
+    // otherwise, could be flipped in the saggital slices
+    bool set_slice_direction(const tipl::vector<3>& pos1,const tipl::vector<3>& pos2)
+    {
+        if(pos1 == pos2)
+        {
+            error_msg = "duplicated slices found.";
+            return false;
+        }
+        orientation_matrix[6] = pos2[0]-pos1[0];
+        orientation_matrix[7] = pos2[1]-pos1[1];
+        orientation_matrix[8] = pos2[2]-pos1[2];
+        tipl::get_orientation(3,orientation_matrix,dim_order,flip);
+        tipl::reorient_vector(vs,dim_order);
+        tipl::reorient_matrix(orientation_matrix,dim_order,flip);
+        return true;
+    }
+    /*
+     * an enhanced multi-frame image: the geometry comes from the functional
+     * groups, and the frames are sorted by temporal index and then by their
+     * position along the slice normal
+     */
+    bool load_frames(void)
+    {
+        const dicom& d = *dicom_reader.front();
+        std::vector<dicom_frame_info> frames;
+        if(!d.get_frame_info(frames) || frames.size() != d.get_frame_count())
+        {
+            error_msg = "invalid per-frame functional groups";
+            return false;
+        }
+        float orientation[6] = {1.0f,0.0f,0.0f,0.0f,1.0f,0.0f};
+        if(!d.get_image_row_orientation(orientation) || !d.get_image_col_orientation(orientation+3))
+            d.get_functional_group_numbers(0x0020,0x0037,orientation,6);
+        float spacing[2] = {1.0f,1.0f};
+        if(!d.get_functional_group_numbers(0x0028,0x0030,spacing,2))
+        {
+            d.get_voxel_size(vs);
+            spacing[0] = vs[1];
+            spacing[1] = vs[0];
+        }
+        tipl::vector<3> normal(orientation[1]*orientation[5]-orientation[2]*orientation[4],
+                               orientation[2]*orientation[3]-orientation[0]*orientation[5],
+                               orientation[0]*orientation[4]-orientation[1]*orientation[3]);
+        std::vector<float> distance(frames.size());
+        for(size_t i = 0;i < frames.size();++i)
+            distance[i] = normal*tipl::vector<3>(frames[i].position);
+        auto order = tipl::arg_sort(frames.size(),[&](uint32_t i,uint32_t j)
+        {
+            if(frames[i].temporal_index != frames[j].temporal_index)
+                return frames[i].temporal_index < frames[j].temporal_index;
+            return distance[i] < distance[j];
+        });
+        frame_order.assign(order.begin(),order.end());
+
+        dim = tipl::shape<3>(d.width(),d.height(),uint32_t(frames.size()));
+        vs[0] = spacing[1];
+        vs[1] = spacing[0];
+        vs[2] = std::fabs(distance[order[1]]-distance[order[0]]);
+        if(vs[2] == 0.0f)
+        {
+            error_msg = "duplicated slices found.";
+            return false;
         }
+        std::copy(orientation,orientation+6,orientation_matrix);
+        for(int i = 0;i < 3;++i)
+            orientation_matrix[6+i] = frames[order[1]].position[i]-frames[order[0]].position[i];
+        tipl::get_orientation(3,orientation_matrix,dim_order,flip);
         tipl::reorient_vector(vs,dim_order);
         tipl::reorient_matrix(orientation_matrix,dim_order,flip);
         return true;
     }
+    template<typename pointer_type>
+    void read_slice(size_t z,pointer_type ptr) const
+    {
+        if(!frame_order.empty())
+            dicom_reader.front()->save_frame_to_buffer(frame_order[z],ptr,dim.plane_size());
+        else
+        if(dicom_reader[z])
+            dicom_reader[z]->save_to_buffer(ptr,(unsigned int)dim.plane_size());
+        else
+        {
+            dicom d;
+            if(d.load_from_file(file_names[z]) && d.width() == dim[0] && d.height() == dim[1])
+                d.save_to_buffer(ptr,(unsigned int)dim.plane_size());
+            else
+                std::fill(ptr,ptr+dim.plane_size(),typename std::iterator_traits<pointer_type>::value_type(0));
+        }
+    }
+public:
     template<typename image_type>
     void get_untouched_image(image_type& source) const
     {
         if(dicom_reader.empty())
             return;
-        if(dicom_reader.size() == 1)
+        if(dicom_reader.size() == 1 && frame_order.empty())
             *dicom_reader.front() >> source;
         else
         {
             source.resize(dim);
-            for(size_t index = 0;index < dicom_reader.size();++index)
-                dicom_reader[index]->save_to_buffer(&*source.begin()+index*dim.plane_size(),dim.plane_size());
+            par_for(dim[2],[&](size_t index)
+            {
+                read_slice(index,&*source.begin()+index*dim.plane_size());
+            });
         }
     }
 
+    // each slice is read and written to its reoriented position, without an untouched copy of the volume
     template<typename image_type>
     void save_to_image(image_type& I) const
     {
-        tipl::image<3,typename image_type::value_type> buffer;
-        get_untouched_image(buffer);
-        tipl::reorder(buffer,I,dim_order,flip); // to LPS
+        if(dicom_reader.size() <= 1 && frame_order.empty())
+        {
+            tipl::image<3,typename image_type::value_type> buffer;
+            get_untouched_image(buffer);
+            tipl::reorder(buffer,I,dim_order,flip); // to LPS
+            return;
+        }
+        tipl::shape<3> new_geo;
+        int64_t origin[3],shift[3];
+        tipl::reorder_shift_index(dim,dim_order,flip,new_geo,origin,shift);
+        I.resize(new_geo);
+        par_for(dim[2],[&](size_t z)
+        {
+            std::vector<typename image_type::value_type> slice(dim.plane_size());
+            read_slice(z,&slice[0]);
+            int64_t y_index = origin[2]+int64_t(z)*shift[2]+origin[1];
+            for(size_t y = 0,i = 0;y < dim[1];++y,y_index += shift[1])
+            {
+                int64_t x_index = y_index+origin[0];
+                for(size_t x = 0;x < dim[0];++x,++i,x_index += shift[0])
+                    I[size_t(x_index)] = slice[i];
+            }
+        });
     }
 
     template<typename image_type>
@@ -0,0 +1,360 @@
+#ifndef DICOM_INDEX_HPP
+#define DICOM_INDEX_HPP
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+#include "dicom.hpp"
+#include "../utility/multi_thread.hpp"
+
+namespace tipl
+{
+
+namespace io
+{
+
+/*
+ * lists root/dir (dir is relative to root, empty for root itself). Files are
+ * added with their modification times and sub-directories are added to
+ * sub_dirs, all as paths relative to root. Symbolic links to directories are
+ * not followed.
+ */
+inline bool list_directory(const std::string& root,const std::string& dir,
+                           std::vector<std::string>& files,std::vector<int64_t>& mtimes,
+                           std::vector<std::string>& sub_dirs)
+{
+    std::string path = dir.empty() ? root : root + "/" + dir;
+    std::string prefix = dir.empty() ? std::string() : dir + "/";
+#ifdef _WIN32
+    WIN32_FIND_DATAA info;
+    HANDLE h = FindFirstFileA((path + "/*").c_str(),&info);
+    if(h == INVALID_HANDLE_VALUE)
+        return false;
+    do{
+        std::string name(info.cFileName);
+        if(name == "." || name == "..")
+            continue;
+        if(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            if(!(info.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+                sub_dirs.push_back(prefix + name);
+            continue;
+        }
+        files.push_back(prefix + name);
+        mtimes.push_back((int64_t(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime);
+    }while(FindNextFileA(h,&info));
+    FindClose(h);
+#else
+    DIR* d = opendir(path.c_str());
+    if(!d)
+        return false;
+    while(dirent* e = readdir(d))
+    {
+        std::string name(e->d_name);
+        if(name == "." || name == "..")
+            continue;
+        struct stat st;
+        std::string file_path = path + "/" + name;
+        if(lstat(file_path.c_str(),&st) != 0)
+            continue;
+        if(S_ISDIR(st.st_mode))
+        {
+            sub_dirs.push_back(prefix + name);
+            continue;
+        }
+        if(S_ISLNK(st.st_mode) && (stat(file_path.c_str(),&st) != 0 || !S_ISREG(st.st_mode)))
+            continue;
+        files.push_back(prefix + name);
+        mtimes.push_back(int64_t(st.st_mtime));
+    }
+    closedir(d);
+#endif
+    return true;
+}
+
+// all files under root, sorted by name, the directories of each level are listed in parallel
+inline void walk_directory(const std::string& root,std::vector<std::string>& files,std::vector<int64_t>& mtimes)
+{
+    std::vector<std::string> all_files;
+    std::vector<int64_t> all_mtimes;
+    std::vector<std::string> level(1);
+    while(!level.empty())
+    {
+        std::vector<std::vector<std::string> > level_files(level.size()),level_dirs(level.size());
+        std::vector<std::vector<int64_t> > level_mtimes(level.size());
+        par_for(level.size(),[&](size_t i)
+        {
+            list_directory(root,level[i],level_files[i],level_mtimes[i],level_dirs[i]);
+        });
+        std::vector<std::string> next_level;
+        for(size_t i = 0;i < level.size();++i)
+        {
+            all_files.insert(all_files.end(),level_files[i].begin(),level_files[i].end());
+            all_mtimes.insert(all_mtimes.end(),level_mtimes[i].begin(),level_mtimes[i].end());
+            next_level.insert(next_level.end(),level_dirs[i].begin(),level_dirs[i].end());
+        }
+        level.swap(next_level);
+    }
+    auto order = tipl::arg_sort(all_files.size(),[&](uint32_t i,uint32_t j){return all_files[i] < all_files[j];});
+    files.resize(order.size());
+    mtimes.resize(order.size());
+    for(size_t i = 0;i < order.size();++i)
+    {
+        files[i].swap(all_files[order[i]]);
+        mtimes[i] = all_mtimes[order[i]];
+    }
+}
+
+// the attributes of one file used to group, sort, and check the geometry of a series
+struct dicom_index_entry
+{
+    std::string file_name;      // relative to the indexed directory
+    int64_t mtime = 0;
+    bool is_dicom = false;      // other files are kept so that they are not scanned again
+    std::string series_uid;     // (0020,000E)
+    std::string series_name;    // series number and description, see dicom::get_sequence
+    int image_num = 0;          // (0020,0013)
+    uint32_t width = 0;
+    uint32_t height = 0;
+    float position[3] = {0.0f,0.0f,0.0f};   // (0020,0032)
+};
+
+/*
+ * dicom_index keeps the series attributes of every file in a directory tree,
+ * so that a large archive can be grouped and sorted without parsing the
+ * headers again:
+ *
+ *     tipl::io::dicom_index index;
+ *     index.load_from_file("study.idx");
+ *     if(index.update(dir))       // only new or modified files are scanned
+ *         index.save_to_file("study.idx");
+ *     auto series = index.get_series();
+ *     tipl::io::dicom_volume v;
+ *     index.open(series[0],v);
+ */
+class dicom_index
+{
+public:
+    std::string root;
+    std::vector<dicom_index_entry> entries;
+    std::string error_msg;
+private:
+    static const uint32_t version = 1;
+    static void write_string(std::ofstream& out,const std::string& s)
+    {
+        uint32_t size = uint32_t(s.size());
+        out.write((const char*)&size,sizeof(size));
+        out.write(s.data(),size);
+    }
+    static bool read_string(std::ifstream& in,std::string& s)
+    {
+        uint32_t size = 0;
+        if(!in.read((char*)&size,sizeof(size)) || size > (1 << 16))
+            return false;
+        s.resize(size);
+        return size == 0 || bool(in.read(&s[0],size));
+    }
+    void scan(dicom_index_entry& entry) const
+    {
+        dicom d;
+        entry.is_dicom = d.load_from_file(root + "/" + entry.file_name) && d.width() && d.height();
+        d.close();
+        if(!entry.is_dicom)
+            return;
+        d.get_text(0x0020,0x000E,entry.series_uid);
+        entry.series_uid.erase(std::remove(entry.series_uid.begin(),entry.series_uid.end(),' '),entry.series_uid.end());
+        entry.series_uid.erase(std::remove(entry.series_uid.begin(),entry.series_uid.end(),'\0'),entry.series_uid.end());
+        d.get_sequence(entry.series_name);
+        std::istringstream(d.get_image_num()) >> entry.image_num;
+        entry.width = d.width();
+        entry.height = d.height();
+        d.get_left_upper_pos(entry.position);
+    }
+public:
+    dicom_index(void){}
+    dicom_index(const std::string& root_):root(root_){}
+    /*
+     * walks root and scans, in parallel, the files that are new or whose
+     * modification time changed. The entries of removed files are dropped.
+     */
+    bool update(void)
+    {
+        std::vector<std::string> files;
+        std::vector<int64_t> mtimes;
+        walk_directory(root,files,mtimes);
+        if(files.empty())
+        {
+            error_msg = "no file found in ";
+            error_msg += root;
+            return false;
+        }
+        std::map<std::string,size_t> old_entries;
+        for(size_t i = 0;i < entries.size();++i)
+            old_entries[entries[i].file_name] = i;
+        std::vector<dicom_index_entry> new_entries(files.size());
+        std::vector<size_t> to_scan;
+        for(size_t i = 0;i < files.size();++i)
+        {
+            auto iter = old_entries.find(files[i]);
+            if(iter != old_entries.end() && entries[iter->second].mtime == mtimes[i])
+            {
+                new_entries[i] = entries[iter->second];
+                continue;
+            }
+            new_entries[i].file_name = files[i];
+            new_entries[i].mtime = mtimes[i];
+            to_scan.push_back(i);
+        }
+        par_for(to_scan.size(),[&](size_t i)
+        {
+            scan(new_entries[to_scan[i]]);
+        });
+        entries.swap(new_entries);
+        return true;
+    }
+    bool update(const std::string& root_)
+    {
+        if(root_ != root)
+        {
+            root = root_;
+            entries.clear();
+        }
+        return update();
+    }
+public:
+    bool save_to_file(const char* file_name) const
+    {
+        std::ofstream out(file_name,std::ios::binary);
+        if(!out)
+            return false;
+        uint32_t file_version = version;
+        out.write("TIPLDCMI",8);
+        out.write((const char*)&file_version,sizeof(file_version));
+        write_string(out,root);
+        uint32_t count = uint32_t(entries.size());
+        out.write((const char*)&count,sizeof(count));
+        for(const auto& e : entries)
+        {
+            write_string(out,e.file_name);
+            out.write((const char*)&e.mtime,sizeof(e.mtime));
+            char is_dicom = e.is_dicom;
+            out.write(&is_dicom,1);
+            if(!e.is_dicom)
+                continue;
+            write_string(out,e.series_uid);
+            write_string(out,e.series_name);
+            out.write((const char*)&e.image_num,sizeof(e.image_num));
+            out.write((const char*)&e.width,sizeof(e.width));
+            out.write((const char*)&e.height,sizeof(e.height));
+            out.write((const char*)e.position,sizeof(e.position));
+        }
+        return bool(out);
+    }
+    bool load_from_file(const char* file_name)
+    {
+        std::ifstream in(file_name,std::ios::binary);
+        char magic[8] = {0};
+        uint32_t file_version = 0,count = 0;
+        if(!in.read(magic,8) || std::string(magic,8) != "TIPLDCMI" ||
+           !in.read((char*)&file_version,sizeof(file_version)) || file_version != version ||
+           !read_string(in,root) ||
+           !in.read((char*)&count,sizeof(count)))
+        {
+            error_msg = "invalid index file";
+            return false;
+        }
+        std::vector<dicom_index_entry> new_entries(count);
+        for(auto& e : new_entries)
+        {
+            char is_dicom = 0;
+            if(!read_string(in,e.file_name) ||
+               !in.read((char*)&e.mtime,sizeof(e.mtime)) ||
+               !in.read(&is_dicom,1))
+            {
+                error_msg = "incomplete index file";
+                return false;
+            }
+            e.is_dicom = is_dicom;
+            if(!e.is_dicom)
+                continue;
+            if(!read_string(in,e.series_uid) ||
+               !read_string(in,e.series_name) ||
+               !in.read((char*)&e.image_num,sizeof(e.image_num)) ||
+               !in.read((char*)&e.width,sizeof(e.width)) ||
+               !in.read((char*)&e.height,sizeof(e.height)) ||
+               !in.read((char*)e.position,sizeof(e.position)))
+            {
+                error_msg = "incomplete index file";
+                return false;
+            }
+        }
+        entries.swap(new_entries);
+        return true;
+    }
+public:
+    // entries of each series (by series instance UID), sorted by image number
+    std::vector<std::vector<size_t> > get_series(void) const
+    {
+        std::map<std::string,std::vector<size_t> > groups;
+        for(size_t i = 0;i < entries.size();++i)
+            if(entries[i].is_dicom)
+                groups[entries[i].series_name + "/" + entries[i].series_uid].push_back(i);
+        std::vector<std::vector<size_t> > result;
+        for(auto& g : groups)
+        {
+            std::stable_sort(g.second.begin(),g.second.end(),[&](size_t i,size_t j)
+            {
+                return entries[i].image_num < entries[j].image_num;
+            });
+            result.push_back(g.second);
+        }
+        return result;
+    }
+    std::vector<std::string> get_files(const std::vector<size_t>& series) const
+    {
+        std::vector<std::string> files;
+        for(size_t i : series)
+            files.push_back(root + "/" + entries[i].file_name);
+        return files;
+    }
+    /*
+     * opens a series from get_series() in its indexed order and geometry: only
+     * the first header is parsed before the pixel data are read, see
+     * dicom_volume::load_from_sorted_files
+     */
+    bool open(const std::vector<size_t>& series,dicom_volume& volume) const
+    {
+        if(series.empty())
+            return false;
+        std::vector<tipl::vector<3> > positions;
+        for(size_t i : series)
+        {
+            if(entries[i].width != entries[series.front()].width ||
+               entries[i].height != entries[series.front()].height)
+            {
+                volume.error_msg = "inconsistent image dimension at ";
+                volume.error_msg += entries[i].file_name;
+                return false;
+            }
+            positions.push_back(tipl::vector<3>(entries[i].position));
+        }
+        return volume.load_from_sorted_files(get_files(series),
+                    entries[series.front()].width,entries[series.front()].height,positions);
+    }
+};
+
+}
+
+}
+#endif//DICOM_INDEX_HPP
@@ -1,6 +1,27 @@
 #ifndef IMAGE_IO_INTERFACE_HPP
 #define IMAGE_IO_INTERFACE_HPP
 #include <fstream>
+#include <cstring>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef USE_ZLIB
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include "../utility/multi_thread.hpp"
+#endif
 
 namespace tipl
 {
@@ -57,6 +78,166 @@ public:
     bool operator!() const	{return !in.good();}
 };
 
+/*
+ * mmap_istream maps the whole file read-only. read() copies out of the
+ * mapping, and map() gives a pointer into it, so a reader can use the stored
+ * data in place. Pages are loaded by the OS on first access, so opening a
+ * large file costs nothing until its data are used.
+ */
+class mmap_istream{
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    size_t pos = 0;
+    bool opened = false;
+    bool good = false;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+    static HANDLE open_file(const char* file_name)
+    {
+        return CreateFileA(file_name,GENERIC_READ,FILE_SHARE_READ,nullptr,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,nullptr);
+    }
+    static HANDLE open_file(const wchar_t* file_name)
+    {
+        return CreateFileW(file_name,GENERIC_READ,FILE_SHARE_READ,nullptr,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,nullptr);
+    }
+#endif
+public:
+    mmap_istream(void){}
+    mmap_istream(const mmap_istream&) = delete;
+    mmap_istream& operator=(const mmap_istream&) = delete;
+    ~mmap_istream(void){close();}
+    template<typename char_type>
+    bool open(const char_type* file_name)
+    {
+        close();
+#ifdef _WIN32
+        file = open_file(file_name);
+        if(file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER file_size;
+        if(!GetFileSizeEx(file,&file_size))
+            return false;
+        size_ = size_t(file_size.QuadPart);
+        if(size_)
+        {
+            mapping = CreateFileMapping(file,nullptr,PAGE_READONLY,0,0,nullptr);
+            if(!mapping)
+                return false;
+            data_ = (const char*)MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+            if(!data_)
+                return false;
+        }
+#else
+        int fd = ::open(file_name,O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat st;
+        if(fstat(fd,&st) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        size_ = size_t(st.st_size);
+        if(size_)
+        {
+            void* ptr = mmap(nullptr,size_,PROT_READ,MAP_SHARED,fd,0);
+            if(ptr == MAP_FAILED)
+            {
+                ::close(fd);
+                size_ = 0;
+                return false;
+            }
+            data_ = (const char*)ptr;
+        }
+        ::close(fd);
+#endif
+        opened = good = true;
+        return true;
+    }
+    void close(void)
+    {
+#ifdef _WIN32
+        if(data_)
+            UnmapViewOfFile(data_);
+        if(mapping)
+            CloseHandle(mapping);
+        if(file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if(data_)
+            munmap((void*)data_,size_);
+#endif
+        data_ = nullptr;
+        size_ = pos = 0;
+        opened = good = false;
+    }
+    bool read(void* buf,size_t size)
+    {
+        if(!good)
+            return false;
+        if(pos+size > size_)
+        {
+            if(pos < size_)
+                std::memcpy(buf,data_+pos,size_-pos);
+            pos = size_;
+            return good = false;
+        }
+        std::memcpy(buf,data_+pos,size);
+        pos += size;
+        return true;
+    }
+    // the stored bytes [pos,pos+size), or nullptr if they are not in the file
+    const char* map(size_t pos_,size_t size) const
+    {
+        return (data_ && pos_ <= size_ && size <= size_-pos_) ? data_+pos_ : nullptr;
+    }
+    void seek(size_t pos_)
+    {
+        pos = pos_;
+        if(pos > size_)
+        {
+            pos = size_;
+            good = false;
+        }
+    }
+    void seek_end(int pos_)
+    {
+        seek(size_t(int64_t(size_)+pos_));
+    }
+    size_t tell(void)
+    {
+        return pos;
+    }
+    void clear(void)
+    {
+        good = opened;
+    }
+    size_t size(void)
+    {
+        return size_;
+    }
+    void flush(void) const
+    {
+        ;
+    }
+    operator bool() const	{return good;}
+    bool operator!() const	{return !good;}
+};
+
+// streams without a mapping are read through read()
+template<typename stream_type>
+const char* map_stream(const stream_type&,size_t,size_t)
+{
+    return nullptr;
+}
+inline const char* map_stream(const mmap_istream& in,size_t pos,size_t size)
+{
+    return in.map(pos,size);
+}
+
 class std_ostream{
     std::ofstream out;
 public:
@@ -77,6 +258,381 @@ public:
     operator bool() const	{return out.good();}
     bool operator!() const	{return !out.good();}
 };
+
+#ifdef USE_ZLIB
+// gz streams for .nii.gz and other gzip files, define USE_ZLIB and link zlib to use them
+
+// true if the file name ends with .gz
+template<typename char_type>
+bool is_gz_file_name(const char_type* file_name)
+{
+    size_t length = 0;
+    while(file_name[length])
+        ++length;
+    return length >= 3 && file_name[length-3] == '.' && file_name[length-2] == 'g' && file_name[length-1] == 'z';
+}
+
+/*
+ * gz_istream inflates on a background thread that keeps up to read_ahead
+ * chunks ready, so decompression overlaps with the reader's conversion.
+ * Files without the gzip magic are read as they are. seek() skips forward by
+ * inflating; seeking back restarts from the beginning of the file.
+ */
+class gz_istream{
+    static constexpr size_t chunk_size = 1 << 20;
+    static constexpr size_t read_ahead = 4;
+    std::ifstream file;
+    bool opened = false;
+    bool good = false;
+    size_t pos = 0;
+    size_t size_ = 0;
+    std::vector<char> current;
+    size_t current_pos = 0;
+    // shared with the worker
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<std::vector<char> > ready;
+    bool done = false;
+    bool stop = false;
+private:
+    bool push(std::vector<char>& chunk)
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        cv.wait(lk,[&]{return stop || ready.size() < read_ahead;});
+        if(stop)
+            return false;
+        ready.push_back(std::vector<char>());
+        ready.back().swap(chunk);
+        cv.notify_all();
+        return true;
+    }
+    void produce(void)
+    {
+        std::vector<unsigned char> in(chunk_size/4);
+        unsigned char magic[2] = {0,0};
+        file.read(reinterpret_cast<char*>(magic),2);
+        size_t magic_size = size_t(file.gcount());
+        std::vector<char> out(chunk_size);
+        if(magic_size < 2 || magic[0] != 0x1f || magic[1] != 0x8b)
+        {
+            // not compressed
+            std::copy(magic,magic+magic_size,out.begin());
+            size_t out_size = magic_size;
+            while(file)
+            {
+                file.read(&out[out_size],std::streamsize(chunk_size-out_size));
+                out_size += size_t(file.gcount());
+                if(out_size == chunk_size || !file)
+                {
+                    out.resize(out_size);
+                    if(out.empty() || !push(out))
+                        break;
+                    out.resize(chunk_size);
+                    out_size = 0;
+                }
+            }
+        }
+        else
+        {
+            z_stream strm = {};
+            inflateInit2(&strm,15+16);
+            std::copy(magic,magic+2,in.begin());
+            strm.next_in = in.data();
+            strm.avail_in = 2;
+            strm.next_out = reinterpret_cast<Bytef*>(out.data());
+            strm.avail_out = uInt(chunk_size);
+            while(true)
+            {
+                if(!strm.avail_in && file)
+                {
+                    file.read(reinterpret_cast<char*>(in.data()),std::streamsize(in.size()));
+                    strm.next_in = in.data();
+                    strm.avail_in = uInt(file.gcount());
+                }
+                int r = inflate(&strm,Z_NO_FLUSH);
+                bool end = (r != Z_OK && r != Z_STREAM_END) || (r == Z_STREAM_END && !strm.avail_in && !file);
+                // concatenated gzip members
+                if(r == Z_STREAM_END && !end)
+                    inflateReset(&strm);
+                if(!strm.avail_out || end)
+                {
+                    out.resize(chunk_size-strm.avail_out);
+                    if((!out.empty() && !push(out)) || end)
+                        break;
+                    out.resize(chunk_size);
+                    strm.next_out = reinterpret_cast<Bytef*>(out.data());
+                    strm.avail_out = uInt(chunk_size);
+                }
+            }
+            inflateEnd(&strm);
+        }
+        std::lock_guard<std::mutex> lk(lock);
+        done = true;
+        cv.notify_all();
+    }
+    void stop_worker(void)
+    {
+        if(worker.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                stop = true;
+                cv.notify_all();
+            }
+            worker.join();
+        }
+        ready.clear();
+        current.clear();
+        current_pos = 0;
+        pos = 0;
+        done = stop = false;
+    }
+    void start_worker(void)
+    {
+        file.clear();
+        file.seekg(0,std::ios::beg);
+        worker = std::thread([this]{produce();});
+    }
+    // the next chunk, false at the end of the data
+    bool next_chunk(void)
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        cv.wait(lk,[&]{return done || !ready.empty();});
+        if(ready.empty())
+            return false;
+        current.swap(ready.front());
+        ready.pop_front();
+        current_pos = 0;
+        cv.notify_all();
+        return true;
+    }
+public:
+    gz_istream(void){}
+    gz_istream(const gz_istream&) = delete;
+    gz_istream& operator=(const gz_istream&) = delete;
+    ~gz_istream(void){stop_worker();}
+    template<typename char_type>
+    bool open(const char_type* file_name)
+    {
+        stop_worker();
+        file.close();
+        file.clear();
+        file.open(file_name,std::ios::binary);
+        opened = good = file.good();
+        if(!opened)
+            return false;
+        // the uncompressed size (modulo 2^32) is in the last four bytes of a gzip file
+        file.seekg(0,std::ios::end);
+        size_ = size_t(file.tellg());
+        if(is_gz_file_name(file_name) && size_ >= 4)
+        {
+            uint32_t isize = 0;
+            file.seekg(-4,std::ios::end);
+            file.read(reinterpret_cast<char*>(&isize),4);
+            size_ = isize;
+        }
+        start_worker();
+        return true;
+    }
+    bool read(void* buf,size_t size)
+    {
+        char* out = reinterpret_cast<char*>(buf);
+        while(size)
+        {
+            if(current_pos == current.size() && !next_chunk())
+                return good = false;
+            size_t n = std::min(size,current.size()-current_pos);
+            if(out)
+            {
+                std::copy(current.begin()+current_pos,current.begin()+current_pos+n,out);
+                out += n;
+            }
+            current_pos += n;
+            pos += n;
+            size -= n;
+        }
+        return good;
+    }
+    void seek(size_t pos_)
+    {
+        if(pos_ < pos)
+        {
+            stop_worker();
+            start_worker();
+        }
+        if(pos_ > pos)
+            read(nullptr,pos_-pos);
+    }
+    void seek_end(int pos_)
+    {
+        seek(size_t(int64_t(size_)+pos_));
+    }
+    size_t tell(void)
+    {
+        return pos;
+    }
+    void clear(void)
+    {
+        good = opened;
+    }
+    size_t size(void)
+    {
+        return size_;
+    }
+    void flush(void) const
+    {
+        ;
+    }
+    operator bool() const	{return good;}
+    bool operator!() const	{return !good;}
+};
+
+/*
+ * gz_ostream compresses .gz files with all threads, as pigz does: the data
+ * are cut into blocks that are deflated independently (each primed with the
+ * preceding 32K as its dictionary) and written in order as one gzip member.
+ * Other file names are written uncompressed. The stream is finished by
+ * close() or the destructor.
+ */
+class gz_ostream{
+    static constexpr size_t block_size = 1 << 17;
+    static constexpr size_t batch_size = 64;  // blocks compressed at a time
+    static constexpr size_t window_size = 1 << 15;
+    std::ofstream out;
+    bool compress = false;
+    int level;
+    std::vector<unsigned char> pending;
+    std::vector<unsigned char> dictionary;
+    uLong crc = 0;
+    size_t total = 0;
+private:
+    // data[0,size) follows dictionary, size is a multiple of block_size unless finish is set
+    void deflate_data(const unsigned char* data,size_t size,bool finish)
+    {
+        size_t block_count = (size+block_size-1)/block_size;
+        if(finish && !block_count)
+            block_count = 1;
+        for(size_t batch = 0;batch < block_count;batch += batch_size)
+        {
+            size_t count = std::min(size_t(batch_size),block_count-batch);
+            std::vector<std::vector<unsigned char> > compressed(count);
+            std::vector<uLong> block_crc(count);
+            par_for(count,[&](size_t i)
+            {
+                size_t from = (batch+i)*block_size;
+                size_t length = std::min(size,from+block_size)-std::min(size,from);
+                z_stream strm = {};
+                deflateInit2(&strm,level,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY);
+                if(from)
+                    deflateSetDictionary(&strm,data+from-std::min(from,size_t(window_size)),uInt(std::min(from,size_t(window_size))));
+                else
+                if(!dictionary.empty())
+                    deflateSetDictionary(&strm,dictionary.data(),uInt(dictionary.size()));
+                auto& buf = compressed[i];
+                buf.resize(deflateBound(&strm,uLong(length))+16);
+                strm.next_in = const_cast<Bytef*>(data+from);
+                strm.avail_in = uInt(length);
+                // a sync flush ends each block on a byte boundary so that blocks can be concatenated
+                int flush = (finish && batch+i+1 == block_count) ? Z_FINISH : Z_SYNC_FLUSH;
+                size_t out_size = 0;
+                while(true)
+                {
+                    strm.next_out = buf.data()+out_size;
+                    strm.avail_out = uInt(buf.size()-out_size);
+                    int r = deflate(&strm,flush);
+                    out_size = buf.size()-strm.avail_out;
+                    if(strm.avail_out || r == Z_STREAM_END)
+                        break;
+                    buf.resize(buf.size()*2);
+                }
+                buf.resize(out_size);
+                deflateEnd(&strm);
+                block_crc[i] = crc32(0L,data+from,uInt(length));
+            });
+            for(size_t i = 0;i < count;++i)
+            {
+                size_t from = (batch+i)*block_size;
+                size_t length = std::min(size,from+block_size)-std::min(size,from);
+                crc = crc32_combine(crc,block_crc[i],z_off_t(length));
+                out.write(reinterpret_cast<const char*>(compressed[i].data()),std::streamsize(compressed[i].size()));
+            }
+        }
+        total += size;
+        if(size >= window_size)
+            dictionary.assign(data+size-window_size,data+size);
+        else
+        {
+            dictionary.insert(dictionary.end(),data,data+size);
+            if(dictionary.size() > window_size)
+                dictionary.erase(dictionary.begin(),dictionary.end()-window_size);
+        }
+    }
+public:
+    gz_ostream(int level_ = Z_DEFAULT_COMPRESSION):level(level_){}
+    gz_ostream(const gz_ostream&) = delete;
+    gz_ostream& operator=(const gz_ostream&) = delete;
+    ~gz_ostream(void){close();}
+    template<typename char_type>
+    bool open(const char_type* file_name)
+    {
+        close();
+        out.open(file_name,std::ios::binary);
+        compress = is_gz_file_name(file_name);
+        if(compress && out)
+        {
+            // gzip header: deflate, no flags, no time, unknown OS
+            const unsigned char header[10] = {0x1f,0x8b,8,0,0,0,0,0,0,255};
+            out.write(reinterpret_cast<const char*>(header),10);
+            crc = crc32(0L,Z_NULL,0);
+            total = 0;
+        }
+        return out.good();
+    }
+    void write(const void* buf,size_t size)
+    {
+        if(!compress)
+        {
+            out.write((const char*)buf,std::streamsize(size));
+            return;
+        }
+        auto data = reinterpret_cast<const unsigned char*>(buf);
+        if(!pending.empty())
+        {
+            size_t n = std::min(size,block_size-pending.size());
+            pending.insert(pending.end(),data,data+n);
+            data += n;
+            size -= n;
+            if(pending.size() < block_size)
+                return;
+            deflate_data(pending.data(),pending.size(),false);
+            pending.clear();
+        }
+        // whole blocks are compressed from the caller's buffer
+        size_t n = size-size%block_size;
+        if(n)
+            deflate_data(data,n,false);
+        pending.assign(data+n,data+size);
+    }
+    void close(void)
+    {
+        if(!out.is_open())
+            return;
+        if(compress)
+        {
+            deflate_data(pending.data(),pending.size(),true);
+            pending.clear();
+            dictionary.clear();
+            uint32_t trailer[2] = {uint32_t(crc),uint32_t(total)};
+            out.write(reinterpret_cast<const char*>(trailer),8);
+            compress = false;
+        }
+        out.close();
+    }
+    operator bool() const	{return out.good();}
+    bool operator!() const	{return !out.good();}
+};
+#endif//USE_ZLIB
 }
 }
 
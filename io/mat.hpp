@@ -1,10 +1,11 @@
 #ifndef MAT_HPP
 #define MAT_HPP
+#include <cstdint>
 #include <vector>
 #include <fstream>
 #include <iterator>
 #include <sstream>
-#include <map>
+#include <unordered_map>
 #include "interface.hpp"
 namespace tipl
 {
@@ -76,7 +77,7 @@ private:
     std::string name;
 private:
     std::vector<unsigned char> data_buf;
-    void* data_ptr = nullptr; // for read
+    const void* data_ptr = nullptr; // data_buf, or the stored data in a mapped file
     size_t delay_read_pos = 0;
 private:
     void copy(const mat_matrix& rhs)
@@ -87,6 +88,10 @@ private:
         name = rhs.name;
         namelen = rhs.namelen;
         data_buf = rhs.data_buf;
+        // data in a mapping belong to the reader of rhs, keep a copy
+        if(data_buf.empty() && rhs.data_ptr)
+            data_buf.assign(reinterpret_cast<const unsigned char*>(rhs.data_ptr),
+                            reinterpret_cast<const unsigned char*>(rhs.data_ptr)+get_total_size(type));
         data_ptr = data_buf.empty() ? nullptr : &*data_buf.begin();
     }
 
@@ -191,7 +196,7 @@ public:
             copy_data(reinterpret_cast<unsigned char*>(new_data));
             break;
         }
-        std::swap(data_ptr,new_data);
+        data_ptr = new_data;
         allocator.swap(data_buf);
         type = get_type;
         return data_ptr;
@@ -229,7 +234,8 @@ public:
             goto read;
         }
         in.read(buf,sizeof(buf));
-        if (!in || type > 100 || type % 10 > 1)
+        // P (type/10) above 5 has no element size
+        if (!in || type > 100 || type % 10 > 1 || (type % 100)/10 > 5)
             return false;
         if (type % 10) // text
 	    type = 0;
@@ -243,6 +249,22 @@ public:
             name = &*buffer.begin();
         }
 
+        // mapped stream: use the stored data in place, or read them on first access if they are not aligned
+        if(const char* ptr = map_stream(in,in.tell(),get_total_size(type)))
+        {
+            size_t element_size = get_total_size(type)/(size_t(rows)*size_t(cols));
+            delay_read_pos = in.tell();
+            in.seek(delay_read_pos + get_total_size(type));
+            if(reinterpret_cast<uintptr_t>(ptr) % element_size == 0)
+            {
+                delay_read_pos = 0;
+                data_ptr = ptr;
+            }
+            else
+                data_ptr = nullptr;
+            return true;
+        }
+
         // first time, do not read the data
         if(delayed_read && get_total_size(type) > 16777216) // 16MB
         {
@@ -265,7 +287,7 @@ public:
             return false;
         }
         data_ptr = &*data_buf.begin();
-        in.read(reinterpret_cast<char*>(data_ptr),get_total_size(type));
+        in.read(reinterpret_cast<char*>(&*data_buf.begin()),get_total_size(type));
         return true;
     }
     template<typename stream_type>
@@ -326,12 +348,19 @@ public:
     }
 };
 
+/*
+ * With mmap_istream (mapped_mat_read), loading only walks the headers and
+ * records where each matrix is stored. read() of the stored type then returns
+ * a pointer into the mapping without copying, so opening a large file costs
+ * only the matrices that are used. The pointers are valid while the reader
+ * is open.
+ */
 template<typename input_interface = std_istream>
 class mat_read_base
 {
 private:
     std::vector<std::shared_ptr<mat_matrix> > dataset;
-    std::map<std::string,int> name_table;
+    std::unordered_map<std::string,unsigned int> name_table;
 private:
     void copy(const mat_read_base& rhs)
     {
@@ -381,7 +410,7 @@ public:
     }
     const void* read_as_type(const char* name,unsigned int& rows,unsigned int& cols,unsigned int type) const
     {
-        std::map<std::string,int>::const_iterator iter = name_table.find(name);
+        auto iter = name_table.find(name);
         if (iter == name_table.end())
             return nullptr;
         return read_as_type(iter->second,rows,cols,type);
@@ -440,6 +469,7 @@ public:
         if(!in->open(file_name))
             return false;
         dataset.clear();
+        name_table.clear();
         while(*in)
         {
             std::shared_ptr<mat_matrix> matrix(new mat_matrix);
@@ -616,6 +646,7 @@ public:
 
 typedef mat_write_base<> mat_write;
 typedef mat_read_base<> mat_read;
+typedef mat_read_base<mmap_istream> mapped_mat_read;
 
 
 
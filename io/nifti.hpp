@@ -32,10 +32,16 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sstream>
 #include <string>
 #include <memory>
+#include <functional>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
 #include <stdint.h>
 #include "interface.hpp"
 #include "../numerical/basic_op.hpp"
 #include "../numerical/numerical.hpp"
+#include "../utility/series_image.hpp"
 
 namespace tipl
 {
@@ -165,6 +171,14 @@ struct nifti_type_info<float>
     static const int16_t bit_pix = 32;
 };
 
+// half is stored as float
+template<>
+struct nifti_type_info<half>
+{
+    static const int16_t data_type = 16;
+    static const int16_t bit_pix = 32;
+};
+
 template<>
 struct nifti_type_info<double>
 {
@@ -336,9 +350,10 @@ public:
 private:
     bool big_endian;
 private:
-    std::vector<char> rgb_write_buf;
     const void* write_buf = 0;
     size_t write_size = 0;
+    // fills the stored bytes of count voxels starting at voxel from
+    std::function<void(size_t,size_t,char*)> write_converter;
 private:
     bool compatible(long type1,long type2) const
     {
@@ -633,7 +648,7 @@ public:
         tipl::shape<3> geo(nif_header2.dim+1);
         size_t volume_size = byte_per_pixel*geo.size();
         input_stream->clear();
-        input_stream->seek(size_t(nif_header.vox_offset)+i*volume_size);
+        input_stream->seek(voxel_offset()+i*volume_size);
         return (*input_stream);
     }
     template<typename shape_type>
@@ -777,6 +792,52 @@ public:
         is_nii = true;
         set_voxel_size(tipl::vector<3>(1.0f,1.0f,1.0f));
     }
+private:
+    // rgb is written as 24-bit, half as float, other types as they are
+    static void encode_voxels(const tipl::rgb* in,size_t count,char* out)
+    {
+        for(size_t i = 0;i < count;++i,out += 3)
+        {
+            out[0] = char(in[i].r);
+            out[1] = char(in[i].g);
+            out[2] = char(in[i].b);
+        }
+    }
+    static void encode_voxels(const half* in,size_t count,char* out)
+    {
+        half_to_float(in,reinterpret_cast<float*>(out),count);
+    }
+    template<typename value_type>
+    static void encode_voxels(const value_type* in,size_t count,char* out)
+    {
+        std::memcpy(out,in,count*sizeof(value_type));
+    }
+    // converted types are encoded chunk by chunk while the file is written
+    template<typename image_type>
+    void set_write_buf(const image_type& source,tipl::rgb)
+    {
+        set_write_converter(&*source.begin());
+    }
+    template<typename image_type>
+    void set_write_buf(const image_type& source,half)
+    {
+        set_write_converter(&*source.begin());
+    }
+    template<typename image_type,typename value_type>
+    void set_write_buf(const image_type& source,value_type)
+    {
+        write_buf = &*source.begin();
+        write_converter = nullptr;
+    }
+    template<typename value_type>
+    void set_write_converter(const value_type* in)
+    {
+        write_buf = in;
+        write_converter = [in](size_t from,size_t count,char* out)
+        {
+            encode_voxels(in+from,count,out);
+        };
+    }
 public:
     template<int dimension>
     void get_image_dimension(shape<dimension>& geo) const
@@ -799,22 +860,36 @@ public:
 
         set_dim(source.shape());
         write_size = source.size()*(size_t)(nif_header2.bitpix/8);
-        if(nif_header2.datatype == 128 && nif_header2.bitpix == 24)
-        {
-            rgb_write_buf.resize(source.size()*3);
-            for(size_t i = 0,j = 0; i < source.size();++i,j += 3)
-            {
-                tipl::rgb c = source[i];
-                rgb_write_buf[j] = c.r;
-                rgb_write_buf[j+1] = c.g;
-                rgb_write_buf[j+2] = c.b;
-            }
-            write_buf = &*rgb_write_buf.begin();
-        }
-        else
-            write_buf = &*source.begin();
+        set_write_buf(source,typename image_type::value_type());
         is_nii = true;
     }
+    // int16 with scl_slope and scl_inter
+    template<int dim>
+    void load_from_image(const scaled_image<dim>& source)
+    {
+        load_from_image(static_cast<const image<dim,int16_t>&>(source));
+        nif_header.scl_slope = nif_header2.scl_slope = source.slope;
+        nif_header.scl_inter = nif_header2.scl_inter = source.inter;
+    }
+
+    // NIfTI stores volume by volume, a voxel_major series is gathered chunk by chunk while it is written
+    template<typename vtype>
+    void load_from_image(const series_image<vtype>& source)
+    {
+        load_from_image(make_image(&*source.begin(),source.shape()));
+        if(source.layout() == volume_major)
+            return;
+        const vtype* in = &*source.begin();
+        size_t V = source.voxel_count();
+        size_t n = source.volume_count();
+        write_converter = [in,V,n](size_t from,size_t count,char* out)
+        {
+            std::vector<vtype> buf(count);
+            for(size_t i = 0,j = from;i < count;++i,++j)
+                buf[i] = in[(j%V)*n+j/V];
+            encode_voxels(&buf[0],count,out);
+        };
+    }
 
     template<typename char_type,typename image_type,typename vs_type>
     static bool load_from_file(const char_type* pfile_name,image_type& I,vs_type& vs)
@@ -849,11 +924,20 @@ public:
             nii.set_descrip(descript);
         return nii.save_to_file(pfile_name);
     }
-    template<typename char_type>
-    bool save_to_file(const char_type* pfile_name)
+    template<typename char_type,typename image_type,typename vs_type,typename srow_type>
+    static std::future<bool> save_to_file_async(const char_type* pfile_name,const image_type& I,const vs_type& vs,const srow_type& T,const char* descript = nullptr)
+    {
+        nifti_base nii;
+        nii.set_voxel_size(vs);
+        nii.set_image_transformation(T);
+        nii.load_from_image(I);
+        if(descript)
+            nii.set_descrip(descript);
+        return nii.save_to_file_async(pfile_name);
+    }
+private:
+    void prepare_header_for_write(void)
     {
-        if(!write_buf)
-            return false;
         if (!is_nii)// is the header from the analyze format?
         {
             //yes, then change the header to the NIFTI format
@@ -865,111 +949,308 @@ public:
             nif_header.magic[2] = '1';
             nif_header.magic[3] = 0;
         }
+    }
+    static const size_t write_chunk_size = 1 << 22;
+    static constexpr size_t write_ring_size = 3;
+    /*
+     * Images that need conversion are encoded into a ring of write_ring_size
+     * chunks by the calling thread while a writer thread writes (and, for
+     * gz, compresses) the filled ones, so the extra memory is at most
+     * write_ring_size*write_chunk_size bytes.
+     */
+    template<typename char_type>
+    static bool write_file(const char_type* pfile_name,const nifti_1_header& header,
+                           const void* buf,size_t size,
+                           const std::function<void(size_t,size_t,char*)>& converter)
+    {
         output_interface out;
         if(!out.open(pfile_name))
             return false;
-        out.write((const char*)&nif_header,sizeof(nif_header));
+        out.write((const char*)&header,sizeof(header));
         int padding = 0;
         out.write((const char*)&padding,4);
-        out.write((const char*)write_buf,write_size);
+        if(!converter)
+        {
+            out.write((const char*)buf,size);
+            return out;
+        }
+        size_t voxel_bytes = size_t(header.bitpix/8);
+        size_t voxel_count = size/voxel_bytes;
+        size_t chunk_voxels = std::max<size_t>(1,write_chunk_size/voxel_bytes);
+        size_t chunk_count = (voxel_count+chunk_voxels-1)/chunk_voxels;
+        std::vector<std::vector<char> > ring(std::min(size_t(write_ring_size),chunk_count),
+                                             std::vector<char>(chunk_voxels*voxel_bytes));
+        std::mutex m;
+        std::condition_variable cv;
+        size_t filled = 0,written = 0;
+        bool failed = false;
+        std::thread writer([&]()
+        {
+            for(size_t i = 0;i < chunk_count;++i)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(m);
+                    cv.wait(lock,[&](){return filled > i;});
+                }
+                out.write(&ring[i%ring.size()][0],std::min(chunk_voxels,voxel_count-i*chunk_voxels)*voxel_bytes);
+                bool good = out;
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    written = i+1;
+                    failed = !good;
+                }
+                cv.notify_all();
+                if(!good)
+                    return;
+            }
+        });
+        for(size_t i = 0;i < chunk_count;++i)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv.wait(lock,[&](){return failed || i-written < ring.size();});
+                if(failed)
+                    break;
+            }
+            size_t from = i*chunk_voxels;
+            converter(from,std::min(chunk_voxels,voxel_count-from),&ring[i%ring.size()][0]);
+            {
+                std::lock_guard<std::mutex> lock(m);
+                filled = i+1;
+            }
+            cv.notify_all();
+        }
+        writer.join();
+        return !failed && out;
+    }
+public:
+    template<typename char_type>
+    bool save_to_file(const char_type* pfile_name)
+    {
+        if(!write_buf)
+            return false;
+        prepare_header_for_write();
+        bool result = write_file(pfile_name,nif_header,write_buf,write_size,write_converter);
         write_buf = 0;
-        return out;
+        return result;
+    }
+    /*
+     * writes the file on another thread and returns at once. The header is
+     * copied, but the image given to load_from_image is read while writing
+     * and must stay unchanged until the future is ready.
+     */
+    template<typename char_type>
+    std::future<bool> save_to_file_async(const char_type* pfile_name)
+    {
+        if(!write_buf)
+        {
+            std::promise<bool> result;
+            result.set_value(false);
+            return result.get_future();
+        }
+        prepare_header_for_write();
+        std::basic_string<char_type> file_name(pfile_name);
+        nifti_1_header header = nif_header;
+        const void* buf = write_buf;
+        size_t size = write_size;
+        std::function<void(size_t,size_t,char*)> converter = write_converter;
+        write_buf = 0;
+        return std::async(std::launch::async,[file_name,header,buf,size,converter]()
+        {
+            return write_file(file_name.c_str(),header,buf,size,converter);
+        });
     }
     template<typename iterator_type1,typename iterator_type2,typename int_type>
     static void copy_ptr(iterator_type1 iter1,iterator_type2 iter2,int_type size)
     {
-        for(iterator_type1 end = iter1+size; iter1 != end; ++iter1,++iter2)
-            *iter2 = typename std::iterator_traits<iterator_type2>::value_type(*iter1);
+        typedef typename std::iterator_traits<iterator_type2>::value_type value_type;
+        size_t i = 0;
+        // groups of eight independent conversions compile to vector instructions
+        for(;i+8 <= size_t(size);i += 8)
+            for(size_t k = 0;k < 8;++k)
+                iter2[i+k] = value_type(iter1[i+k]);
+        for(;i < size_t(size);++i)
+            iter2[i] = value_type(iter1[i]);
+    }
+    static void copy_ptr(const float* iter1,half* iter2,size_t size)
+    {
+        float_to_half(iter1,iter2,size);
+    }
+
+private:
+    template<typename T>
+    static T swapped(T value)
+    {
+        unsigned char* p = reinterpret_cast<unsigned char*>(&value);
+        std::reverse(p,p+sizeof(T));
+        return value;
     }
-    template<typename lhs_type,typename rhs_type>
-    static void copy_data(const void* lhs,rhs_type rhs,size_t size)
+    static uint16_t swapped(uint16_t v){return uint16_t((v >> 8) | (v << 8));}
+    static uint32_t swapped(uint32_t v){return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);}
+    static uint64_t swapped(uint64_t v){return (uint64_t(swapped(uint32_t(v))) << 32) | swapped(uint32_t(v >> 32));}
+    // byte-swap n values of type T through the unsigned integer of the same size
+    template<typename T>
+    static void swap_block(const T* in,T* out,size_t n)
     {
-        copy_ptr(reinterpret_cast<const lhs_type*>(lhs),rhs,size);
+        using uint_type = typename std::conditional<sizeof(T) == 2,uint16_t,
+                          typename std::conditional<sizeof(T) == 4,uint32_t,uint64_t>::type>::type;
+        if(sizeof(T) == 1)
+        {
+            std::copy(in,in+n,out);
+            return;
+        }
+        for(size_t i = 0;i < n;++i)
+        {
+            uint_type u;
+            std::memcpy(&u,in+i,sizeof(T));
+            u = swapped(u);
+            std::memcpy(static_cast<void*>(out+i),&u,sizeof(T));
+        }
     }
-    static void copy_data(const float* lhs,unsigned char* rhs,size_t size)
+    template<typename T>
+    static void scale_block(T* out,size_t n,double slope,double inter,std::true_type)
     {
-        tipl::normalize(lhs,lhs+size,rhs);
+        T s = T(slope),b = T(inter);
+        size_t i = 0;
+        for(;i+8 <= n;i += 8)
+            for(size_t k = 0;k < 8;++k)
+                out[i+k] = out[i+k]*s+b;
+        for(;i < n;++i)
+            out[i] = out[i]*s+b;
     }
-    static void copy_data(const double* lhs,unsigned char* rhs,size_t size)
+    template<typename T>
+    static void scale_block(T*,size_t,double,double,std::false_type){}
+    static constexpr size_t convert_block_size = 1 << 13;
+    /*
+     * converts n stored values of in_type to out, block by block over threads:
+     * each block is byte-swapped (if swap is set), converted, and scaled
+     * (floating-point outputs, if slope != 0) while it is in cache
+     */
+    template<typename in_type,typename out_type>
+    static void convert_data(const void* in,out_type* out,size_t n,bool swap,double slope,double inter)
     {
-        tipl::normalize(lhs,lhs+size,rhs);
+        auto from = reinterpret_cast<const in_type*>(in);
+        par_for((n+convert_block_size-1)/convert_block_size,[&](size_t block)
+        {
+            size_t pos = block*convert_block_size;
+            size_t size = std::min(size_t(convert_block_size),n-pos);
+            if(swap)
+            {
+                in_type buf[convert_block_size];
+                swap_block(from+pos,buf,size);
+                copy_ptr(buf,out+pos,size);
+            }
+            else
+                copy_ptr(from+pos,out+pos,size);
+            if(slope != 0.0)
+                scale_block(out+pos,size,slope,inter,std::is_floating_point<out_type>());
+        });
     }
-
+    // the same type, swapped and scaled in place
+    template<typename out_type>
+    static void convert_in_place(out_type* out,size_t n,bool swap,double slope,double inter)
+    {
+        if(!swap && (slope == 0.0 || !std::is_floating_point<out_type>::value))
+            return;
+        par_for((n+convert_block_size-1)/convert_block_size,[&](size_t block)
+        {
+            size_t pos = block*convert_block_size;
+            size_t size = std::min(size_t(convert_block_size),n-pos);
+            if(swap)
+                swap_block(out+pos,out+pos,size);
+            if(slope != 0.0)
+                scale_block(out+pos,size,slope,inter,std::is_floating_point<out_type>());
+        });
+    }
+    /*
+     * reads pixel_count voxels from the current position into ptr, converted to
+     * its value type. With scale set, scl_slope/scl_inter are applied: during
+     * the conversion for floating-point outputs, afterwards for other types.
+     */
     template<typename pointer_type>
-    bool save_to_buffer(pointer_type ptr,size_t pixel_count) const
+    bool read_data(pointer_type ptr,size_t pixel_count,bool scale) const
     {
         const size_t byte_per_pixel = nif_header2.bitpix/8;
         typedef typename std::iterator_traits<pointer_type>::value_type value_type;
-        if(compatible(nifti_type_info<value_type>::data_type,nif_header2.datatype))
+        double slope = scale ? nif_header2.scl_slope : 0.0;
+        double inter = scale ? nif_header2.scl_inter : 0.0;
+        value_type* out = &*ptr;
+        if(compatible(nifti_type_info<value_type>::data_type,nif_header2.datatype) &&
+           sizeof(value_type) == byte_per_pixel)
         {
-            if(!input_stream->read((char*)&*ptr,pixel_count*byte_per_pixel))
+            if(!input_stream->read((char*)out,pixel_count*byte_per_pixel))
                 return false;
-            if (big_endian)
-                change_endian(&*ptr,pixel_count);
-            return true;
+            convert_in_place(out,pixel_count,big_endian,slope,inter);
         }
         else
         {
-            std::vector<char> buf(pixel_count*byte_per_pixel);
-            if(buf.empty())
-                return false;
-            void* buf_ptr = &*buf.begin();
-            if(!input_stream->read((char*)buf_ptr,buf.size()))
+            size_t buf_size = pixel_count*byte_per_pixel;
+            if(!buf_size)
                 return false;
-            if (big_endian)
+            // a mapped file is converted in place
+            std::vector<char> buf;
+            const char* buf_ptr = map_stream(*input_stream,input_stream->tell(),buf_size);
+            if(buf_ptr)
+                input_stream->seek(input_stream->tell()+buf_size);
+            else
             {
-                switch (byte_per_pixel)
-                {
-                    case 2:
-                        change_endian<int16_t>(buf_ptr,buf.size()/2);
-                        break;
-                    case 4:
-                        change_endian<int32_t>(buf_ptr,buf.size()/4);
-                        break;
-                    case 8:
-                        change_endian<double>(buf_ptr,buf.size()/8);
-                        break;
-                }
+                buf.resize(buf_size);
+                if(!input_stream->read(&*buf.begin(),buf_size))
+                    return false;
+                buf_ptr = &*buf.begin();
             }
             switch (nif_header2.datatype)
             {
             case 2://DT_UNSIGNED_CHAR 2
-                copy_data<unsigned char>(buf_ptr,ptr,pixel_count);
+                convert_data<unsigned char>(buf_ptr,out,pixel_count,big_endian,slope,inter);
                 break;
             case 4://DT_SIGNED_SHORT 4
-                copy_data<int16_t>(buf_ptr,ptr,pixel_count);
+                convert_data<int16_t>(buf_ptr,out,pixel_count,big_endian,slope,inter);
                 break;
             case 8://DT_SIGNED_INT 8
-                copy_data<int32_t>(buf_ptr,ptr,pixel_count);
+                convert_data<int32_t>(buf_ptr,out,pixel_count,big_endian,slope,inter);
                 break;
             case 16://DT_FLOAT 16
-                copy_data<float>(buf_ptr,ptr,pixel_count);
+                convert_data<float>(buf_ptr,out,pixel_count,big_endian,slope,inter);
                 break;
             case 64://DT_DOUBLE 64
-                copy_data<double>(buf_ptr,ptr,pixel_count);
+                convert_data<double>(buf_ptr,out,pixel_count,big_endian,slope,inter);
                 break;
             case 128://DT_RGB
-                for(size_t index = 0;index < buf.size();index +=3,++ptr)
-                    *ptr = uint32_t(tipl::rgb(buf[index],buf[index+1],buf[index+2]));
+                for(size_t index = 0;index < buf_size;index +=3,++out)
+                    *out = uint32_t(tipl::rgb(buf_ptr[index],buf_ptr[index+1],buf_ptr[index+2]));
+                out -= pixel_count;
                 break;
             case 256: // DT_INT8
-                copy_data<char>(buf_ptr,ptr,pixel_count);
+                convert_data<char>(buf_ptr,out,pixel_count,big_endian,slope,inter);
                 break;
             case 512: // DT_UINT16
-                copy_data<uint16_t>(buf_ptr,ptr,pixel_count);
+                convert_data<uint16_t>(buf_ptr,out,pixel_count,big_endian,slope,inter);
                 break;
             case 768: // DT_UINT32
-                copy_data<uint32_t>(buf_ptr,ptr,pixel_count);
+                convert_data<uint32_t>(buf_ptr,out,pixel_count,big_endian,slope,inter);
                 break;
-            case 1024: // DT_UINT32
-                copy_data<int64_t>(buf_ptr,ptr,pixel_count);
+            case 1024: // DT_INT64
+                convert_data<int64_t>(buf_ptr,out,pixel_count,big_endian,slope,inter);
                 break;
-            case 1280: // DT_UINT32
-                copy_data<uint64_t>(buf_ptr,ptr,pixel_count);
+            case 1280: // DT_UINT64
+                convert_data<uint64_t>(buf_ptr,out,pixel_count,big_endian,slope,inter);
                 break;
             }
-            return true;
         }
+        if(slope != 0.0 && !std::is_floating_point<value_type>::value)
+        {
+            tipl::multiply_constant(out,out+pixel_count,slope);
+            tipl::add_constant(out,out+pixel_count,inter);
+        }
+        return true;
+    }
+public:
+    // reads pixel_count voxels as stored (without scl_slope/scl_inter)
+    template<typename pointer_type>
+    bool save_to_buffer(pointer_type ptr,size_t pixel_count) const
+    {
+        return read_data(ptr,pixel_count,false);
     }
 
     bool has_data(void) const
@@ -985,16 +1266,190 @@ public:
         if(!has_data())
             return false;
         out.resize(tipl::shape<image_type::dimension>(nif_header2.dim+1));
-        if(!save_to_buffer(out.begin(),out.size()))
+        return read_data(out.begin(),out.size(),true);
+    }
+
+    /*
+     * int16 data are kept as stored with the scl_slope and scl_inter of the
+     * header, other data types are quantized over their value range
+     */
+    template<int dim>
+    bool get_untouched_image(scaled_image<dim>& out) const
+    {
+        if(!has_data())
             return false;
-        if(nif_header2.scl_slope != 0)
+        if(nif_header2.datatype != 4)
         {
-            tipl::multiply_constant(out,nif_header2.scl_slope);
-            tipl::add_constant(out,nif_header2.scl_inter);
+            image<dim,float> I;
+            if(!get_untouched_image(I))
+                return false;
+            out.load_from_image(I);
+            return true;
         }
+        out.resize(tipl::shape<dim>(nif_header2.dim+1));
+        if(!save_to_buffer(out.begin(),out.size()))
+            return false;
+        out.slope = nif_header2.scl_slope == 0.0 ? 1.0f : float(nif_header2.scl_slope);
+        out.inter = nif_header2.scl_slope == 0.0 ? 0.0f : float(nif_header2.scl_inter);
         return true;
     }
 
+    /*
+     * Partial reads. Only the requested voxels are read and converted, and the
+     * stream is only moved forward between reads, so a compressed stream can
+     * skip instead of seeking back. The images are as stored, like
+     * get_untouched_image.
+     */
+    // volume t of a 4D file
+    template<typename image_type>
+    bool get_volume(size_t t,image_type& out)
+    {
+        return get_volumes(t,t+1,out);
+    }
+    // volumes [from,to) into a 4D image, or volume from into a 3D image
+    template<typename image_type>
+    bool get_volumes(size_t from,size_t to,image_type& out)
+    {
+        if(!has_data() || to <= from)
+            return false;
+        tipl::shape<3> geo(nif_header2.dim+1);
+        tipl::shape<image_type::dimension> out_geo;
+        std::copy(geo.begin(),geo.begin()+std::min<int>(3,int(image_type::dimension)),out_geo.begin());
+        if(image_type::dimension == 4)
+            out_geo[image_type::dimension-1] = uint32_t(to-from);
+        out.resize(out_geo);
+        return select_volume(from) && read_data(out.begin(),out.size(),true);
+    }
+    // slices [z_from,z_to) of volume t
+    template<typename image_type>
+    bool get_slab(size_t t,unsigned int z_from,unsigned int z_to,image_type& out)
+    {
+        unsigned int from[3] = {0,0,z_from};
+        unsigned int to[3] = {uint32_t(nif_header2.dim[1]),uint32_t(nif_header2.dim[2]),z_to};
+        return get_region(t,from,to,out);
+    }
+    // the box [from,to) of volume t
+    template<typename image_type,typename pos_type>
+    bool get_region(size_t t,const pos_type& from,const pos_type& to,image_type& out)
+    {
+        if(!has_data())
+            return false;
+        tipl::shape<3> geo(nif_header2.dim+1);
+        tipl::shape<3> out_geo;
+        for(int d = 0;d < 3;++d)
+        {
+            if(to[d] <= from[d] || size_t(to[d]) > geo[d])
+                return false;
+            out_geo[d] = uint32_t(to[d]-from[d]);
+        }
+        out.resize(out_geo);
+        const size_t byte_per_pixel = nif_header2.bitpix/8;
+        size_t volume_pos = voxel_offset()+t*geo.size()*byte_per_pixel;
+        // whole rows of a slice are read at once
+        bool full_row = out_geo[0] == geo[0];
+        size_t rows = full_row ? 1 : out_geo[1];
+        size_t row_size = full_row ? out_geo.plane_size() : out_geo[0];
+        auto out_iter = out.begin();
+        input_stream->clear();
+        for(size_t z = 0;z < out_geo[2];++z)
+            for(size_t y = 0;y < rows;++y,out_iter += row_size)
+            {
+                size_t voxel = size_t(from[0])+(size_t(from[1])+y)*geo[0]+(size_t(from[2])+z)*geo.plane_size();
+                input_stream->seek(volume_pos+voxel*byte_per_pixel);
+                if(!read_data(out_iter,row_size,true))
+                    return false;
+            }
+        return true;
+    }
+    // offset of the voxel data in the data file (the .nii file or the .img file)
+    size_t voxel_offset(void) const
+    {
+        if(is_nii2)
+            return size_t(nif_header2.vox_offset);
+        return (is_nii && nif_header.magic[1] == '+') ? size_t(nif_header.vox_offset) : 0;
+    }
+    /*
+     * points out at the stored voxels of a memory-mapped file (see mmap_istream),
+     * without copying. This needs a little-endian file whose datatype matches
+     * vtype and without scaling; the image is as stored, like get_untouched_image.
+     */
+    template<int dim,typename vtype>
+    bool get_mapped_image(const_pointer_image<dim,vtype>& out) const
+    {
+        if(!has_data() || big_endian ||
+           !compatible(nifti_type_info<vtype>::data_type,nif_header2.datatype) ||
+           sizeof(vtype)*8 != size_t(nif_header2.bitpix) ||
+           (nif_header2.scl_slope != 0.0 && (nif_header2.scl_slope != 1.0 || nif_header2.scl_inter != 0.0)))
+            return false;
+        tipl::shape<dim> geo(nif_header2.dim+1);
+        const char* ptr = map_stream(*input_stream,voxel_offset(),geo.size()*sizeof(vtype));
+        if(!ptr)
+            return false;
+        out = const_pointer_image<dim,vtype>(reinterpret_cast<const vtype*>(ptr),geo);
+        return true;
+    }
+    // the mapped voxels if possible, otherwise a converted copy kept in buffer
+    template<int dim,typename vtype>
+    bool get_mapped_image(const_pointer_image<dim,vtype>& out,image<dim,vtype>& buffer) const
+    {
+        if(get_mapped_image(out))
+            return true;
+        input_stream->clear();
+        input_stream->seek(voxel_offset());
+        if(!get_untouched_image(buffer))
+            return false;
+        out = const_pointer_image<dim,vtype>(buffer);
+        return true;
+    }
+    // the 4D image as stored, in either layout
+    template<typename vtype>
+    bool get_untouched_image(series_image<vtype>& out) const
+    {
+        return read_series(out,out.layout(),nullptr,tipl::shape<3>(nif_header2.dim+1));
+    }
+private:
+    /*
+     * reads all volumes into out. Voxel i of the output takes stored voxel
+     * gather[i] (gather == nullptr keeps the stored order). voxel_major reads a
+     * chunk of volumes at a time and interleaves it, so no volume_major copy of
+     * the whole series is kept.
+     */
+    template<typename vtype>
+    bool read_series(series_image<vtype>& out,series_layout layout,
+                     const uint32_t* gather,const tipl::shape<3>& geo) const
+    {
+        if(!has_data())
+            return false;
+        size_t n = 1;
+        for(int d = 4;d <= nif_header2.dim[0] && d < 8;++d)
+            n *= size_t(std::max<int64_t>(1,nif_header2.dim[d]));
+        out.resize(geo,n,layout);
+        size_t V = geo.size();
+        if(layout == volume_major && !gather)
+        {
+            if(!read_data(out.begin(),out.size(),true))
+                return false;
+        }
+        else
+        {
+            size_t chunk = std::max<size_t>(1,std::min<size_t>(n,(size_t(1) << 24)/std::max<size_t>(1,V)));
+            std::vector<vtype> buf(chunk*V);
+            for(size_t t0 = 0;t0 < n;t0 += chunk)
+            {
+                size_t count = std::min(chunk,n-t0);
+                if(!read_data(buf.begin(),count*V,true))
+                    return false;
+                par_for_block(V,[&](size_t i)
+                {
+                    size_t from = gather ? gather[i] : i;
+                    for(size_t t = 0;t < count;++t)
+                        out.at(i,t0+t) = buf[t*V+from];
+                });
+            }
+        }
+        return true;
+    }
+public:
     template<typename image_type>
     bool save_to_image(image_type& out)
     {
@@ -1062,6 +1517,36 @@ public:
             if(load_image && !get_untouched_image(out))
                 return false;
         }
+        reorient_to_LPS(out,change_header,load_image);
+        return true;
+    }
+    /*
+     * the volumes are read in chunks and scattered into the layout of out, the
+     * LPS swaps and flips are applied on the way through a voxel index image
+     */
+    template<typename vtype>
+    bool toLPS(series_image<vtype>& out,bool change_header = true,bool load_image = true)
+    {
+        if(!load_image)
+        {
+            image<3,char> header_only;
+            reorient_to_LPS(header_only,change_header,false);
+            return true;
+        }
+        // each step checks the header left by the previous one
+        nifti_2_header header = nif_header2;
+        image<3,uint32_t> index(tipl::shape<3>(nif_header2.dim+1));
+        for(size_t i = 0;i < index.size();++i)
+            index[i] = uint32_t(i);
+        reorient_to_LPS(index,true,true);
+        if(!change_header)
+            nif_header2 = header;
+        return read_series(out,out.layout(),&*index.begin(),index.shape());
+    }
+    // the RAS to LPS swaps and flips, applied to the header, the image, or both
+    template<typename image_type>
+    void reorient_to_LPS(image_type& out,bool change_header,bool load_image)
+    {
         handle_qform();
 
         // swap x y
@@ -1150,7 +1635,6 @@ public:
                 nif_header2.srow_z[2] = -nif_header2.srow_z[2];
             }
         }
-        return true;
     }
     friend std::ostream& operator<<(std::ostream& out,const nifti_base& nii)
     {
@@ -1204,6 +1688,10 @@ public:
 };
 
 typedef nifti_base<> nifti;
+typedef nifti_base<mmap_istream> mapped_nifti;
+#ifdef USE_ZLIB
+typedef nifti_base<gz_istream,gz_ostream> gz_nifti;
+#endif
 
 }
 }
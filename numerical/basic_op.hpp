@@ -4,6 +4,7 @@
 #include "../utility/pixel_index.hpp"
 #include "../utility/basic_image.hpp"
 #include "../utility/multi_thread.hpp"
+#include "../utility/sub_image.hpp"
 
 namespace tipl
 {
@@ -194,16 +195,7 @@ void crop(const image<2,PixelType,storage_type>& from_image,
 {
     if (to[0] <= from[0] || to[1] <= from[1])
         return;
-    tipl::shape<2> geo(to[0]-from[0],to[1]-from[1]);
-    to_image.resize(geo);
-    auto size = geo.size();
-    unsigned int from_index = from[1]*from_image.width() + from[0];
-    unsigned int shift = from_image.width()-geo.width();
-    for (unsigned int to_index = 0,step_index = geo.width();
-            to_index < size; from_index += shift,step_index += geo.width())
-        for (; to_index != step_index; ++to_index,++from_index)
-            to_image[to_index] = from_image[from_index];
-
+    make_sub_image(from_image,from,to).save_to_image(to_image);
 }
 //--------------------------------------------------------------------------
 template<typename PixelType,typename PosType,typename storage_type>
@@ -213,15 +205,7 @@ void crop(const image<3,PixelType,storage_type>& from_image,
     if (to[0] <= from[0] || to[1] <= from[1] ||
             to[2] <= from[2])
         return;
-    tipl::shape<3> geo(to[0]-from[0],to[1]-from[1],to[2]-from[2]);
-    to_image.resize(geo);
-    unsigned int from_index = (from[2]*from_image.height()+from[1])*from_image.width()+from[0];
-    unsigned int y_shift = from_image.width()-geo.width();
-    unsigned int z_shift = from_image.width()*from_image.height()-geo.height()*from_image.width();
-    for (unsigned int z = from[2],to_index = 0; z < to[2]; ++z,from_index += z_shift)
-        for (unsigned int y = from[1]; y < to[1]; ++y,from_index += y_shift)
-            for (unsigned int x = from[0]; x < to[0]; ++x,++to_index,++from_index)
-                to_image[to_index] = from_image[from_index];
+    make_sub_image(from_image,from,to).save_to_image(to_image);
 }
 //---------------------------------------------------------------------------
 template<typename ImageType,typename DimensionType>
@@ -784,8 +768,7 @@ ImageType& swap_xz(ImageType& I)
     shift[2] = 1;
     reorder(I,new_volume,origin,shift,3);
 
-    I.resize(new_geo);
-    std::copy(new_volume.begin(),new_volume.end(),I.begin());
+    move_assign(I,std::move(new_volume));
     return I;
 }
 //---------------------------------------------------------------------------
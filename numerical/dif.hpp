@@ -1,6 +1,7 @@
 #ifndef DIF_HPP
 #define DIF_HPP
 #include "../utility/basic_image.hpp"
+#include "../utility/soa_image.hpp"
 #include "interpolation.hpp"
 namespace tipl
 {
@@ -86,6 +87,72 @@ void compose_displacement(const ImageType& src,const ComposeImageType& displace,
         tipl::estimate(src,vtor,value,type);
     });
 }
+// returns src warped by displace
+template<typename ImageType,typename ComposeImageType>
+image<ImageType::dimension,typename ImageType::value_type>
+    compose_displacement(const ImageType& src,const ComposeImageType& displace)
+{
+    image<ImageType::dimension,typename ImageType::value_type> dest;
+    compose_displacement(src,displace,dest);
+    return dest;
+}
+//---------------------------------------------------------------------------
+// displacement stored as component planes
+template<typename ImageType,int dim,typename vtype,typename OutImageType>
+void compose_displacement(const ImageType& src,const soa_image<dim,vtype>& displace,OutImageType& dest,
+                          interpolation_type type = interpolation_type::linear)
+{
+    typedef typename soa_image<dim,vtype>::value_type vtor_type;
+    dest.resize(src.shape());
+    dest.for_each_mt([&](typename OutImageType::value_type& value,
+                         tipl::pixel_index<dim> index)
+    {
+        vtor_type dis(displace[index.index()]);
+        if(dis == vtor_type())
+        {
+            value = src[index.index()];
+            return;
+        }
+        vtor_type vtor(index);
+        vtor += dis;
+        tipl::estimate(src,vtor,value,type);
+    });
+}
+// warps each component plane, the interpolation weights are computed once per voxel
+template<int dim,typename vtype,typename dis_vtype,typename out_vtype>
+void compose_displacement(const soa_image<dim,vtype>& src,const soa_image<dim,dis_vtype>& displace,
+                          soa_image<dim,out_vtype>& dest,
+                          interpolation_type type = interpolation_type::linear)
+{
+    typedef typename soa_image<dim,dis_vtype>::value_type vtor_type;
+    dest.resize(src.shape());
+    out_vtype* out[dim];
+    for(int k = 0;k < dim;++k)
+        out[k] = &dest.plane(k)[0];
+    dest.plane(0).for_each_mt([&](out_vtype&,tipl::pixel_index<dim> index)
+    {
+        size_t i = index.index();
+        vtor_type dis(displace[i]);
+        if(dis == vtor_type())
+        {
+            for(int k = 0;k < dim;++k)
+                out[k][i] = src.plane(k)[i];
+            return;
+        }
+        vtor_type vtor(index);
+        vtor += dis;
+        if(type == interpolation_type::linear)
+        {
+            interpolation<linear_weighting,dim> interp;
+            if(interp.get_location(src.shape(),vtor))
+                for(int k = 0;k < dim;++k)
+                    interp.estimate(src.plane(k),out[k][i]);
+            return;
+        }
+        for(int k = 0;k < dim;++k)
+            tipl::estimate(src.plane(k),vtor,out[k][i],type);
+    });
+}
 //---------------------------------------------------------------------------
 template<typename ImageType,typename ComposeImageType,typename OutImageType,typename transform_type>
 void compose_displacement_with_affine(const ImageType& src,OutImageType& dest,
@@ -105,20 +172,27 @@ void compose_displacement_with_affine(const ImageType& src,OutImageType& dest,
 }
 
 //---------------------------------------------------------------------------
+// buf is the working field, its storage is reused when it already has the shape of v0
 template<typename ComposeImageType>
-void invert_displacement(const ComposeImageType& v0,ComposeImageType& v1,uint8_t iterations = 16)
+void invert_displacement(const ComposeImageType& v0,ComposeImageType& v1,ComposeImageType& buf,uint8_t iterations = 16)
 {
-    ComposeImageType vv;
     v1.resize(v0.shape());
     for(size_t index = 0;index < v1.size();++index)
         v1[index] = -v0[index];
     for(uint8_t i = 0;i < iterations;++i)
     {
-        tipl::compose_displacement(v0,v1,vv);
+        tipl::compose_displacement(v0,v1,buf);
+        v1.swap(buf);
         for(size_t index = 0;index < v1.size();++index)
-            v1[index] = -vv[index];
+            v1[index] = -v1[index];
     }
 }
+template<typename ComposeImageType>
+void invert_displacement(const ComposeImageType& v0,ComposeImageType& v1,uint8_t iterations = 16)
+{
+    ComposeImageType buf;
+    invert_displacement(v0,v1,buf,iterations);
+}
 //---------------------------------------------------------------------------
 template<typename ComposeImageType>
 void invert_displacement(ComposeImageType& v,uint8_t iterations = 16)
@@ -152,7 +226,7 @@ void accumulate_displacement(ComposeImageType& v0,const ComposeImageType& vv)
 {
     ComposeImageType nv;
     compose_displacement(v0,vv,nv);
-    v0 = nv;
+    v0.swap(nv);
     v0 += vv;
 }
 //---------------------------------------------------------------------------
@@ -174,40 +248,68 @@ void decompose_displacement(const ComposeImageType& v,const ComposeImageType& vx
     }
 }
 //---------------------------------------------------------------------------
+/*
+ * visits a volume row by row: edge(i) for voxels on the border, fun(from,to)
+ * for the run of interior voxels of a row, which can then read the six
+ * neighbors without bound checks
+ */
+template<typename edge_type,typename fun_type>
+void for_each_interior_row(const shape<3>& geo,edge_type&& edge,fun_type&& fun)
+{
+    int w = geo.width();
+    int h = geo.height();
+    int d = geo.depth();
+    size_t wh = geo.plane_size();
+    par_for(d,[&](int iz)
+    {
+        for(int iy = 0;iy < h;++iy)
+        {
+            size_t row = size_t(iz)*wh+size_t(iy)*size_t(w);
+            if(iz == 0 || iz+1 == d || iy == 0 || iy+1 == h || w < 3)
+            {
+                for(int ix = 0;ix < w;++ix)
+                    edge(row+size_t(ix));
+                continue;
+            }
+            edge(row);
+            edge(row+size_t(w)-1);
+            fun(row+1,row+size_t(w)-1);
+        }
+    });
+}
+//---------------------------------------------------------------------------
 template<typename VectorType,typename DetType>
 void jacobian_determinant(const image<3,VectorType>& src,DetType& dest)
 {
     typedef typename DetType::value_type value_type;
     shape<3> geo(src.shape());
     dest.resize(geo);
-    int w = src.width();
-    int wh = src.plane_size();
-    for (tipl::pixel_index<3> index(geo); index < geo.size();++index)
+    size_t w = src.width();
+    size_t wh = src.plane_size();
+    for_each_interior_row(geo,[&](size_t i){dest[i] = 1;},[&](size_t from,size_t to)
     {
-        if (geo.is_edge(index))
+        for(size_t i = from;i < to;++i)
         {
-            dest[index.index()] = 1;
-            continue;
-        }
-        const VectorType& v1_0 = src[index.index()+1];
-        const VectorType& v1_1 = src[index.index()-1];
-        const VectorType& v2_0 = src[index.index()+w];
-        const VectorType& v2_1 = src[index.index()-w];
-        const VectorType& v3_0 = src[index.index()+wh];
-        const VectorType& v3_1 = src[index.index()-wh];
+            const VectorType& v1_0 = src[i+1];
+            const VectorType& v1_1 = src[i-1];
+            const VectorType& v2_0 = src[i+w];
+            const VectorType& v2_1 = src[i-w];
+            const VectorType& v3_0 = src[i+wh];
+            const VectorType& v3_1 = src[i-wh];
 
-        value_type d2_0 = v2_0[0] - v2_1[0];
-        value_type d2_1 = v2_0[1] - v2_1[1];
-        value_type d2_2 = v2_0[2] - v2_1[2];
+            value_type d2_0 = v2_0[0] - v2_1[0];
+            value_type d2_1 = v2_0[1] - v2_1[1];
+            value_type d2_2 = v2_0[2] - v2_1[2];
 
-        value_type d3_0 = v3_0[0] - v3_1[0];
-        value_type d3_1 = v3_0[1] - v3_1[1];
-        value_type d3_2 = v3_0[2] - v3_1[2];
+            value_type d3_0 = v3_0[0] - v3_1[0];
+            value_type d3_1 = v3_0[1] - v3_1[1];
+            value_type d3_2 = v3_0[2] - v3_1[2];
 
-        dest[index.index()] = (v1_0[0] - v1_1[0])*(d2_1*d3_2-d2_2*d3_1)+
-                                       (v1_0[1] - v1_1[1])*(d2_2*d3_0-d2_0*d3_2)+
-                                       (v1_0[2] - v1_1[2])*(d2_0*d3_1-d2_1*d3_0);
-    }
+            dest[i] = (v1_0[0] - v1_1[0])*(d2_1*d3_2-d2_2*d3_1)+
+                      (v1_0[1] - v1_1[1])*(d2_2*d3_0-d2_0*d3_2)+
+                      (v1_0[2] - v1_1[2])*(d2_0*d3_1-d2_1*d3_0);
+        }
+    });
 }
 template<typename VectorType>
 double jacobian_determinant_dis_at(const image<3,VectorType>& src,const tipl::pixel_index<3>& index)
@@ -264,15 +366,56 @@ void jacobian_determinant_dis(const image<3,VectorType>& src,DetType& dest)
 {
     shape<3> geo(src.shape());
     dest.resize(geo);
-    for (tipl::pixel_index<3> index(geo); index < geo.size();++index)
+    for_each_interior_row(geo,[&](size_t i){dest[i] = 1;},[&](size_t from,size_t to)
     {
-        if (geo.is_edge(index))
+        tipl::pixel_index<3> index(from,geo);
+        for(size_t i = from;i < to;++i,++index)
+            dest[i] = jacobian_determinant_dis_at(src,index);
+    });
+}
+
+//---------------------------------------------------------------------------
+// central differences over the component planes, diag is added to the
+// diagonal (1 for a displacement field, 0 for a mapping)
+template<typename vtype,typename DetType>
+void jacobian_determinant_planes(const soa_image<3,vtype>& src,DetType& dest,double diag)
+{
+    typedef typename DetType::value_type value_type;
+    shape<3> geo(src.shape());
+    dest.resize(geo);
+    size_t w = geo.width();
+    size_t wh = geo.plane_size();
+    const vtype* x = &src.plane(0)[0];
+    const vtype* y = &src.plane(1)[0];
+    const vtype* z = &src.plane(2)[0];
+    for_each_interior_row(geo,[&](size_t i){dest[i] = 1;},[&](size_t from,size_t to)
+    {
+        for(size_t i = from;i < to;++i)
         {
-            dest[index.index()] = 1;
-            continue;
+            double d1_0 = x[i+1]-x[i-1]+diag;
+            double d1_1 = y[i+1]-y[i-1];
+            double d1_2 = z[i+1]-z[i-1];
+            double d2_0 = x[i+w]-x[i-w];
+            double d2_1 = y[i+w]-y[i-w]+diag;
+            double d2_2 = z[i+w]-z[i-w];
+            double d3_0 = x[i+wh]-x[i-wh];
+            double d3_1 = y[i+wh]-y[i-wh];
+            double d3_2 = z[i+wh]-z[i-wh]+diag;
+            dest[i] = value_type(d1_0*(d2_1*d3_2-d2_2*d3_1)+
+                                 d1_1*(d2_2*d3_0-d2_0*d3_2)+
+                                 d1_2*(d2_0*d3_1-d2_1*d3_0));
         }
-        dest[index.index()] = jacobian_determinant_dis_at(src,index);
-    }
+    });
+}
+template<typename vtype,typename DetType>
+void jacobian_determinant(const soa_image<3,vtype>& src,DetType& dest)
+{
+    jacobian_determinant_planes(src,dest,0.0);
+}
+template<typename vtype,typename DetType>
+void jacobian_determinant_dis(const soa_image<3,vtype>& src,DetType& dest)
+{
+    jacobian_determinant_planes(src,dest,1.0);
 }
 
 //---------------------------------------------------------------------------
@@ -2,6 +2,7 @@
 #ifndef INTERPOLATION_HPP
 #define INTERPOLATION_HPP
 #include "../utility/basic_image.hpp"
+#include "../utility/scaled_image.hpp"
 #include "index_algorithm.hpp"
 
 namespace tipl
@@ -73,6 +74,16 @@ struct interpolator<unsigned int>{
 };
 
 
+// half is interpolated in float
+template<>
+struct interpolator<half>{
+    typedef float type;
+    static half assign(float v)
+    {
+        return half(v);
+    }
+};
+
 template<int dim,typename vtype>
 struct interpolator<tipl::vector<dim,vtype> >{
     typedef tipl::vector<dim,typename interpolator<vtype>::type> type;
@@ -865,6 +876,25 @@ typename ImageType::value_type estimate(const ImageType& source,const VTorType&
     return result;
 }
 
+// the stored values are interpolated and then scaled, the weights sum to one
+template<int dim,typename VTorType,typename PixelType>
+bool estimate(const scaled_image<dim>& source,const VTorType& location,PixelType& pixel,interpolation_type type = linear)
+{
+    float x = 0.0f;
+    if(!estimate(static_cast<const image<dim,int16_t>&>(source),location,x,type))
+        return false;
+    pixel = source.slope*x+source.inter;
+    return true;
+}
+template<int dim,typename VTorType>
+float estimate(const scaled_image<dim>& source,const VTorType& location,interpolation_type type = linear)
+{
+    float x = 0.0f;
+    if(!estimate(static_cast<const image<dim,int16_t>&>(source),location,x,type))
+        return 0.0f;
+    return source.slope*x+source.inter;
+}
+
 
 
 }
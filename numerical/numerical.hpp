@@ -4,6 +4,7 @@
 #include <random>
 #include "../utility/basic_image.hpp"
 #include "../utility/multi_thread.hpp"
+#include "../utility/soa_image.hpp"
 #include "interpolation.hpp"
 
 
@@ -121,6 +122,22 @@ void gradient_sobel(const PixelImageType& src,VectorImageType& dest)
         shift *= src.shape()[index];
     }
 }
+// each component plane is a shifted difference of src
+template<typename PixelImageType,int dim,typename vtype>
+void gradient_sobel(const PixelImageType& src,soa_image<dim,vtype>& dest)
+{
+    dest.clear();
+    dest.resize(src.shape());
+    size_t shift = 1;
+    for (unsigned int index = 0; index < dim; ++index)
+    {
+        auto in = src.begin();
+        vtype* out = &dest.plane(index)[0]+shift;
+        for (size_t i = 0,n = src.size()-std::min(src.size(),shift+shift); i < n; ++i)
+            out[i] = in[i+shift+shift] - in[i];
+        shift *= src.shape()[index];
+    }
+}
 //---------------------------------------------------------------------------
 template<typename pixel_type,typename container_type,typename VectorImageType>
 void gradient_multiple_sampling(const tipl::image<3,pixel_type,container_type>& src,
@@ -4,6 +4,7 @@
 #include <limits>
 #include <vector>
 #include <map>
+#include <mutex>
 #include "numerical.hpp"
 #include "matrix.hpp"
 namespace tipl
@@ -31,21 +32,46 @@ void plot_fun_2d(
     }
 }
 
+/*
+ * run f(i,fun_copy) in parallel, where each thread evaluates its own copy of fun.
+ * Cost functions keeping per-call state (e.g. reg::mt_correlation) are therefore
+ * never shared between threads. The copies run under thread_count_scope(1), so
+ * internally parallel cost functions evaluate them single-threaded. Copies should
+ * share read-only precomputation (e.g. through std::shared_ptr) to keep copying cheap.
+ */
+template<typename function_type,typename Func>
+void par_for_fun(unsigned int size,function_type& fun,Func&& f,
+                 unsigned int thread_count = std::thread::hardware_concurrency())
+{
+    if(thread_count > size)
+        thread_count = size;
+    if(thread_count <= 1)
+    {
+        for(unsigned int i = 0;i < size;++i)
+            f(i,fun);
+        return;
+    }
+    std::vector<function_type> funs(thread_count,fun);
+    par_for2(size,[&](unsigned int i,unsigned int id)
+    {
+        thread_count_scope scope(1);
+        f(i,funs[id]);
+    },thread_count);
+}
+
 // calculate fun(x+ei)
 template<typename iter_type1,typename tol_type,typename iter_type2,typename function_type>
 void estimate_change(iter_type1 x_beg,iter_type1 x_end,tol_type tol,iter_type2 fun_ei,function_type& fun)
 {
     typedef typename std::iterator_traits<iter_type1>::value_type param_type;
     unsigned int size = x_end-x_beg;
-    std::vector<param_type> x(x_beg,x_end);
-    par_for(size,[&](unsigned int i)
+    par_for_fun(size,fun,[&](unsigned int i,function_type& f)
     {
         if(tol[i] == 0)
             return;
-        param_type old_x = x[i];
+        std::vector<param_type> x(x_beg,x_end);
         x[i] += tol[i];
-        fun_ei[i] = fun(&x[0]);
-        x[i] = old_x;
+        fun_ei[i] = f(&x[0]);
     });
 }
 // calculate fun(x+ei)
@@ -167,7 +193,7 @@ bool armijo_line_search(iter_type1 x_beg,iter_type1 x_end,
         new_x_list.push_back(std::move(new_x));
     }
 
-    par_for(cost.size(),[&](unsigned int index)
+    par_for_fun(uint32_t(cost.size()),fun,[&](unsigned int index,function_type& f)
     {
         if(index == 0)
             return;
@@ -177,7 +203,7 @@ bool armijo_line_search(iter_type1 x_beg,iter_type1 x_end,
                cost[i+1] != std::numeric_limits<value_type>::max() &&
                cost[i] < cost[i+1])
                 return;
-        cost[index] = fun(&*new_x_list[index].begin());
+        cost[index] = f(&*new_x_list[index].begin());
     });
 
     // find the step that has lowest cost
@@ -235,6 +261,173 @@ void quasi_newtons_minimize(
     }
 }
 
+// detect cost functions providing gradient(const param_type* x,param_type* g)
+template<typename function_type,typename param_type>
+class has_gradient{
+    template<typename T>
+    static auto test(int)->decltype(std::declval<T&>().gradient((const param_type*)nullptr,(param_type*)nullptr),std::true_type());
+    template<typename>
+    static std::false_type test(...);
+public:
+    static const bool value = decltype(test<function_type>(0))::value;
+};
+
+template<typename param_type,typename value_type,typename function_type,
+         typename std::enable_if<has_gradient<function_type,param_type>::value,bool>::type = true>
+void get_gradient(const std::vector<param_type>& x,const std::vector<param_type>&,value_type,
+                  std::vector<param_type>& g,function_type& fun)
+{
+    fun.gradient(&x[0],&g[0]);
+}
+
+template<typename param_type,typename value_type,typename function_type,
+         typename std::enable_if<!has_gradient<function_type,param_type>::value,bool>::type = true>
+void get_gradient(const std::vector<param_type>& x,const std::vector<param_type>& tols,value_type fun_x,
+                  std::vector<param_type>& g,function_type& fun)
+{
+    std::vector<value_type> fun_x_ei(x.size());
+    estimate_change(x.begin(),x.end(),tols.begin(),fun_x_ei.begin(),fun);
+    gradient(x.begin(),x.end(),tols.begin(),fun_x,fun_x_ei.begin(),g.begin());
+}
+
+/*
+ * Limited-memory BFGS with bound constraints (projected L-BFGS).
+ * Parameters are scaled by x_upper-x_lower. Variables at a bound whose gradient points
+ * outward are kept fixed, and the line search evaluates projected steps concurrently.
+ * The gradient is taken from fun.gradient(x,g) if available, or estimated by forward
+ * differences otherwise.
+ */
+template<typename iter_type1,typename iter_type2,typename function_type,typename terminated_class>
+void lbfgs_minimize(
+                iter_type1 x_beg,iter_type1 x_end,
+                iter_type2 x_upper,iter_type2 x_lower,
+                function_type& fun,
+                typename function_type::value_type& fun_x,
+                terminated_class& terminated,double precision = 0.001,
+                unsigned int max_iteration = 100,unsigned int history = 6)
+{
+    typedef typename std::iterator_traits<iter_type1>::value_type param_type;
+    typedef typename function_type::value_type value_type;
+    const unsigned int size = x_end-x_beg;
+    std::vector<param_type> x(x_beg,x_end),tols(size),g(size);
+    calculate_resolution(tols,x_upper,x_lower,precision);
+    std::vector<double> range(size),gs(size),prev_gs,step;
+    for(unsigned int i = 0;i < size;++i)
+        range[i] = x_upper[i]-x_lower[i];
+
+    std::deque<std::vector<double> > s_list,y_list;
+    std::deque<double> rho_list;
+    for(unsigned int iter = 0;iter < max_iteration && !terminated;++iter)
+    {
+        get_gradient(x,tols,fun_x,g,fun);
+        for(unsigned int i = 0;i < size;++i)
+            gs[i] = range[i] == 0.0 ? 0.0 : double(g[i])*range[i];
+
+        // update the curvature pairs
+        if(!step.empty())
+        {
+            std::vector<double> y(gs);
+            tipl::vec::axpy(y.begin(),y.end(),-1.0,prev_gs.begin());
+            double sy = tipl::vec::dot(step.begin(),step.end(),y.begin());
+            if(sy > 1.0e-10*tipl::vec::dot(y.begin(),y.end(),y.begin()))
+            {
+                s_list.push_back(step);
+                y_list.push_back(y);
+                rho_list.push_back(1.0/sy);
+                if(s_list.size() > history)
+                {
+                    s_list.pop_front();
+                    y_list.pop_front();
+                    rho_list.pop_front();
+                }
+            }
+        }
+
+        // free variables: not fixed and not pushed against an active bound
+        std::vector<unsigned char> free_var(size);
+        for(unsigned int i = 0;i < size;++i)
+            free_var[i] = range[i] != 0.0 &&
+                          !(x[i] <= x_lower[i] && gs[i] > 0.0) &&
+                          !(x[i] >= x_upper[i] && gs[i] < 0.0);
+        std::vector<double> q(size);
+        for(unsigned int i = 0;i < size;++i)
+            if(free_var[i])
+                q[i] = gs[i];
+        double q_length = std::sqrt(tipl::vec::dot(q.begin(),q.end(),q.begin()));
+        if(q_length == 0.0)
+            break;
+
+        // two-loop recursion
+        std::vector<double> alpha(s_list.size());
+        for(int k = int(s_list.size())-1;k >= 0;--k)
+        {
+            alpha[k] = rho_list[k]*tipl::vec::dot(s_list[k].begin(),s_list[k].end(),q.begin());
+            tipl::vec::axpy(q.begin(),q.end(),-alpha[k],y_list[k].begin());
+        }
+        double gamma = s_list.empty() ? 0.1/q_length :
+                       1.0/rho_list.back()/tipl::vec::dot(y_list.back().begin(),y_list.back().end(),y_list.back().begin());
+        tipl::vec::scale(q.begin(),q.end(),gamma);
+        for(unsigned int k = 0;k < s_list.size();++k)
+        {
+            double beta = rho_list[k]*tipl::vec::dot(y_list[k].begin(),y_list[k].end(),q.begin());
+            tipl::vec::axpy(q.begin(),q.end(),alpha[k]-beta,s_list[k].begin());
+        }
+        std::vector<double> d(size);
+        for(unsigned int i = 0;i < size;++i)
+            if(free_var[i])
+                d[i] = -q[i];
+        if(tipl::vec::dot(d.begin(),d.end(),gs.begin()) >= 0.0)
+        {
+            // not a descent direction, restart from steepest descent
+            s_list.clear();
+            y_list.clear();
+            rho_list.clear();
+            for(unsigned int i = 0;i < size;++i)
+                d[i] = free_var[i] ? -gs[i]*0.1/q_length : 0.0;
+        }
+
+        // projected backtracking line search, steps evaluated in parallel
+        const unsigned int step_count = 8;
+        std::vector<std::vector<param_type> > new_x(step_count,x);
+        std::vector<value_type> cost(step_count);
+        std::vector<double> decrease(step_count);
+        for(unsigned int j = 0;j < step_count;++j)
+        {
+            double a = std::pow(0.5,double(j));
+            for(unsigned int i = 0;i < size;++i)
+                if(d[i] != 0.0)
+                {
+                    new_x[j][i] = param_type(std::min<double>(std::max<double>(x[i]+a*d[i]*range[i],x_lower[i]),x_upper[i]));
+                    decrease[j] += gs[i]*(double(new_x[j][i])-double(x[i]))/range[i];
+                }
+        }
+        par_for_fun(step_count,fun,[&](unsigned int j,function_type& f)
+        {
+            cost[j] = f(&new_x[j][0]);
+        });
+        unsigned int accepted = step_count;
+        for(unsigned int j = 0;j < step_count && accepted == step_count;++j)
+            if(cost[j] <= fun_x+1.0e-4*decrease[j] && cost[j] < fun_x)
+                accepted = j;
+        if(accepted == step_count)
+        {
+            accepted = uint32_t(std::min_element(cost.begin(),cost.end())-cost.begin());
+            if(!(cost[accepted] < fun_x))
+                break;
+        }
+
+        step.resize(size);
+        for(unsigned int i = 0;i < size;++i)
+            step[i] = range[i] == 0.0 ? 0.0 : (double(new_x[accepted][i])-double(x[i]))/range[i];
+        prev_gs = gs;
+        x.swap(new_x[accepted]);
+        fun_x = cost[accepted];
+        std::copy(x.begin(),x.end(),x_beg);
+        if(std::sqrt(tipl::vec::dot(step.begin(),step.end(),step.begin())) < precision)
+            break;
+    }
+}
+
 template<typename param_type,typename function_type,typename value_type,typename terminated_class>
 void graient_descent_1d(param_type& x,param_type upper,param_type lower,
                      function_type& fun,value_type& fun_x,terminated_class& terminated,double precision = 0.001)
@@ -262,28 +455,179 @@ void random_search(iter_type1 x_beg,iter_type1 x_end,
                      int random_search_count)
 {
     typedef typename std::iterator_traits<iter_type1>::value_type param_type;
-    std::default_random_engine gen;
-    std::uniform_int_distribution<int> un(0,x_end-x_beg-1);
-    tipl::par_for(std::thread::hardware_concurrency(),[&](int)
+    std::mutex update_mutex;
+    unsigned int thread_count = std::thread::hardware_concurrency();
+    par_for_fun(thread_count,fun,[&](unsigned int thread,function_type& f)
     {
+        std::default_random_engine gen(thread);
+        std::uniform_int_distribution<int> un(0,x_end-x_beg-1);
         for(int j = 0;j < random_search_count && !terminated;)
         {
             int cur_dim = un(gen);
             if(x_upper[cur_dim] == x_lower[cur_dim])
                 continue;
             ++j;
-            float sd = std::max<float>(std::fabs(x_upper[cur_dim]-x_beg[cur_dim]),std::fabs(x_lower[cur_dim]-x_beg[cur_dim]))/2.0f;
-            std::normal_distribution<double> distribution(x_beg[cur_dim],sd);
-            std::vector<param_type> param(x_beg,x_end);
+            std::vector<param_type> param;
+            {
+                std::lock_guard<std::mutex> lock(update_mutex);
+                param.assign(x_beg,x_end);
+            }
+            float sd = std::max<float>(std::fabs(x_upper[cur_dim]-param[cur_dim]),std::fabs(x_lower[cur_dim]-param[cur_dim]))/2.0f;
+            std::normal_distribution<double> distribution(param[cur_dim],sd);
             param[cur_dim] = distribution(gen);
-            double current_value = fun(&*param.begin());
+            double current_value = f(&*param.begin());
+            std::lock_guard<std::mutex> lock(update_mutex);
             if(current_value < optimal_value)
             {
                 optimal_value = current_value;
                 x_beg[cur_dim] = param[cur_dim];
             }
         }
-    });
+    },thread_count);
+}
+
+/*
+ * Covariance matrix adaptation evolution strategy (CMA-ES).
+ * The search runs in the box normalized by x_upper and x_lower. Dimensions with
+ * x_upper == x_lower are kept fixed. Candidates of each generation are evaluated
+ * concurrently on per-thread copies of fun (see par_for_fun), so copies must be
+ * cheap and share only read-only state.
+ * population = 0 uses max(4+3ln(n),thread_count) candidates per generation.
+ */
+template<typename iter_type1,typename iter_type2,typename function_type,typename teminated_class>
+void cmaes(iter_type1 x_beg,iter_type1 x_end,
+           iter_type2 x_upper,iter_type2 x_lower,
+           function_type& fun,
+           double& optimal_value,
+           teminated_class& terminated,
+           double precision = 0.001,
+           unsigned int max_generation = 100,
+           unsigned int population = 0,
+           double initial_sigma = 0.25,
+           unsigned int thread_count = std::thread::hardware_concurrency())
+{
+    typedef typename std::iterator_traits<iter_type1>::value_type param_type;
+    std::vector<unsigned int> dims;
+    for(unsigned int i = 0;i < x_end-x_beg;++i)
+        if(x_upper[i] != x_lower[i])
+            dims.push_back(i);
+    const unsigned int n = uint32_t(dims.size());
+    if(!n)
+        return;
+    const unsigned int lambda = population ? population :
+                            std::max<unsigned int>(4+uint32_t(3.0*std::log(double(n))),thread_count);
+    const unsigned int mu = std::max<unsigned int>(1,lambda/2);
+
+    // recombination weights and learning rates
+    std::vector<double> w(mu);
+    for(unsigned int i = 0;i < mu;++i)
+        w[i] = std::log(double(mu)+0.5)-std::log(double(i)+1.0);
+    tipl::multiply_constant(w,1.0/std::accumulate(w.begin(),w.end(),0.0));
+    const double mueff = 1.0/tipl::vec::dot(w.begin(),w.end(),w.begin());
+    const double cc = (4.0+mueff/n)/(n+4.0+2.0*mueff/n);
+    const double cs = (mueff+2.0)/(n+mueff+5.0);
+    const double c1 = 2.0/((n+1.3)*(n+1.3)+mueff);
+    const double cmu = std::min<double>(1.0-c1,2.0*(mueff-2.0+1.0/mueff)/((n+2.0)*(n+2.0)+mueff));
+    const double damps = 1.0+2.0*std::max<double>(0.0,std::sqrt((mueff-1.0)/(n+1.0))-1.0)+cs;
+    const double chiN = std::sqrt(double(n))*(1.0-1.0/(4.0*n)+1.0/(21.0*n*n));
+
+    // state in the normalized space
+    std::vector<double> m(n),ps(n),pc(n),C(n*n),B(n*n),D(n,1.0);
+    for(unsigned int j = 0;j < n;++j)
+    {
+        unsigned int k = dims[j];
+        m[j] = std::min<double>(1.0,std::max<double>(0.0,double(x_beg[k]-x_lower[k])/double(x_upper[k]-x_lower[k])));
+    }
+    tipl::mat::identity(C.begin(),tipl::shape<2>(n,n));
+    tipl::mat::identity(B.begin(),tipl::shape<2>(n,n));
+    double sigma = initial_sigma;
+
+    std::vector<param_type> best_x(x_beg,x_end);
+    double best_value = optimal_value;
+    std::mt19937 gen(0);
+    std::normal_distribution<double> normal(0.0,1.0);
+    std::vector<std::vector<double> > y(lambda,std::vector<double>(n));
+    std::vector<std::vector<param_type> > x(lambda,std::vector<param_type>(x_beg,x_end));
+    std::vector<double> cost(lambda);
+    for(unsigned int g = 0;g < max_generation && !terminated;++g)
+    {
+        // sample y ~ N(0,C) and repair candidates to stay in the bounds
+        for(unsigned int i = 0;i < lambda;++i)
+        {
+            std::vector<double> z(n);
+            for(unsigned int k = 0;k < n;++k)
+                z[k] = D[k]*normal(gen);
+            for(unsigned int j = 0;j < n;++j)
+            {
+                double v = 0.0;
+                for(unsigned int k = 0;k < n;++k)
+                    v += B[k*n+j]*z[k]; // B rows are eigenvectors
+                double u = std::min<double>(1.0,std::max<double>(0.0,m[j]+sigma*v));
+                y[i][j] = (u-m[j])/sigma;
+                unsigned int d = dims[j];
+                x[i][d] = param_type(x_lower[d]+u*(x_upper[d]-x_lower[d]));
+            }
+        }
+        par_for_fun(lambda,fun,[&](unsigned int i,function_type& f)
+        {
+            cost[i] = f(&x[i][0]);
+        },thread_count);
+
+        std::vector<unsigned int> rank(lambda);
+        std::iota(rank.begin(),rank.end(),0);
+        std::sort(rank.begin(),rank.end(),[&cost](unsigned int l,unsigned int r){return cost[l] < cost[r];});
+        if(cost[rank[0]] < best_value)
+        {
+            best_value = cost[rank[0]];
+            best_x = x[rank[0]];
+        }
+
+        // update mean
+        std::vector<double> yw(n);
+        for(unsigned int i = 0;i < mu;++i)
+            tipl::vec::axpy(yw.begin(),yw.end(),w[i],y[rank[i]].begin());
+        tipl::vec::axpy(m.begin(),m.end(),sigma,yw.begin());
+
+        // update evolution paths, C^(-1/2)*yw = B'*D^-1*B*yw
+        {
+            std::vector<double> invsqrt_yw(n),tmp(n);
+            for(unsigned int k = 0;k < n;++k)
+                tmp[k] = tipl::vec::dot(B.begin()+k*n,B.begin()+k*n+n,yw.begin())/D[k];
+            for(unsigned int k = 0;k < n;++k)
+                tipl::vec::axpy(invsqrt_yw.begin(),invsqrt_yw.end(),tmp[k],B.begin()+k*n);
+            tipl::vec::scale(ps.begin(),ps.end(),1.0-cs);
+            tipl::vec::axpy(ps.begin(),ps.end(),std::sqrt(cs*(2.0-cs)*mueff),invsqrt_yw.begin());
+        }
+        double ps_norm = std::sqrt(tipl::vec::dot(ps.begin(),ps.end(),ps.begin()));
+        bool hsig = ps_norm/std::sqrt(1.0-std::pow(1.0-cs,2.0*(g+1)))/chiN < 1.4+2.0/(n+1.0);
+        tipl::vec::scale(pc.begin(),pc.end(),1.0-cc);
+        if(hsig)
+            tipl::vec::axpy(pc.begin(),pc.end(),std::sqrt(cc*(2.0-cc)*mueff),yw.begin());
+
+        // update covariance matrix
+        double c1a = c1*(hsig ? 1.0 : 1.0-cc*(2.0-cc));
+        for(unsigned int r = 0,index = 0;r < n;++r)
+            for(unsigned int c = 0;c < n;++c,++index)
+            {
+                double rank_mu = 0.0;
+                for(unsigned int i = 0;i < mu;++i)
+                    rank_mu += w[i]*y[rank[i]][r]*y[rank[i]][c];
+                C[index] = (1.0-c1a-cmu)*C[index]+c1*pc[r]*pc[c]+cmu*rank_mu;
+            }
+        sigma *= std::exp((cs/damps)*(ps_norm/chiN-1.0));
+
+        std::vector<double> d(n);
+        tipl::mat::eigen_decomposition_sym(C.begin(),B.begin(),d.begin(),tipl::shape<2>(n,n));
+        for(unsigned int k = 0;k < n;++k)
+            D[k] = std::sqrt(std::max<double>(d[k],std::numeric_limits<double>::epsilon()));
+        if(sigma*(*std::max_element(D.begin(),D.end())) < precision)
+            break;
+    }
+    if(best_value < optimal_value)
+    {
+        optimal_value = best_value;
+        std::copy(best_x.begin(),best_x.end(),x_beg);
+    }
 }
 
 template<typename iter_type1,typename iter_type2,typename function_type,typename terminated_class>
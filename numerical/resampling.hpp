@@ -722,6 +722,13 @@ void upsample_with_padding(const image_type1& I,image_type2& uI,const geo_type&
     tipl::draw(new_I,uI,pixel_index<image_type1::dimension>(I.shape()));
 }
 
+template<int dim,typename vtype,typename geo_type>
+void upsample_with_padding(const soa_image<dim,vtype>& I,soa_image<dim,vtype>& uI,const geo_type& geo)
+{
+    for(int k = 0;k < dim;++k)
+        upsample_with_padding(I.plane(k),uI.plane(k),geo);
+}
+
 
 template<typename PixelType>
 void shrink(const tipl::image<3,PixelType>& image,
@@ -1064,7 +1071,8 @@ void resample(const tipl::image<3,PixelType>& source_image,
 
 
 
-template<typename ImageType1,typename ImageType2,typename transform_type>
+template<typename ImageType1,typename ImageType2,typename transform_type,
+         typename std::enable_if<!std::is_same<ImageType2,tipl::shape<ImageType2::dimension> >::value,bool>::type = true>
 void resample_mt(const ImageType1& from,ImageType2& to,const transform_type& transform,interpolation_type type = interpolation_type::linear)
 {
     to.for_each_mt([&transform,&from,type](typename ImageType2::value_type& value,
@@ -1075,12 +1083,23 @@ void resample_mt(const ImageType1& from,ImageType2& to,const transform_type& tra
         estimate(from,pos,value,type);
     });
 }
-template<typename ImageType1,typename ImageType2,int r,int c,typename value_type>
+template<typename ImageType1,typename ImageType2,int r,int c,typename value_type,
+         typename std::enable_if<!std::is_same<ImageType2,tipl::shape<ImageType2::dimension> >::value,bool>::type = true>
 void resample_mt(const ImageType1& from,ImageType2& to,const tipl::matrix<r,c,value_type>& trans,interpolation_type type = interpolation_type::linear)
 {
     tipl::transformation_matrix<value_type> transform(trans);
     resample_mt(from,to,transform,type);
 }
+// returns the resampled image of shape to_geo
+template<typename ImageType,typename transform_type>
+image<ImageType::dimension,typename ImageType::value_type>
+    resample_mt(const ImageType& from,const tipl::shape<ImageType::dimension>& to_geo,
+                const transform_type& transform,interpolation_type type = interpolation_type::linear)
+{
+    image<ImageType::dimension,typename ImageType::value_type> to(to_geo);
+    resample_mt(from,to,transform,type);
+    return to;
+}
 
 
 template<typename ImageType1,typename ImageType2>
@@ -1157,6 +1176,7 @@ void resample(ImageType& from,const tipl::transformation_matrix<value_type>& tra
         transform(index,pos);
         estimate(from,pos,I[index.index()],type);
     }
+    move_assign(from,std::move(I));
 }
 
 
@@ -1174,5 +1194,243 @@ void resample(ImageType& from,const ContainerType& trans,interpolation_type type
     resample(from,transform,type);
 }
 
+/*
+ * compiled_warp precomputes, for every voxel of the target grid, the base (floor)
+ * index into the source grid and quantized 16-bit interpolation weights. It is built
+ * once from a transformation, a mapping, or a displacement field, and then applied to
+ * any number of images sharing the source grid (e.g. atlas labels, other contrasts).
+ *
+ * store_weights = true : keep all 2^dim weights per voxel (faster apply, more memory)
+ * store_weights = false: keep only dim fractions per voxel and expand them on apply
+ *
+ * Target voxels falling outside the source (as defined by linear interpolation) are
+ * left untouched by apply, in the same way as estimate() does.
+ */
+template<int dim,typename index_type = uint32_t>
+class compiled_warp
+{
+public:
+    static const unsigned int ref_count = 1 << dim;
+    static const index_type invalid_index = std::numeric_limits<index_type>::max();
+    tipl::shape<dim> from_geo,to_geo;
+private:
+    bool store_weights = false;
+    std::vector<index_type> base;
+    std::vector<uint16_t> weights;
+    size_t offset[ref_count];
+private:
+    void get_offset(void)
+    {
+        size_t stride[dim];
+        stride[0] = 1;
+        for(int d = 1;d < dim;++d)
+            stride[d] = stride[d-1]*from_geo[d-1];
+        for(unsigned int c = 0;c < ref_count;++c)
+        {
+            offset[c] = 0;
+            for(int d = 0;d < dim;++d)
+                if(c & (1 << d))
+                    offset[c] += stride[d];
+        }
+    }
+    template<typename frac_type,typename out_type>
+    static void fractions_to_weights(const frac_type* frac,out_type* w,float scale)
+    {
+        for(unsigned int c = 0;c < ref_count;++c)
+        {
+            float v = scale;
+            for(int d = 0;d < dim;++d)
+                v *= (c & (1 << d)) ? float(frac[d]) : 65535.0f-float(frac[d]);
+            w[c] = out_type(v);
+        }
+    }
+    // returns false if the voxel is not mapped
+    bool get_weights(size_t i,float* w) const
+    {
+        if(base[i] == invalid_index)
+            return false;
+        if(store_weights)
+        {
+            const uint16_t* iw = &weights[i*ref_count];
+            for(unsigned int c = 0;c < ref_count;++c)
+                w[c] = float(iw[c])*(1.0f/65535.0f);
+        }
+        else
+            fractions_to_weights(&weights[i*dim],w,1.0f/std::pow(65535.0f,float(dim)));
+        return true;
+    }
+public:
+    compiled_warp(void){}
+    template<typename transform_type>
+    compiled_warp(const tipl::shape<dim>& from_geo_,const tipl::shape<dim>& to_geo_,
+                  const transform_type& T,bool store_weights_ = false)
+    {
+        build(from_geo_,to_geo_,T,store_weights_);
+    }
+public:
+    size_t size(void) const{return base.size();}
+    bool empty(void) const{return base.empty();}
+    size_t memory_size(void) const
+    {
+        return base.size()*sizeof(index_type)+weights.size()*sizeof(uint16_t);
+    }
+    void clear(void)
+    {
+        base.clear();
+        weights.clear();
+    }
+public:
+    // get_pos(index,pos) returns the source location of the target voxel at index
+    template<typename fun_type>
+    void build_from_fun(const tipl::shape<dim>& from_geo_,const tipl::shape<dim>& to_geo_,
+                        fun_type&& get_pos,bool store_weights_ = false)
+    {
+        from_geo = from_geo_;
+        to_geo = to_geo_;
+        store_weights = store_weights_;
+        if(from_geo.size() >= size_t(invalid_index))
+            throw std::runtime_error("Source image too large for compiled_warp");
+        get_offset();
+        base.resize(to_geo.size());
+        weights.resize(to_geo.size()*(store_weights ? ref_count : dim));
+        tipl::make_image(&base[0],to_geo).for_each_mt([&](index_type& b,const tipl::pixel_index<dim>& index)
+        {
+            tipl::vector<dim,double> pos;
+            get_pos(index,pos);
+            b = invalid_index;
+            size_t base_index = 0;
+            uint16_t frac[dim];
+            for(int d = dim-1;d >= 0;--d)
+            {
+                double x = pos[d];
+                if(x < 0.0)
+                    return;
+                double fx = std::floor(x);
+                size_t ix = size_t(fx);
+                if(ix + 1 >= from_geo[d])
+                    return;
+                frac[d] = uint16_t(std::round((x-fx)*65535.0));
+                base_index = base_index*from_geo[d] + ix;
+            }
+            b = index_type(base_index);
+            if(store_weights)
+                fractions_to_weights(frac,&weights[index.index()*ref_count],1.0f/std::pow(65535.0f,float(dim-1)));
+            else
+                std::copy(frac,frac+dim,&weights[index.index()*dim]);
+        });
+    }
+    // T(index,pos) as in resample_mt
+    template<typename transform_type>
+    void build(const tipl::shape<dim>& from_geo_,const tipl::shape<dim>& to_geo_,
+               const transform_type& T,bool store_weights_ = false)
+    {
+        build_from_fun(from_geo_,to_geo_,[&T](const tipl::pixel_index<dim>& index,tipl::vector<dim,double>& pos)
+        {
+            T(index,pos);
+        },store_weights_);
+    }
+    template<typename value_type>
+    void build(const tipl::shape<dim>& from_geo_,const tipl::shape<dim>& to_geo_,
+               const tipl::matrix<dim+1,dim+1,value_type>& trans,bool store_weights_ = false)
+    {
+        build(from_geo_,to_geo_,tipl::transformation_matrix<value_type>(trans),store_weights_);
+    }
+    // mapping stores the source location of each target voxel, as in compose_mapping
+    template<typename MappingType>
+    void build_from_mapping(const tipl::shape<dim>& from_geo_,const MappingType& mapping,bool store_weights_ = false)
+    {
+        build_from_fun(from_geo_,mapping.shape(),[&mapping](const tipl::pixel_index<dim>& index,tipl::vector<dim,double>& pos)
+        {
+            pos = mapping[index.index()];
+        },store_weights_);
+    }
+    // source location = index + dis[index], as in compose_displacement
+    template<typename DisType>
+    void build_from_displacement(const tipl::shape<dim>& from_geo_,const DisType& dis,bool store_weights_ = false)
+    {
+        build_from_fun(from_geo_,dis.shape(),[&dis](const tipl::pixel_index<dim>& index,tipl::vector<dim,double>& pos)
+        {
+            pos = index;
+            pos += dis[index.index()];
+        },store_weights_);
+    }
+    // source location = T(index + dis[index]), as in compose_displacement_with_affine
+    template<typename DisType,typename transform_type>
+    void build_from_displacement(const tipl::shape<dim>& from_geo_,const DisType& dis,
+                                 const transform_type& T,bool store_weights_ = false)
+    {
+        build_from_fun(from_geo_,dis.shape(),[&dis,&T](const tipl::pixel_index<dim>& index,tipl::vector<dim,double>& pos)
+        {
+            tipl::vector<dim,double> vtor(index);
+            vtor += dis[index.index()];
+            T(vtor,pos);
+        },store_weights_);
+    }
+public:
+    template<typename ImageType1,typename ImageType2>
+    bool apply(const ImageType1& from,ImageType2& to,interpolation_type type = interpolation_type::linear) const
+    {
+        if(from.shape() != from_geo)
+            return false;
+        if(to.shape() != to_geo)
+            to.resize(to_geo);
+        using value_type = typename ImageType2::value_type;
+        tipl::par_for(base.size(),[&](size_t i)
+        {
+            float w[ref_count];
+            if(!get_weights(i,w))
+                return;
+            size_t b = base[i];
+            if(type == interpolation_type::nearest)
+            {
+                to[i] = from[b+offset[std::max_element(w,w+ref_count)-w]];
+                return;
+            }
+            size_t dindex[ref_count];
+            for(unsigned int c = 0;c < ref_count;++c)
+                dindex[c] = b + offset[c];
+            weighting_sum<typename interpolator<value_type>::type>()(
+                const_reference_iterator<ImageType1,size_t*>(from,dindex),
+                const_reference_iterator<ImageType1,size_t*>(from,dindex+ref_count),w,to[i]);
+        });
+        return true;
+    }
+    // for label images: assign the label with the largest summed weight among the neighbors
+    template<typename ImageType1,typename ImageType2>
+    bool apply_label(const ImageType1& from,ImageType2& to) const
+    {
+        if(from.shape() != from_geo)
+            return false;
+        if(to.shape() != to_geo)
+            to.resize(to_geo);
+        tipl::par_for(base.size(),[&](size_t i)
+        {
+            float w[ref_count];
+            if(!get_weights(i,w))
+                return;
+            size_t b = base[i];
+            typename ImageType1::value_type label[ref_count];
+            for(unsigned int c = 0;c < ref_count;++c)
+                label[c] = from[b+offset[c]];
+            unsigned int best = 0;
+            float best_w = 0.0f;
+            for(unsigned int c = 0;c < ref_count;++c)
+            {
+                float sum_w = 0.0f;
+                for(unsigned int j = 0;j < ref_count;++j)
+                    if(label[j] == label[c])
+                        sum_w += w[j];
+                if(sum_w > best_w)
+                {
+                    best_w = sum_w;
+                    best = c;
+                }
+            }
+            to[i] = label[best];
+        });
+        return true;
+    }
+};
+
 }
 #endif
@@ -2,10 +2,12 @@
 #define STATISTICS_HPP
 #include <cmath>
 #include <algorithm>
+#include <functional>
 #include <numeric>
 #include <utility>
 #include "numerical.hpp"
 #include "matrix.hpp"
+#include "../utility/masked_image.hpp"
 
 namespace tipl
 {
@@ -127,10 +129,11 @@ double gaussian_distribution(value_type x,value_type mean,value_type variance,va
     return x;
 }
 
+// multithreaded, and reproducible for any thread count (see par_transform_reduce)
 template<typename input_iterator>
 double mean(input_iterator from,input_iterator to)
 {
-    return from == to ? 0.0 : std::accumulate(from,to,0.0)/((double)(to-from));
+    return from == to ? 0.0 : par_reduce(from,to,0.0,std::plus<double>())/((double)(to-from));
 }
 
 template<typename image_type>
@@ -204,14 +207,13 @@ std::pair<double,double> mean_variance(input_iterator from,input_iterator to)
 template<typename input_iterator>
 double mean_square(input_iterator from,input_iterator to)
 {
-    double ms = 0.0;
+    using value_type = typename std::iterator_traits<input_iterator>::value_type;
     size_t size = to-from;
-    while (from != to)
+    double ms = par_transform_reduce(from,to,0.0,std::plus<double>(),[](const value_type& v)
     {
-        double t = *from;
-        ms += t*t;
-        ++from;
-    }
+        double t = v;
+        return t*t;
+    });
     if(size)
         ms /= size;
     return ms;
@@ -291,14 +293,11 @@ template<typename input_iterator1,typename input_iterator2>
 double covariance(input_iterator1 x_from,input_iterator1 x_to,
                   input_iterator2 y_from,double mean_x,double mean_y)
 {
-    double co = 0.0;
     size_t size = x_to-x_from;
-    while (x_from != x_to)
+    double co = par_transform_reduce(size,0.0,std::plus<double>(),[&](size_t i)
     {
-        co += *x_from*(*y_from);
-        ++x_from;
-        ++y_from;
-    }
+        return double(x_from[i])*double(y_from[i]);
+    });
     if(size)
         co /= size;
     return co-mean_x*mean_y;
@@ -328,6 +327,33 @@ double correlation(input_iterator1 x_from,input_iterator1 x_to,
     return correlation(x_from,x_to,y_from,mean(x_from,x_to),mean(y_from,y_from+(x_to-x_from)));
 }
 
+// statistics over the stored voxels of masked images
+template<int dim,typename value_type>
+double variance(const masked_image<dim,value_type>& I)
+{
+    return variance(I.begin(),I.end(),mean(I.begin(),I.end()));
+}
+template<int dim,typename value_type>
+double standard_deviation(const masked_image<dim,value_type>& I)
+{
+    return standard_deviation(I.begin(),I.end());
+}
+// x and y share the same mask
+template<int dim,typename value_type1,typename value_type2>
+double correlation(const masked_image<dim,value_type1>& x,const masked_image<dim,value_type2>& y)
+{
+    return correlation(x.begin(),x.end(),y.begin());
+}
+// correlation between x and a dense image y within the mask of x
+template<int dim,typename value_type,typename image_type>
+double correlation(const masked_image<dim,value_type>& x,const image_type& y)
+{
+    masked_image<dim,typename image_type::value_type> y_in_mask;
+    y_in_mask.set_mask(x);
+    y_in_mask.load_from_image(y);
+    return correlation(x.begin(),x.end(),y_in_mask.begin());
+}
+
 template<typename input_iterator1,typename input_iterator2>
 double t_statistics(input_iterator1 x_from,input_iterator1 x_to,input_iterator2 y_from,input_iterator2 y_to)
 {
@@ -0,0 +1,168 @@
+#ifndef BATCH_REG_HPP
+#define BATCH_REG_HPP
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "../utility/multi_thread.hpp"
+#include "linear.hpp"
+#include "cdm.hpp"
+
+namespace tipl
+{
+namespace reg
+{
+
+// lets a cost function keep its template-side precomputation for all subjects
+template<typename cost_type>
+void keep_template_side(cost_type&){}
+inline void keep_template_side(mutual_information& cost)
+{
+    cost.keep_from_images();
+}
+
+/*
+ * Registers many subjects to one template. The template pyramid, and the
+ * normalized template and histogram of each level for mutual_information, are
+ * computed once and shared by all subjects. The subjects are scheduled on a shared
+ * thread budget: several subjects run side by side, each capped at
+ * subject_thread_count threads (see tipl::max_thread_count), so that the
+ * serial phases of one registration are filled by the others.
+ *
+ * The linear stage maps the template space to the subject space, the nonlinear
+ * stage (cdm) then runs on the subject resampled into the template space.
+ */
+template<typename image_type,typename CostFunctionType = mutual_information>
+class batch_reg{
+public:
+    static const unsigned int dimension = image_type::dimension;
+    typedef tipl::vector<dimension> vs_type;
+    typedef tipl::image<dimension,tipl::vector<dimension> > dis_type;
+    typedef tipl::transformation_matrix<float> transform_type;
+    struct result_type{
+        bool ok = false;
+        tipl::affine_transform<float> arg;
+        transform_type T;           // template space to subject space
+        dis_type dis;               // displacement in the template space
+        float linear_cost = 0.0f;
+        float nonlinear_cost = 0.0f;
+        double load_time = 0.0;     // in milliseconds
+        double linear_time = 0.0;
+        double nonlinear_time = 0.0;
+    };
+public:
+    reg_type linear_type = affine;
+    const float* bound = reg_bound;
+    bool nonlinear = true;
+    cdm_param param;
+    unsigned int thread_count = std::thread::hardware_concurrency();
+    unsigned int subject_thread_count = 4;
+private:
+    vs_type It_vs;
+    std::vector<image_type> It_pyramid;
+    CostFunctionType cost;
+public:
+    batch_reg(const image_type& It,const vs_type& It_vs_,cdm_param param_ = cdm_param(),
+              CostFunctionType cost_ = CostFunctionType()):
+        param(param_),It_vs(It_vs_),cost(cost_)
+    {
+        keep_template_side(cost);
+        image_type I(It);
+        cdm_pre(I);
+        cdm_pyramid(I,It_pyramid,param);
+        // linear_mr goes down to 64 voxels, cdm to param.min_dimension
+        while(*std::max_element(It_pyramid.back().shape().begin(),It_pyramid.back().shape().end()) > 64)
+        {
+            image_type rI;
+            downsample_with_padding(It_pyramid.back(),rI);
+            It_pyramid.push_back(std::move(rI));
+        }
+    }
+    const image_type& get_template(void) const{return It_pyramid[0];}
+public:
+    /*
+     * load(i,I,vs) reads subject i and returns false if it cannot be loaded.
+     * output(i,result) is called as soon as subject i is done, after which the
+     * displacement field is released. The returned results keep the transforms,
+     * costs, and timings of all subjects.
+     */
+    template<typename loader_type,typename output_type,typename terminated_type>
+    std::vector<result_type> run(size_t subject_count,
+                                 loader_type&& load,
+                                 output_type&& output,
+                                 terminated_type& terminated)
+    {
+        std::vector<result_type> results(subject_count);
+        unsigned int per_subject = std::max<unsigned int>(1,std::min(subject_thread_count,thread_count));
+        unsigned int concurrent = std::max<unsigned int>(1,thread_count/per_subject);
+        // the budget places concurrent subjects on distinct cores, see thread_affinity
+        thread_count_scope budget(concurrent*per_subject);
+        par_for_asyn(subject_count,[&](size_t i)
+        {
+            if(terminated)
+                return;
+            thread_count_scope scope(per_subject);
+            result_type& result = results[i];
+            run_subject(i,result,load,terminated);
+            output(i,result);
+            result.dis = dis_type();
+        },concurrent);
+        return results;
+    }
+private:
+    template<typename loader_type,typename terminated_type>
+    void run_subject(size_t i,result_type& result,loader_type& load,terminated_type& terminated)
+    {
+        const image_type& It = It_pyramid[0];
+        tipl::time t;
+        image_type I;
+        vs_type I_vs;
+        if(!load(i,I,I_vs) || I.empty())
+            return;
+        result.load_time = t.elapsed<std::chrono::milliseconds>();
+
+        t.restart();
+        // the coarse levels as in linear_mr, then one pass at full resolution with the final precision
+        int random_search = 20;
+        if(It_pyramid.size() > 1 &&
+           *std::max_element(It.shape().begin(),It.shape().end()) > 64 &&
+           *std::max_element(I.shape().begin(),I.shape().end()) > 64)
+        {
+            image_type I_r;
+            vs_type It_vs_r(It_vs),I_vs_r(I_vs);
+            downsample_with_padding(I,I_r);
+            It_vs_r *= 2.0;
+            I_vs_r *= 2.0;
+            tipl::affine_transform<float> arg_r(result.arg);
+            arg_r.downsampling();
+            linear_mr(It_pyramid,It_vs_r,I_r,I_vs_r,arg_r,linear_type,cost,terminated,0.1,bound,default_optimizer,1);
+            arg_r.upsampling();
+            result.arg = arg_r;
+            random_search = 0;
+            if(terminated)
+                return;
+        }
+        result.linear_cost = linear(It,It_vs,I,I_vs,result.arg,linear_type,cost,terminated,0.001,random_search,bound);
+        result.T = transform_type(result.arg,It.shape(),It_vs,I.shape(),I_vs);
+        result.linear_time = t.elapsed<std::chrono::milliseconds>();
+        if(terminated)
+            return;
+
+        if(nonlinear)
+        {
+            t.restart();
+            image_type Is(It.shape());
+            resample_mt(I,Is,result.T);
+            I = image_type();
+            cdm_pre(Is);
+            result.nonlinear_cost = cdm(It_pyramid,Is,result.dis,terminated,param);
+            result.nonlinear_time = t.elapsed<std::chrono::milliseconds>();
+            if(terminated)
+                return;
+        }
+        result.ok = true;
+    }
+};
+
+}
+}
+#endif//BATCH_REG_HPP
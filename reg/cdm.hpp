@@ -5,6 +5,8 @@
 #include "../filter/gaussian.hpp"
 #include "../filter/filter_model.hpp"
 #include "../utility/multi_thread.hpp"
+#include "../utility/pool.hpp"
+#include "../utility/halo_image.hpp"
 #include "../numerical/resampling.hpp"
 #include "../numerical/statistics.hpp"
 #include "../numerical/window.hpp"
@@ -81,7 +83,7 @@ void cdm_update_contrast(const std::vector<image<dimension,pixel_type> >& Ji,
 
 
 // trim the image size to uniform
-template<typename pixel_type,unsigned int dimension,typename crop_type>
+template<typename pixel_type,int dimension,typename crop_type>
 void cdm_trim_images(std::vector<image<dimension,pixel_type> >& I,
                       crop_type& crop_from,crop_type& crop_to)
 {
@@ -90,7 +92,7 @@ void cdm_trim_images(std::vector<image<dimension,pixel_type> >& I,
     vector<dimension,int> min_from,max_to;
     for(int index = 0;index < I.size();++index)
     {
-        crop(I[index],crop_from[index],crop_to[index]);
+        bounding_box(I[index],crop_from[index],crop_to[index],pixel_type(0));
         if(index == 0)
         {
             min_from = crop_from[0];
@@ -99,22 +101,26 @@ void cdm_trim_images(std::vector<image<dimension,pixel_type> >& I,
         else
             for(int dim = 0;dim < dimension;++dim)
             {
-                min_from[dim] = std::min(crop_from[index][dim],min_from[dim]);
-                max_to[dim] = std::max(crop_to[index][dim],max_to[dim]);
+                min_from[dim] = std::min<int>(crop_from[index][dim],min_from[dim]);
+                max_to[dim] = std::max<int>(crop_to[index][dim],max_to[dim]);
             }
     }
     max_to -= min_from;
     int safe_margin = std::accumulate(max_to.begin(),max_to.end(),0.0f)/float(dimension)/2.0f;
     max_to += safe_margin;
     shape<dimension> geo(max_to.begin());
-    // align with respect to the min_from
+    // align with respect to the min_from, the bounding box is copied
+    // straight from the original image into its place in the new one
     for(int index = 0;index < I.size();++index)
     {
         image<dimension,float> new_I(geo);
         vector<dimension,int> pos(crop_from[index]);
         pos -= min_from;
         pos += safe_margin/2;
-        draw(I[index],new_I,pos);
+        vector<dimension,int> pos_to(pos),src_from(crop_from[index]),src_to(crop_to[index]);
+        pos_to += src_to;
+        pos_to -= src_from;
+        make_sub_image(new_I,pos,pos_to).load_from_image(make_sub_image(I[index],src_from,src_to));
         new_I.swap(I[index]);
         crop_from[index] -= pos;
         crop_to[index] = crop_from[index];
@@ -319,20 +325,26 @@ void cdm_group(const std::vector<image<dimension,pixel_type> >& I,// original im
     std::cout << std::endl;
 }
 
+inline std::pair<double,size_t> cdm_add_r2(const std::pair<double,size_t>& a,const std::pair<double,size_t>& b)
+{
+    return std::make_pair(a.first+b.first,a.second+b.second);
+}
+
 // calculate dJ(cJ-I)
 template<typename image_type,typename dis_type>
 float cdm_get_gradient(const image_type& Js,const image_type& It,dis_type& new_d)
 {
-    float accumulated_r2 = 0.0f;
-    unsigned int r_num = 0;
     const unsigned int window_size = 2;
     gradient_sobel(Js,new_d);
-    Js.for_each_mt([&](typename image_type::value_type,pixel_index<image_type::dimension>& index){
-        if(It[index.index()] == 0.0 || Js[index.index()] == 0.0 ||
-           It.shape().is_edge(index))
+    // the sum of r2 and the number of voxels that contribute
+    using r2_sum = std::pair<double,size_t>;
+    r2_sum sum = par_transform_reduce(Js.size(),r2_sum(0.0,0),cdm_add_r2,[&](size_t i)
+    {
+        pixel_index<image_type::dimension> index(i,Js.shape());
+        if(It[i] == 0.0 || Js[i] == 0.0 || It.shape().is_edge(index))
         {
-            new_d[index.index()] = typename dis_type::value_type();
-            return;
+            new_d[i] = typename dis_type::value_type();
+            return r2_sum(0.0,0);
         }
         std::vector<typename image_type::value_type> Itv,Jv;
         get_window(index,It,window_size,Itv);
@@ -340,15 +352,14 @@ float cdm_get_gradient(const image_type& Js,const image_type& It,dis_type& new_d
         float a,b,r2;
         linear_regression(Jv.begin(),Jv.end(),Itv.begin(),a,b,r2);
         if(a <= 0.0f)
-            new_d[index.index()] = typename dis_type::value_type();
-        else
         {
-            new_d[index.index()] *= r2*(Js[index.index()]*a+b-It[index.index()]);
-            accumulated_r2 += r2;
-            ++r_num;
+            new_d[i] = typename dis_type::value_type();
+            return r2_sum(0.0,0);
         }
+        new_d[i] *= r2*(Js[i]*a+b-It[i]);
+        return r2_sum(r2,1);
     });
-    return accumulated_r2/float(r_num);
+    return float(sum.first/double(sum.second));
 }
 
 
@@ -356,23 +367,21 @@ float cdm_get_gradient(const image_type& Js,const image_type& It,dis_type& new_d
 template<typename image_type,typename dis_type>
 float cdm_get_gradient_abs_dif(const image_type& Js,const image_type& It,dis_type& new_d)
 {
-    float accumulated_r2 = 0.0f;
-    unsigned int r_num = 0;
     gradient_sobel(Js,new_d);
-    Js.for_each_mt([&](typename image_type::value_type,pixel_index<image_type::dimension>& index){
-        if(It[index.index()] == 0.0 ||
-           Js[index.index()] == 0.0 ||
-           It.shape().is_edge(index))
+    using r2_sum = std::pair<double,size_t>;
+    r2_sum sum = par_transform_reduce(Js.size(),r2_sum(0.0,0),cdm_add_r2,[&](size_t i)
+    {
+        if(It[i] == 0.0 || Js[i] == 0.0 ||
+           It.shape().is_edge(pixel_index<image_type::dimension>(i,Js.shape())))
         {
-            new_d[index.index()] = typename dis_type::value_type();
-            return;
+            new_d[i] = typename dis_type::value_type();
+            return r2_sum(0.0,0);
         }
-        auto dif = Js[index.index()]-It[index.index()];
-        new_d[index.index()] *= dif;
-        accumulated_r2 += dif*dif;
-        ++r_num;
+        auto dif = Js[i]-It[i];
+        new_d[i] *= dif;
+        return r2_sum(dif*dif,1);
     });
-    return accumulated_r2/float(r_num);
+    return float(sum.first/double(sum.second));
 }
 
 
@@ -418,49 +427,50 @@ template<typename dis_type,typename terminated_type>
 void cdm_solve_poisson(tipl::image<3,dis_type>& new_d,terminated_type& terminated)
 {
     float inv_d2 = 0.5f/3.0f;
-    tipl::image<3,dis_type> solve_d(new_d);
-    multiply_constant_mt(solve_d,-inv_d2);
-
+    // the Jacobi sweeps run branch-free over the interior of a zero halo,
+    // alternating between two pooled buffers
+    typedef halo_image<3,dis_type,aligned_container<dis_type> > solve_type;
+    solve_type cur(new_d,1),next(new_d.shape(),1);
     int w = new_d.width();
-    int wh = new_d.plane_size();
+    size_t sy = cur.stride(1);
+    size_t sz = cur.stride(2);
+    cur.for_each_row_mt([&](size_t p,size_t)
+    {
+        for(int x = 0;x < w;++x)
+            cur[p+x] *= -inv_d2;
+    });
     for(int iter = 0;iter < 6 && !terminated;++iter)
     {
-        tipl::image<3,dis_type> new_solve_d(new_d.shape());
-        tipl::par_for(solve_d.size(),[&](int pos)
+        const dis_type* c = &cur[0];
+        dis_type* n = &next[0];
+        cur.for_each_row_mt([&](size_t p,size_t i)
         {
-            auto v = new_solve_d[pos];
-            {
-                int p1 = pos-1;
-                int p2 = pos+1;
-                if(p1 >= 0)
-                   v += solve_d[p1];
-                if(p2 < solve_d.size())
-                   v += solve_d[p2];
-            }
-            {
-                int p1 = pos-w;
-                int p2 = pos+w;
-                if(p1 >= 0)
-                   v += solve_d[p1];
-                if(p2 < solve_d.size())
-                   v += solve_d[p2];
-            }
+            const dis_type* src = &new_d[i];
+            for(int x = 0;x < w;++x,++p)
             {
-                int p1 = pos-wh;
-                int p2 = pos+wh;
-                if(p1 >= 0)
-                   v += solve_d[p1];
-                if(p2 < solve_d.size())
-                   v += solve_d[p2];
+                dis_type v = c[p-1];
+                v += c[p+1];
+                v += c[p-sy];
+                v += c[p+sy];
+                v += c[p-sz];
+                v += c[p+sz];
+                v -= src[x];
+                v *= inv_d2;
+                n[p] = v;
             }
-            v -= new_d[pos];
-            v *= inv_d2;
-            new_solve_d[pos] = v;
         });
-        solve_d.swap(new_solve_d);
+        cur.swap(next);
     }
-    minus_constant_mt(solve_d,solve_d[0]);
-    new_d.swap(solve_d);
+    cur.save_to_image(new_d);
+    minus_constant_mt(new_d,new_d[0]);
+}
+
+// the Jacobi sweeps run on each component plane
+template<int dim,typename vtype,typename terminated_type>
+void cdm_solve_poisson(soa_image<dim,vtype>& new_d,terminated_type& terminated)
+{
+    for(int k = 0;k < dim && !terminated;++k)
+        cdm_solve_poisson(new_d.plane(k),terminated);
 }
 
 template<typename dist_type,typename value_type>
@@ -469,12 +479,9 @@ void cdm_accumulate_dis(dist_type& d,dist_type& new_d,value_type& theta,float cd
     value_type cdm_smoothness2 = value_type(1.0)-cdm_smoothness;
     if(theta == 0.0)
     {
-        par_for(new_d.size(),[&](int i)
-        {
-           value_type l = new_d[i].length();
-           if(l > theta)
-               theta = l;
-        });
+        theta = par_transform_reduce(new_d.size(),value_type(0),
+                    [](value_type a,value_type b){return std::max(a,b);},
+                    [&](size_t i){return value_type(new_d[i].length());});
     }
     multiply_constant_mt(new_d,0.5f/theta);
     add(new_d,d);
@@ -513,6 +520,60 @@ void cdm_accumulate_dis(dist_type& d,dist_type& new_d,value_type& theta,float cd
     }
 }
 
+template<int dim,typename vtype,typename value_type>
+void cdm_accumulate_dis(soa_image<dim,vtype>& d,soa_image<dim,vtype>& new_d,value_type& theta,float cdm_smoothness,float constrain_length)
+{
+    value_type cdm_smoothness2 = value_type(1.0)-cdm_smoothness;
+    if(theta == 0.0)
+    {
+        value_type max_l2 = par_transform_reduce(new_d.size(),value_type(0),
+                    [](value_type a,value_type b){return std::max(a,b);},[&](size_t i)
+        {
+            value_type l2 = 0;
+            for(int k = 0;k < dim;++k)
+                l2 += new_d.plane(k)[i]*new_d.plane(k)[i];
+            return l2;
+        });
+        theta = std::sqrt(max_l2);
+    }
+    for(int k = 0;k < dim;++k)
+    {
+        auto& plane = new_d.plane(k);
+        multiply_constant_mt(plane,0.5f/theta);
+        add(plane,d.plane(k));
+        image<dim,vtype> plane_s(plane);
+        filter::gaussian2(plane_s);
+        par_for(plane.size(),[&](size_t i){
+            plane[i] = plane[i]*cdm_smoothness2+plane_s[i]*cdm_smoothness;
+        });
+    }
+    new_d.swap(d);
+
+    // the constraint on each axis only involves the plane of that component
+    size_t shift = 1;
+    for(unsigned char k = 0;k < dim;++k)
+    {
+        auto dim_length = d.shape()[k];
+        auto& plane = d.plane(k);
+        plane.for_each_mt([&](vtype& v1,const tipl::pixel_index<dim>& pos)
+        {
+            if(v1 > 0.0f && pos[k] + 1 < int(dim_length))
+            {
+                auto& v2 = plane[pos.index()+shift];
+                auto dis = v2-v1;
+                auto abs_dis = std::fabs(dis);
+                if(abs_dis > constrain_length)
+                {
+                    dis *= 0.5f*(abs_dis-constrain_length)/abs_dis;
+                    v1 += dis;
+                    v2 -= dis;
+                }
+            }
+        });
+        shift *= dim_length;
+    }
+}
+
 template<typename r_type>
 bool cdm_improved(r_type& r,r_type& iter)
 {
@@ -540,6 +601,55 @@ struct cdm_param{
     bool multi_resolution = true;
 };
 
+/*
+ * cdm iterations at a single resolution, d is the initial displacement field
+ */
+template<typename image_type,typename dist_type,typename terminate_type>
+float cdm_iterate(const image_type& It,
+                  const image_type& Is,
+                  dist_type& d,// displacement field
+                  terminate_type& terminated,
+                  const cdm_param& param)
+{
+    image_type Js;// transformed I
+    dist_type new_d(d.shape());// new displacements
+    float theta = 0.0;
+
+    std::deque<float> r,iter;
+    for (unsigned int index = 0;index < param.iterations && !terminated;++index)
+    {
+        compose_displacement(Is,d,Js);
+        // dJ(cJ-I)
+        r.push_back(cdm_get_gradient(Js,It,new_d));
+        iter.push_back(index);
+        if(!cdm_improved(r,iter))
+            break;
+        // solving the poisson equation using Jacobi method
+        cdm_solve_poisson(new_d,terminated);
+        cdm_accumulate_dis(d,new_d,theta,param.cdm_smoothness,param.contraint);
+    }
+    return r.empty() ? 0.0f : r.front();
+}
+
+/*
+ * the downsampled images used by the multi-resolution cdm, pyramid[0] is I itself
+ */
+template<typename image_type>
+void cdm_pyramid(const image_type& I,std::vector<image_type>& pyramid,cdm_param param = cdm_param())
+{
+    pyramid.resize(1);
+    pyramid[0] = I;
+    while(param.multi_resolution)
+    {
+        auto geo = pyramid.back().shape();
+        if(*std::min_element(geo.begin(),geo.end()) <= param.min_dimension)
+            break;
+        image_type rI;
+        downsample_with_padding(pyramid.back(),rI);
+        pyramid.push_back(std::move(rI));
+    }
+}
+
 /*
  * cdm_smoothness 0.1: more smooth 0.9: less smooth
  */
@@ -571,24 +681,44 @@ float cdm(const image_type& It,
         if(param.resolution > 1.0f)
             return r;
     }
-    image_type Js;// transformed I
-    dist_type new_d(d.shape());// new displacements
-    float theta = 0.0;
+    return cdm_iterate(It,Is,d,terminated,param);
+}
 
-    std::deque<float> r,iter;
-    for (unsigned int index = 0;index < param.iterations && !terminated;++index)
+/*
+ * Same as cdm but takes the template pyramid precomputed by cdm_pyramid,
+ * so that it can be shared by the registration of many subjects.
+ */
+template<typename image_type,typename dist_type,typename terminate_type>
+float cdm(const std::vector<image_type>& It_pyramid,
+            const image_type& Is,
+            dist_type& d,// displacement field
+            terminate_type& terminated,
+            cdm_param param = cdm_param(),
+            unsigned int level = 0)
+{
+    const image_type& It = It_pyramid[level];
+    if(It.shape() != Is.shape())
+        throw "Inconsistent image dimension";
+    auto geo = It.shape();
+    d.resize(It.shape());
+
+    // multi resolution
+    if (level+1 < It_pyramid.size() &&
+        *std::min_element(geo.begin(),geo.end()) > param.min_dimension && param.multi_resolution)
     {
-        compose_displacement(Is,d,Js);
-        // dJ(cJ-I)
-        r.push_back(cdm_get_gradient(Js,It,new_d));
-        iter.push_back(index);
-        if(!cdm_improved(r,iter))
-            break;
-        // solving the poisson equation using Jacobi method
-        cdm_solve_poisson(new_d,terminated);
-        cdm_accumulate_dis(d,new_d,theta,param.cdm_smoothness,param.contraint);
+        //downsampling
+        image_type rIs;
+        downsample_with_padding(Is,rIs);
+        cdm_param param2 = param;
+        param2.resolution /= 2.0f;
+        param2.iterations *= 2;
+        float r = cdm(It_pyramid,rIs,d,terminated,param2,level+1);
+        upsample_with_padding(d,d,geo);
+        d *= 2.0f;
+        if(param.resolution > 1.0f)
+            return r;
     }
-    return r.front();
+    return cdm_iterate(It,Is,d,terminated,param);
 }
 
 template<typename image_type>
@@ -3,7 +3,11 @@
 #include <limits>
 #include <future>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <cstdlib>     /* srand, rand */
 #include <ctime>
 #include "../numerical/interpolation.hpp"
@@ -78,6 +82,16 @@ struct correlation
         float c = tipl::correlation(Ifrom.begin(),Ifrom.end(),y.begin());
         return -c*c;
     }
+    // only the in-mask voxels of Ifrom are resampled and compared
+    template<int dim,typename value_type,typename ImageType,typename TransformType>
+    double operator()(const tipl::masked_image<dim,value_type>& Ifrom,const ImageType& Ito,const TransformType& transform)
+    {
+        tipl::masked_image<dim,value_type> y;
+        y.set_mask(Ifrom);
+        tipl::resample_mt(Ito,y,transform,tipl::linear);
+        float c = tipl::correlation(Ifrom,y);
+        return -c*c;
+    }
 };
 
 template<typename image_type,typename transform_type>
@@ -85,47 +99,82 @@ struct mt_correlation
 {
     typedef double value_type;
     std::list<std::shared_ptr<std::future<void> > > threads;
-    std::vector<unsigned char> status;
+    unsigned int thread_count;
     const image_type* I1;
     const image_type* I2;
     image_type Y;
     transform_type T;
     double mean_from;
     double sd_from;
+    struct shared_type{
+        std::mutex lock;
+        const image_type* from = 0;
+        double mean_from = 0.0;
+        double sd_from = 0.0;
+    };
+    // mean and sd of the "from" image, shared read-only by all copies of this cost function
+    std::shared_ptr<shared_type> shared;
     bool end;
-    mt_correlation(int){}
-    mt_correlation(void):end(false),status(std::thread::hardware_concurrency()),I1(0)
+    // workers wait for a new round and the caller waits until no work is pending
+    std::mutex lock;
+    std::condition_variable start_round,end_round;
+    unsigned int round_id = 0;
+    unsigned int pending = 0;
+    mt_correlation(int):thread_count(1),I1(0),shared(std::make_shared<shared_type>()),end(false){}
+    mt_correlation(void):thread_count(std::thread::hardware_concurrency()),I1(0),
+        shared(std::make_shared<shared_type>()),end(false)
+    {
+
+    }
+    /*
+     * the optimizers already evaluate per-thread copies in parallel
+     * (see optimization::par_for_fun), so copies run single-threaded
+     */
+    mt_correlation(const mt_correlation& rhs):thread_count(1),I1(0),shared(rhs.shared),end(false)
     {
 
     }
     ~mt_correlation(void)
     {
-        end = true;
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            end = true;
+        }
+        start_round.notify_all();
         for(auto& i:threads)
             i->wait();
     }
     void evaluate(unsigned int id)
     {
-        while(!end)
+        unsigned int size = I1->size();
+        unsigned int thread_size = (size/thread_count)+1;
+        unsigned int from_size = id*thread_size;
+        unsigned int to_size = std::min<unsigned int>(size,(id+1)*thread_size);
+        tipl::shape<image_type::dimension> geo(I1->shape());
+        for (tipl::pixel_index<image_type::dimension> index(from_size,geo);
+             index < to_size;++index)
+        {
+            tipl::vector<image_type::dimension,double> pos;
+            T(index,pos);
+            tipl::estimate(*I2,pos,Y[index.index()],tipl::linear);
+        }
+    }
+    void worker(unsigned int id)
+    {
+        unsigned int cur_round = 0;
+        while(true)
         {
-            if(status[id] == 1)
             {
-                unsigned int size = I1->size();
-                unsigned int thread_size = (size/status.size())+1;
-                unsigned int from_size = id*thread_size;
-                unsigned int to_size = std::min<unsigned int>(size,(id+1)*thread_size);
-                tipl::shape<image_type::dimension> geo(I1->shape());
-                for (tipl::pixel_index<image_type::dimension> index(from_size,geo);
-                     index < to_size;++index)
-                {
-                    tipl::vector<image_type::dimension,double> pos;
-                    T(index,pos);
-                    tipl::estimate(*I2,pos,Y[index.index()],tipl::linear);
-                }
-                status[id] = 2;
+                std::unique_lock<std::mutex> lk(lock);
+                start_round.wait(lk,[&](){return end || round_id != cur_round;});
+                if(end)
+                    return;
+                cur_round = round_id;
             }
-            if(id == 0)
-                return;
+            evaluate(id);
+            std::lock_guard<std::mutex> lk(lock);
+            if(--pending == 0)
+                end_round.notify_one();
         }
     }
 
@@ -136,22 +185,43 @@ struct mt_correlation
         {
             I1 = &Ifrom;
             I2 = &Ito;
-            mean_from = tipl::mean(Ifrom.begin(),Ifrom.end());
-            sd_from = tipl::standard_deviation(Ifrom.begin(),Ifrom.end(),mean_from);
+            {
+                std::lock_guard<std::mutex> lk(shared->lock);
+                if(shared->from != &Ifrom)
+                {
+                    shared->mean_from = tipl::mean(Ifrom.begin(),Ifrom.end());
+                    shared->sd_from = tipl::standard_deviation(Ifrom.begin(),Ifrom.end(),shared->mean_from);
+                    shared->from = &Ifrom;
+                }
+                mean_from = shared->mean_from;
+                sd_from = shared->sd_from;
+            }
             Y.resize(Ifrom.shape());
         }
         T = transform;
         image_type y(Ifrom.shape());
         Y.swap(y);
-        std::fill(status.begin(),status.end(),1);
-        if(threads.empty())
-            for(unsigned int index = 1;index < status.size();++index)
-                threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
-                                                                                  [this,index](){evaluate(index);})));
+        if(threads.empty()) // workers start once, within the caller's thread_count_scope
+            worker_thread_count(thread_count);
+        if(thread_count > 1)
+        {
+            if(threads.empty())
+                for(unsigned int index = 1;index < thread_count;++index)
+                    threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
+                                                                                      [this,index](){worker(index);})));
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                pending = thread_count-1;
+                ++round_id;
+            }
+            start_round.notify_all();
+        }
         evaluate(0);
-        for(unsigned int index = 1;index < status.size();++index)
-            if(status[index] == 1)
-                --index;
+        if(thread_count > 1)
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            end_round.wait(lk,[&](){return pending == 0;});
+        }
         double mean_to = tipl::mean(Y.begin(),Y.end());
         double sd_to = tipl::standard_deviation(Y.begin(),Y.end(),mean_to);
         if(sd_from == 0 || sd_to == 0)
@@ -167,81 +237,175 @@ struct mutual_information
     typedef double value_type;
     unsigned int band_width;
     unsigned int his_bandwidth;
-    std::vector<unsigned int> from_hist;
-    std::vector<unsigned char> from;
-    std::vector<unsigned char> to;
-public:
-    mutual_information(unsigned int band_width_ = 6):band_width(band_width_),his_bandwidth(1 << band_width_) {}
+    struct from_type{
+        std::vector<unsigned int> from_hist;
+        std::vector<unsigned char> from;
+    };
+    struct precomputed_type{
+        std::shared_ptr<const from_type> from;
+        std::vector<unsigned char> to;
+    };
+    struct shared_type{
+        std::mutex lock;
+        std::shared_ptr<const precomputed_type> data;
+    };
+    struct from_cache_type{
+        std::mutex lock;
+        std::map<std::pair<const void*,size_t>,std::shared_ptr<const from_type> > data;
+    };
+    // normalized images and histogram, shared read-only by all copies of this cost function
+    std::shared_ptr<shared_type> shared;
+    // normalized "from" images kept across registrations, see keep_from_images
+    std::shared_ptr<from_cache_type> from_cache;
 public:
-    template<typename ImageType,typename TransformType>
-    double operator()(const ImageType& from_,const ImageType& to_,const TransformType& transform)
+    mutual_information(unsigned int band_width_ = 6):band_width(band_width_),his_bandwidth(1 << band_width_),
+        shared(std::make_shared<shared_type>()) {}
+    /*
+     * keeps the normalized "from" images and their histograms, keyed by image
+     * address, for all registrations using this cost function (e.g. many
+     * subjects to one template). The "from" images must stay alive and unchanged.
+     */
+    void keep_from_images(void)
     {
-        if (from_hist.empty() || to_.size() != to.size() || from_.size() != from.size())
+        from_cache = std::make_shared<from_cache_type>();
+    }
+    // a cost function for a new registration, sharing only the kept "from" images
+    mutual_information new_registration(void) const
+    {
+        mutual_information rhs(band_width);
+        rhs.from_cache = from_cache;
+        return rhs;
+    }
+private:
+    template<typename ImageType>
+    std::shared_ptr<const from_type> get_from(const ImageType& from_) const
+    {
+        auto compute = [&]()
         {
-            to.resize(to_.size());
-            from.resize(from_.size());
-            tipl::normalize(to_.begin(),to_.end(),to.begin(),his_bandwidth-1);
-            tipl::normalize(from_.begin(),from_.end(),from.begin(),his_bandwidth-1);
-            tipl::histogram(from,from_hist,0,his_bandwidth-1,his_bandwidth);
+            auto data = std::make_shared<from_type>();
+            data->from.resize(from_.size());
+            tipl::normalize(from_.begin(),from_.end(),data->from.begin(),his_bandwidth-1);
+            tipl::histogram(data->from,data->from_hist,0,his_bandwidth-1,his_bandwidth);
+            return std::shared_ptr<const from_type>(data);
+        };
+        if(!from_cache)
+            return compute();
+        std::lock_guard<std::mutex> lock(from_cache->lock);
+        auto& data = from_cache->data[std::make_pair((const void*)&*from_.begin(),size_t(from_.size()))];
+        if(!data)
+            data = compute();
+        return data;
+    }
+    template<typename FromImageType,typename ToImageType>
+    std::shared_ptr<const precomputed_type> get_precomputed(const FromImageType& from_,const ToImageType& to_)
+    {
+        std::lock_guard<std::mutex> lock(shared->lock);
+        if (!shared->data || to_.size() != shared->data->to.size() || from_.size() != shared->data->from->from.size())
+        {
+            auto data = std::make_shared<precomputed_type>();
+            data->to.resize(to_.size());
+            tipl::normalize(to_.begin(),to_.end(),data->to.begin(),his_bandwidth-1);
+            data->from = get_from(from_);
+            shared->data = data;
         }
-
-
-        // obtain the histogram
-        tipl::shape<ImageType::dimension> geo(from_.shape());
-        unsigned int thread_count = std::thread::hardware_concurrency();
-
-
-        std::vector<tipl::image<2,double> > mutual_hist(thread_count);
-        std::vector<std::vector<double> > to_hist(thread_count);
-        for(int i = 0;i < thread_count;++i)
+        return shared->data;
+    }
+    // the joint and "to" histograms of each thread
+    struct joint_hist_type{
+        std::vector<tipl::image<2,double> > mutual_hist;
+        std::vector<std::vector<double> > to_hist;
+        joint_hist_type(unsigned int thread_count,unsigned int his_bandwidth):
+            mutual_hist(thread_count),to_hist(thread_count)
         {
-            mutual_hist[i].resize(tipl::shape<2>(his_bandwidth,his_bandwidth));
-            to_hist[i].resize(his_bandwidth);
+            for(unsigned int i = 0;i < thread_count;++i)
+            {
+                mutual_hist[i].resize(tipl::shape<2>(his_bandwidth,his_bandwidth));
+                to_hist[i].resize(his_bandwidth);
+            }
         }
-
-        tipl::make_image(&from[0],geo).for_each_mt2([&](unsigned char value,pixel_index<ImageType::dimension> index,int id)
+    };
+    template<unsigned int dim,typename ImageType,typename TransformType>
+    void add_voxel(joint_hist_type& hist,const std::vector<unsigned char>& to,const ImageType& to_,
+                   const TransformType& transform,unsigned char value,const pixel_index<dim>& index,unsigned int id) const
+    {
+        tipl::interpolation<tipl::linear_weighting,dim> interp;
+        unsigned int from_index = ((unsigned int)value) << band_width;
+        tipl::vector<dim,float> pos;
+        transform(index,pos);
+        if (!interp.get_location(to_.shape(),pos))
         {
-            tipl::interpolation<tipl::linear_weighting,ImageType::dimension> interp;
-            unsigned int from_index = ((unsigned int)value) << band_width;
-            tipl::vector<ImageType::dimension,float> pos;
-            transform(index,pos);
-            if (!interp.get_location(to_.shape(),pos))
+            hist.to_hist[id][0] += 1.0;
+            hist.mutual_hist[id][from_index] += 1.0;
+        }
+        else
+            for (unsigned int i = 0; i < tipl::interpolation<tipl::linear_weighting,dim>::ref_count; ++i)
             {
-                to_hist[id][0] += 1.0;
-                mutual_hist[id][from_index] += 1.0;
+                float weighting = interp.ratio[i];
+                unsigned int to_index = to[interp.dindex[i]];
+                hist.to_hist[id][to_index] += weighting;
+                hist.mutual_hist[id][from_index+ to_index] += weighting;
             }
-            else
-                for (unsigned int i = 0; i < tipl::interpolation<tipl::linear_weighting,ImageType::dimension>::ref_count; ++i)
-                {
-                    float weighting = interp.ratio[i];
-                    unsigned int to_index = to[interp.dindex[i]];
-                    to_hist[id][to_index] += weighting;
-                    mutual_hist[id][from_index+ to_index] += weighting;
-                }
-        });
-
-        for(int i = 1;i < thread_count;++i)
+    }
+    double get_cost(joint_hist_type& hist,const std::vector<unsigned int>& from_hist) const
+    {
+        auto& mutual_hist = hist.mutual_hist;
+        auto& to_hist = hist.to_hist;
+        for(size_t i = 1;i < mutual_hist.size();++i)
         {
             tipl::add(mutual_hist[0],mutual_hist[i]);
             tipl::add(to_hist[0],to_hist[i]);
         }
 
         // calculate the cost
+        float sum = 0.0;
+        for (size_t index = 0;index < mutual_hist[0].size();++index)
         {
-            float sum = 0.0;
-            tipl::shape<2> geo(mutual_hist[0].shape());
-            for (tipl::pixel_index<2> index(geo);index < geo.size();++index)
-            {
-                float mu = mutual_hist[0][index.index()];
-                if (mu == 0.0)
-                    continue;
-                sum += mu*std::log(mu/((float)from_hist[index.y()])/to_hist[0][index.x()]);
-            }
-            return -sum;
+            float mu = mutual_hist[0][index];
+            if (mu == 0.0)
+                continue;
+            sum += mu*std::log(mu/((float)from_hist[index >> band_width])/to_hist[0][index & (his_bandwidth-1)]);
         }
+        return -sum;
+    }
+public:
+    template<typename ImageType,typename TransformType>
+    double operator()(const ImageType& from_,const ImageType& to_,const TransformType& transform)
+    {
+        auto data = get_precomputed(from_,to_);
+        joint_hist_type hist(std::thread::hardware_concurrency(),his_bandwidth);
+        tipl::make_image(data->from->from.data(),from_.shape()).for_each_mt2(
+                    [&](unsigned char value,pixel_index<ImageType::dimension> index,int id)
+        {
+            add_voxel(hist,data->to,to_,transform,value,index,id);
+        });
+        return get_cost(hist,data->from->from_hist);
+    }
+    // only the in-mask voxels of from_ are normalized and compared
+    template<int dim,typename value_type,typename ImageType,typename TransformType>
+    double operator()(const tipl::masked_image<dim,value_type>& from_,const ImageType& to_,const TransformType& transform)
+    {
+        auto data = get_precomputed(from_,to_);
+        const std::vector<unsigned char>& from = data->from->from;
+        joint_hist_type hist(std::thread::hardware_concurrency(),his_bandwidth);
+        par_for_block2(from.size(),[&](size_t i,unsigned int id)
+        {
+            add_voxel(hist,data->to,to_,transform,from[i],pixel_index<dim>(from_.index(i),from_.shape()),id);
+        });
+        return get_cost(hist,data->from->from_hist);
     }
 };
 
+// cost function arguments are type tags (e.g. mt_correlation(0)), each registration constructs its own
+template<typename fun_type>
+fun_type make_cost(const fun_type&)
+{
+    return fun_type();
+}
+inline mutual_information make_cost(const mutual_information& rhs)
+{
+    return rhs.new_registration();
+}
+
 template<typename fun_type>
 struct faster
 {
@@ -276,7 +440,8 @@ public:
     param_type& param;
     fun_type fun;
     unsigned int cur_dim = 0;
-    unsigned int count = 0;
+    // number of evaluations, shared by the per-thread copies made by the optimizers
+    std::shared_ptr<std::atomic<unsigned int> > count = std::make_shared<std::atomic<unsigned int> >(0);
 public:
     typedef typename fun_type::value_type value_type;
     typedef typename param_type::value_type param_value_type;
@@ -285,11 +450,15 @@ public:
                 const image_type& to_,const vs_type& to_vs_,param_type& param_):
         from(from_),to(to_),from_vs(from_vs_),to_vs(to_vs_),
         param(param_){}
+    fun_adoptor(const image_type& from_,const vs_type& from_vs_,
+                const image_type& to_,const vs_type& to_vs_,param_type& param_,const fun_type& fun_):
+        from(from_),to(to_),from_vs(from_vs_),to_vs(to_vs_),
+        param(param_),fun(make_cost(fun_)){}
     float operator()(const param_type& new_param)
     {
         transform_type affine(new_param);
         tipl::transformation_matrix<typename transform_type::value_type> T(affine,from.shape(),from_vs,to.shape(),to_vs);
-        ++count;
+        ++*count;
         return fun(from,to,T);
     }
 
@@ -298,20 +467,23 @@ public:
         transform_type affine(param);
         affine[cur_dim] = param_value;
         tipl::transformation_matrix<typename transform_type::value_type> T(affine,from.shape(),from_vs,to.shape(),to_vs);
-        ++count;
+        ++*count;
         return fun(from,to,T);
     }
     float operator()(const param_value_type* param)
     {
         transform_type affine(&*param);
         tipl::transformation_matrix<typename transform_type::value_type> T(affine,from.shape(),from_vs,to.shape(),to_vs);
-        ++count;
+        ++*count;
         return fun(from,to,T);
     }
 };
 
 enum reg_type {none = 0,translocation = 1,rotation = 2,rigid_body = 3,scaling = 4,rigid_scaling = 7,tilt = 8,affine = 15};
 enum cost_type{corr,mutual_info};
+// opt-in optimizers of linear and linear_mr, combined with |
+// the default is random search followed by gradient descent
+enum optimizer_type{default_optimizer = 0,lbfgs_optimizer = 1,cmaes_optimizer = 2};
 
 const float narrow_bound[8] = {0.2f,-0.2f,0.1f, -0.1f, 1.5f,0.9f,0.1f,-0.1f};
 const float reg_bound[8] =    {1.0f,-1.0f,0.25f,-0.25f,2.0f,0.5f,0.2f,-0.2f};
@@ -372,28 +544,42 @@ float linear(const image_type& from,const vs_type& from_vs,
              const image_type& to  ,const vs_type& to_vs,
              transform_type& arg_min,
              reg_type base_type,
-             CostFunctionType,
+             CostFunctionType cost_type,
              teminated_class& terminated,
-             double precision,int random_search_count = 0,const float* bound = reg_bound)
+             double precision,int random_search_count = 0,const float* bound = reg_bound,
+             unsigned int optimizer = default_optimizer)
 {
-    tipl::reg::fun_adoptor<image_type,vs_type,transform_type,transform_type,CostFunctionType> fun(from,from_vs,to,to_vs,arg_min);
+    tipl::reg::fun_adoptor<image_type,vs_type,transform_type,transform_type,CostFunctionType> fun(from,from_vs,to,to_vs,arg_min,cost_type);
     transform_type upper,lower;
     tipl::reg::get_bound(from,to,arg_min,upper,lower,base_type,bound);
     reg_type reg_list[4] = {translocation,rigid_body,rigid_scaling,affine};
     double optimal_value = fun(arg_min);
+    auto local_search = [&](double local_precision)
+    {
+        if(optimizer & lbfgs_optimizer)
+            tipl::optimization::lbfgs_minimize(arg_min.begin(),arg_min.end(),
+                                               upper.begin(),lower.begin(),fun,optimal_value,terminated,local_precision);
+        else
+            tipl::optimization::gradient_descent(arg_min.begin(),arg_min.end(),
+                                                 upper.begin(),lower.begin(),fun,optimal_value,terminated,local_precision);
+    };
     for(int type = 0;type < 4 && reg_list[type] <= base_type && !terminated;++type)
     {
         tipl::reg::get_bound(from,to,arg_min,upper,lower,reg_list[type],bound);
         if(random_search_count)
-            tipl::optimization::random_search(arg_min.begin(),arg_min.end(),
-                                             upper.begin(),lower.begin(),fun,optimal_value,terminated,random_search_count);
-        tipl::optimization::gradient_descent(arg_min.begin(),arg_min.end(),
-                                                 upper.begin(),lower.begin(),fun,optimal_value,terminated,precision);
+        {
+            if(optimizer & cmaes_optimizer)
+                tipl::optimization::cmaes(arg_min.begin(),arg_min.end(),
+                                          upper.begin(),lower.begin(),fun,optimal_value,terminated,precision);
+            else
+                tipl::optimization::random_search(arg_min.begin(),arg_min.end(),
+                                                 upper.begin(),lower.begin(),fun,optimal_value,terminated,random_search_count);
+        }
+        local_search(precision);
     }
 
     if(!terminated)
-        tipl::optimization::gradient_descent(arg_min.begin(),arg_min.end(),
-                                         upper.begin(),lower.begin(),fun,optimal_value,terminated,precision*0.1f);
+        local_search(precision*0.1f);
     return optimal_value;
 }
 /*
@@ -405,11 +591,11 @@ double linear2(const image_type& from,const vs_type& from_vs,
              const image_type& to  ,const vs_type& to_vs,
              transform_type& arg_min,
              tipl::reg::reg_type base_type,
-             CostFunctionType,
+             CostFunctionType cost_type,
              teminated_class& terminated,
              double precision = 0.001,int random_search_count = 0,const float* bound = tipl::reg::reg_bound)
 {
-    tipl::reg::fun_adoptor<image_type,vs_type,transform_type,transform_type,CostFunctionType> fun(from,from_vs,to,to_vs,arg_min);
+    tipl::reg::fun_adoptor<image_type,vs_type,transform_type,transform_type,CostFunctionType> fun(from,from_vs,to,to_vs,arg_min,cost_type);
     transform_type upper,lower;
     tipl::reg::get_bound(from,to,arg_min,upper,lower,base_type,bound);
     double optimal_value = fun(arg_min);
@@ -428,7 +614,8 @@ float linear_mr(const image_type& from,const vs_type& from_vs,
                 CostFunctionType cost_type,
                 teminated_class& terminated,
                 double precision = 0.01,
-                const float* bound = reg_bound)
+                const float* bound = reg_bound,
+                unsigned int optimizer = default_optimizer)
 {
     // multi resolution
     int random_search = 0;
@@ -444,7 +631,49 @@ float linear_mr(const image_type& from,const vs_type& from_vs,
         to_vs_r *= 2.0;
         transform_type arg_min_r(arg_min);
         arg_min_r.downsampling();
-        linear_mr(from_r,from_vs_r,to_r,to_vs_r,arg_min_r,base_type,cost_type,terminated,precision,bound);
+        linear_mr(from_r,from_vs_r,to_r,to_vs_r,arg_min_r,base_type,cost_type,terminated,precision,bound,optimizer);
+        arg_min_r.upsampling();
+        arg_min = arg_min_r;
+        if(terminated)
+            return 0.0;
+    }
+    else
+        random_search = 20;
+    return linear(from,from_vs,to,to_vs,arg_min,base_type,cost_type,terminated,precision,random_search,bound,optimizer);
+}
+
+/*
+ *  Same as linear_mr but reuses a precomputed pyramid of "from" (from_pyramid[0] at full resolution),
+ *  so that the template side can be shared by many registrations.
+ */
+template<typename image_type,typename vs_type,typename transform_type,typename CostFunctionType,typename teminated_class>
+float linear_mr(const std::vector<image_type>& from_pyramid,const vs_type& from_vs,
+                const image_type& to  ,const vs_type& to_vs,
+                transform_type& arg_min,
+                reg_type base_type,
+                CostFunctionType cost_type,
+                teminated_class& terminated,
+                double precision = 0.01,
+                const float* bound = reg_bound,
+                unsigned int optimizer = default_optimizer,
+                unsigned int level = 0)
+{
+    const image_type& from = from_pyramid[level];
+    // multi resolution
+    int random_search = 0;
+    if (level+1 < from_pyramid.size() &&
+        *std::max_element(from.shape().begin(),from.shape().end()) > 64 &&
+        *std::max_element(to.shape().begin(),to.shape().end()) > 64)
+    {
+        //downsampling
+        image_type to_r;
+        tipl::vector<image_type::dimension> from_vs_r(from_vs),to_vs_r(to_vs);
+        downsample_with_padding(to,to_r);
+        from_vs_r *= 2.0;
+        to_vs_r *= 2.0;
+        transform_type arg_min_r(arg_min);
+        arg_min_r.downsampling();
+        linear_mr(from_pyramid,from_vs_r,to_r,to_vs_r,arg_min_r,base_type,cost_type,terminated,precision,bound,optimizer,level+1);
         arg_min_r.upsampling();
         arg_min = arg_min_r;
         if(terminated)
@@ -452,7 +681,7 @@ float linear_mr(const image_type& from,const vs_type& from_vs,
     }
     else
         random_search = 20;
-    return linear(from,from_vs,to,to_vs,arg_min,base_type,cost_type,terminated,precision,random_search,bound);
+    return linear(from,from_vs,to,to_vs,arg_min,base_type,cost_type,terminated,precision,random_search,bound,optimizer);
 }
 
 template<typename image_type,typename vs_type,typename TransType,typename CostFunctionType,typename teminated_class>
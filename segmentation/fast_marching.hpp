@@ -1,6 +1,7 @@
 #include <vector>
 #include <limits>
 #include <memory>
+#include "../utility/halo_image.hpp"
 
 namespace tipl
 {
@@ -11,6 +12,39 @@ namespace segmentation
 namespace imp
 {
 
+// T from the smallest neighboring times along each axis
+inline float fast_marching_solveT(float Tx,float Ty,float g)
+{
+    // sort Tx,Ty
+    if(Tx > Ty)
+        std::swap(Tx,Ty);
+    if(Ty == std::numeric_limits<float>::max())
+        return Tx+g;
+    float Td;
+    if((Td = Ty - Tx) > g)
+        return Tx+g;
+    // T = [Tx+Ty + (2g^2-(Tx-Tx)^2)^1/2]/2
+    return 0.5*(Tx+Ty+sqrt(2.0*g*g-Td*Td));
+}
+inline float fast_marching_solveT(float Tx,float Ty,float Tz,float g)
+{
+    // sort Tx,Ty,Tz
+    if(Tx > Ty)
+        std::swap(Tx,Ty);
+    if(Tx > Tz)
+        std::swap(Tx,Tz);
+    if(Ty > Tz)
+        std::swap(Ty,Tz);
+    if(Tz == std::numeric_limits<float>::max())
+        return fast_marching_solveT(Tx,Ty,g);
+    float Tsum = Tx+Ty+Tz;
+    float b2_4ac = Tsum*Tsum-3*(Tx*Tx+Ty*Ty+Tz*Tz-g*g);
+    if(b2_4ac <= 0)
+        return Tx+g;
+    b2_4ac = std::sqrt(b2_4ac);
+    return (Tsum + b2_4ac)/3.0;
+}
+
 // The subrutine for fast marching
 template<typename pass_time_type>
 float fast_marching_estimateT(const pass_time_type& T,float g,const shape<2>& geo,const pixel_index<2>& index)
@@ -26,16 +60,7 @@ float fast_marching_estimateT(const pass_time_type& T,float g,const shape<2>& ge
         float Ty2 = (index.y() + 1 < geo.height()) ? T[index.index()+geo.width()] : std::numeric_limits<float>::max();
         Ty = std::min(Ty1,Ty2);
     }
-    // sort Tx,Ty,Tz
-    if(Tx > Ty)
-        std::swap(Tx,Ty);
-    if(Ty == std::numeric_limits<float>::max())
-        return Tx+g;
-    float Td;
-    if((Td = Ty - Tx) > g)
-        return Tx+g;
-    // T = [Tx+Ty + (2g^2-(Tx-Tx)^2)^1/2]/2
-    return 0.5*(Tx+Ty+sqrt(2.0*g*g-Td*Td));
+    return fast_marching_solveT(Tx,Ty,g);
 }
 
 // The subrutine for fast marching
@@ -58,28 +83,25 @@ float fast_marching_estimateT(const pass_time_type& T,float g,const shape<3>& ge
         float Tz2 = (index.z() + 1 < geo.depth()) ? T[index.index()+geo.plane_size()] : std::numeric_limits<float>::max();
         Tz = std::min(Tz1,Tz2);
     }
-    // sort Tx,Ty,Tz
-    if(Tx > Ty)
-        std::swap(Tx,Ty);
-    if(Tx > Tz)
-        std::swap(Tx,Tz);
-    if(Ty > Tz)
-        std::swap(Ty,Tz);
-    if(Ty == std::numeric_limits<float>::max())
-        return Tx+g;
-    if(Tz == std::numeric_limits<float>::max())
-    {
-        float Td;
-        if((Td = Ty - Tx) > g)
-            return Tx+g;
-        return 0.5*(Tx+Ty+sqrt(2.0*g*g-Td*Td));
-    }
-    float Tsum = Tx+Ty+Tz;
-    float b2_4ac = Tsum*Tsum-3*(Tx*Tx+Ty*Ty+Tz*Tz-g*g);
-    if(b2_4ac <= 0)
-        return Tx+g;
-    b2_4ac = std::sqrt(b2_4ac);
-    return (Tsum + b2_4ac)/3.0;
+    return fast_marching_solveT(Tx,Ty,Tz,g);
+}
+
+// the same on a halo_image bordered by infinity, p is the padded offset
+template<typename storage_type>
+float fast_marching_estimateT(const halo_image<2,float,storage_type>& T,float g,size_t p)
+{
+    size_t sy = T.stride(1);
+    return fast_marching_solveT(std::min(T[p-1],T[p+1]),
+                                std::min(T[p-sy],T[p+sy]),g);
+}
+template<typename storage_type>
+float fast_marching_estimateT(const halo_image<3,float,storage_type>& T,float g,size_t p)
+{
+    size_t sy = T.stride(1);
+    size_t sz = T.stride(2);
+    return fast_marching_solveT(std::min(T[p-1],T[p+1]),
+                                std::min(T[p-sy],T[p+sy]),
+                                std::min(T[p-sz],T[p+sz]),g);
 }
 
 }
@@ -99,9 +121,9 @@ void fast_marching(const ImageType& gradient_image,TimeType& pass_time,IndexType
     narrow_band.push_back(new narrow_band_point(0.001,seed));
 
     float infinity_time = std::numeric_limits<float>::max();
-    pass_time.resize(gradient_image.shape());
-    std::fill(pass_time.begin(),pass_time.end(),infinity_time);
-    pass_time[seed.index()] = 0;
+    // the times are kept inside an infinite border so that the neighbors can be read without bound checks
+    halo_image<ImageType::dimension,float> T(gradient_image.shape(),1,halo_constant,infinity_time);
+    T[T.index(seed)] = 0;
 
     while(!narrow_band.empty())
     {
@@ -115,10 +137,11 @@ void fast_marching(const ImageType& gradient_image,TimeType& pass_time,IndexType
         for(size_t index = 0; index < neighbor_points.size(); ++index)
         {
             size_t cur_index = neighbor_points[index].index();
-            if(pass_time[cur_index] != infinity_time)
+            size_t p = T.index(neighbor_points[index]);
+            if(T[p] != infinity_time)
                 continue;
-            float cur_T = imp::fast_marching_estimateT(pass_time,gradient_image[cur_index],gradient_image.shape(),neighbor_points[index]);
-            pass_time[cur_index] = cur_T;
+            float cur_T = imp::fast_marching_estimateT(T,gradient_image[cur_index],p);
+            T[p] = cur_T;
             narrow_band.push_back(new narrow_band_point(cur_T,neighbor_points[index]));
             std::push_heap(narrow_band.begin(),narrow_band.end(),[&](const narrow_band_point* p1,const narrow_band_point* p2)
             {
@@ -126,6 +149,7 @@ void fast_marching(const ImageType& gradient_image,TimeType& pass_time,IndexType
             });
         }
     }
+    T.save_to_image(pass_time);
 }
 
 
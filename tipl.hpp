@@ -31,6 +31,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include "utility/basic_image.hpp"
+#include "utility/pool.hpp"
+#include "utility/masked_image.hpp"
+#include "utility/soa_image.hpp"
+#include "utility/sub_image.hpp"
+#include "utility/halo_image.hpp"
+#include "utility/scaled_image.hpp"
+#include "utility/series_image.hpp"
 
 
 #include "morphology/morphology.hpp"
@@ -52,6 +59,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
 #include "io/dicom.hpp"
+#include "io/dicom_index.hpp"
 #include "io/nifti.hpp"
 #include "io/bitmap.hpp"
 #include "io/mat.hpp"
@@ -72,6 +80,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "reg/lddmm.hpp"
 #include "reg/cdm.hpp"
 #include "reg/bfnorm.hpp"
+#include "reg/batch.hpp"
 
 #include "ml/utility.hpp"
 #include "ml/nb.hpp"
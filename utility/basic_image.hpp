@@ -2,11 +2,13 @@
 #ifndef basic_imageH
 #define basic_imageH
 #include <vector>
+#include <algorithm>
 #include <thread>
 #include <future>
 #include "shape.hpp"
 #include "pixel_value.hpp"
 #include "pixel_index.hpp"
+#include "multi_thread.hpp"
 
 //---------------------------------------------------------------------------
 namespace tipl
@@ -50,6 +52,7 @@ public:
         from = rhs.from;
         to = rhs.to;
         size_ = rhs.size_;
+        return *this;
     }
 public:
     template<typename index_type>
@@ -192,6 +195,11 @@ public:
         std::swap(to,rhs.to);
         std::swap(size_,rhs.size_);
     }
+    void clear(void)
+    {
+        from = to = 0;
+        size_ = 0;
+    }
     void resize(size_t new_size)
     {
         size_ = new_size;
@@ -257,7 +265,7 @@ public:
 public:
     image(void) {}
     image(const image& rhs){operator=(rhs);}
-    image(image&& rhs){operator=(rhs);}
+    image(image&& rhs) noexcept:data(std::move(rhs.data)),geo(rhs.geo){rhs.clear();}
     template<typename T>
     image(const std::initializer_list<T>& rhs):geo(rhs){data.resize(geo.size());}
     template<typename rhs_value_type,typename rhs_storage_type>
@@ -284,10 +292,13 @@ public:
         geo = rhs.shape();
         return *this;
     }
-    const image& operator=(image&& rhs)
+    const image& operator=(image&& rhs) noexcept
     {
-        data.swap(rhs.data);
-        geo.swap(rhs.geo);
+        if(this == &rhs)
+            return *this;
+        data = std::move(rhs.data);
+        geo = rhs.geo;
+        rhs.clear();
         return *this;
     }
 public:
@@ -361,7 +372,7 @@ public:
     }
 public:
     template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
-    const image operator+=(T value)
+    const image& operator+=(T value)
     {
         iterator end_iter = data.end();
         for(iterator iter = data.begin();iter != end_iter;++iter)
@@ -369,7 +380,7 @@ public:
         return *this;
     }
     template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
-    const image operator-=(T value)
+    const image& operator-=(T value)
     {
         iterator end_iter = data.end();
         for(iterator iter = data.begin();iter != end_iter;++iter)
@@ -377,7 +388,7 @@ public:
         return *this;
     }
     template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
-    const image operator*=(T value)
+    const image& operator*=(T value)
     {
         iterator end_iter = data.end();
         for(iterator iter = data.begin();iter != end_iter;++iter)
@@ -385,7 +396,7 @@ public:
         return *this;
     }
     template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
-    const image operator/=(T value)
+    const image& operator/=(T value)
     {
         iterator end_iter = data.end();
         for(iterator iter = data.begin();iter != end_iter;++iter)
@@ -470,6 +481,8 @@ public:
     {
         if(thread_count < 1)
             thread_count = 1;
+        auto worker_cap = worker_thread_count(thread_count);
+        unsigned int first_core = core_offset();
         size_t block_size = data.size()/thread_count;
 
         std::vector<std::future<void> > futures;
@@ -477,13 +490,17 @@ public:
         for(int id = 1; id < thread_count; id++)
         {
             size_t end = pos + block_size;
-            futures.push_back(std::move(std::async(std::launch::async, [this,f,pos,end]
+            futures.push_back(std::move(std::async(std::launch::async, [this,id,f,pos,end,worker_cap,first_core]
             {
+                thread_count_scope scope(worker_cap,first_core,id);
+                thread_affinity_scope pin;
                 for(pixel_index<dim> index(pos,shape());index.index() < end;++index)
                     f(data[index.index()],index);
             })));
             pos = end;
         }
+        thread_count_scope scope(worker_cap);
+        thread_affinity_scope pin;
         for(pixel_index<dim> index(pos,shape());index.index() < data.size();++index)
             f(data[index.index()],index);
         for(auto &future : futures)
@@ -494,6 +511,8 @@ public:
     {
         if(thread_count < 1)
             thread_count = 1;
+        auto worker_cap = worker_thread_count(thread_count);
+        unsigned int first_core = core_offset();
         size_t block_size = data.size()/thread_count;
 
         std::vector<std::future<void> > futures;
@@ -501,13 +520,17 @@ public:
         for(int id = 1; id < thread_count; id++)
         {
             size_t end = pos + block_size;
-            futures.push_back(std::move(std::async(std::launch::async, [this,f,pos,end]
+            futures.push_back(std::move(std::async(std::launch::async, [this,id,f,pos,end,worker_cap,first_core]
             {
+                thread_count_scope scope(worker_cap,first_core,id);
+                thread_affinity_scope pin;
                 for(pixel_index<dim> index(pos,shape());index.index() < end;++index)
                     f(data[index.index()],index);
             })));
             pos = end;
         }
+        thread_count_scope scope(worker_cap);
+        thread_affinity_scope pin;
         for(pixel_index<dim> index(pos,shape());index.index() < data.size();++index)
             f(data[index.index()],index);
         for(auto &future : futures)
@@ -518,6 +541,8 @@ public:
     {
         if(thread_count < 1)
             thread_count = 1;
+        auto worker_cap = worker_thread_count(thread_count);
+        unsigned int first_core = core_offset();
         size_t block_size = data.size()/thread_count;
 
         std::vector<std::future<void> > futures;
@@ -525,13 +550,17 @@ public:
         for(int id = 1; id < thread_count; id++)
         {
             size_t end = pos + block_size;
-            futures.push_back(std::move(std::async(std::launch::async, [this,id,f,pos,end]
+            futures.push_back(std::move(std::async(std::launch::async, [this,id,f,pos,end,worker_cap,first_core]
             {
+                thread_count_scope scope(worker_cap,first_core,id);
+                thread_affinity_scope pin;
                 for(pixel_index<dim> index(pos,shape());index.index() < end;++index)
                     f(data[index.index()],index,id);
             })));
             pos = end;
         }
+        thread_count_scope scope(worker_cap);
+        thread_affinity_scope pin;
         for(pixel_index<dim> index(pos,shape());index.index() < data.size();++index)
             f(data[index.index()],index,0);
         for(auto &future : futures)
@@ -554,6 +583,7 @@ public:
 public:
     pointer_image(void) {}
     pointer_image(const pointer_image& rhs):base_type(){operator=(rhs);}
+    pointer_image(pointer_image&& rhs) noexcept:base_type(static_cast<base_type&&>(rhs)){}
     template<typename rhs_storage_type>
     pointer_image(image<dim,vtype,rhs_storage_type>& rhs):base_type(&*rhs.begin(),rhs.shape()) {}
     pointer_image(vtype* pointer,const tipl::shape<dim>& geo_):base_type(pointer,geo_) {}
@@ -564,6 +594,12 @@ public:
         base_type::geo = rhs.shape();
         return *this;
     }
+    // takes over the view, rhs is left empty
+    pointer_image& operator=(pointer_image&& rhs) noexcept
+    {
+        base_type::operator=(static_cast<base_type&&>(rhs));
+        return *this;
+    }
 };
 
 template<int dim,typename vtype = float>
@@ -578,6 +614,7 @@ public:
 public:
     const_pointer_image(void) {}
     const_pointer_image(const const_pointer_image& rhs):base_type(){operator=(rhs);}
+    const_pointer_image(const_pointer_image&& rhs) noexcept:base_type(static_cast<base_type&&>(rhs)){}
     template<typename rhs_storage_type>
     const_pointer_image(const image<dim,vtype,rhs_storage_type>& rhs):base_type(&*rhs.begin(),rhs.shape()) {}
     const_pointer_image(const vtype* pointer,const tipl::shape<dim>& geo_):base_type(pointer,geo_){}
@@ -588,6 +625,11 @@ public:
         base_type::geo = rhs.shape();
         return *this;
     }
+    const_pointer_image& operator=(const_pointer_image&& rhs) noexcept
+    {
+        base_type::operator=(static_cast<base_type&&>(rhs));
+        return *this;
+    }
 
 };
 
@@ -606,5 +648,18 @@ const_pointer_image<shape_type::dimension,value_type>
     return const_pointer_image<shape_type::dimension,value_type>(pointer,geo);
 }
 
+// hand over a temporary image to I: swapped if I owns the same storage, copied otherwise
+template<typename image_type,int dim,typename vtype>
+void move_assign(image_type& I,image<dim,vtype>&& temp)
+{
+    I.resize(temp.shape());
+    std::copy(temp.begin(),temp.end(),I.begin());
+}
+template<int dim,typename vtype>
+void move_assign(image<dim,vtype>& I,image<dim,vtype>&& temp)
+{
+    I.swap(temp);
+}
+
 }
 #endif
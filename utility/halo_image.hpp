@@ -0,0 +1,242 @@
+#ifndef HALO_IMAGE_HPP
+#define HALO_IMAGE_HPP
+#include <algorithm>
+#include <vector>
+#include "basic_image.hpp"
+#include "multi_thread.hpp"
+
+namespace tipl
+{
+
+enum halo_mode {halo_zero,halo_replicate,halo_mirror,halo_wrap,halo_constant};
+
+/*
+ * halo_image keeps an image inside a border (ghost cells) of width halo() on
+ * every side, so a stencil of radius up to halo() can read its neighbors
+ * without checking the boundary. The border follows the mode:
+ *
+ *   halo_zero      0
+ *   halo_replicate the nearest edge voxel
+ *   halo_mirror    reflected about the edge voxel (-1 reads 1)
+ *   halo_wrap      periodic
+ *   halo_constant  the value given to the constructor
+ *
+ * Stencil code works on padded offsets: index() maps a voxel to its padded
+ * offset, stride(d) is the padded step along dimension d, and
+ * for_each_row_mt gives the padded and unpadded offsets of each interior row.
+ * After the interior is modified, fill_halo() refreshes the border.
+ */
+template<int dim,typename vtype = float,typename storage_type = std::vector<vtype> >
+class halo_image
+{
+public:
+    using value_type        = vtype;
+    using shape_type        = tipl::shape<dim>;
+    using padded_type       = image<dim,vtype,storage_type>;
+    static const int dimension = dim;
+private:
+    padded_type padded_;
+    shape_type geo;
+    unsigned int k = 0;
+    halo_mode mode = halo_zero;
+    vtype border_value = vtype();
+    size_t strides[dim] = {};
+    size_t origin = 0;
+private:
+    void allocate(void)
+    {
+        shape_type padded_geo;
+        for(int d = 0;d < dim;++d)
+            padded_geo[d] = geo[d]+2*k;
+        padded_type(padded_geo).swap(padded_);
+        origin = 0;
+        for(size_t d = 0,s = 1;d < dim;++d)
+        {
+            strides[d] = s;
+            origin += k*s;
+            s *= padded_geo[d];
+        }
+    }
+    // interior coordinate for padded coordinate c along a dimension of length n
+    int source_of(int c,int n) const
+    {
+        if(mode == halo_replicate)
+            return std::min(std::max(c,0),n-1);
+        if(mode == halo_wrap)
+            return ((c % n)+n) % n;
+        // mirror
+        if(n == 1)
+            return 0;
+        int period = 2*(n-1);
+        c = ((c % period)+period) % period;
+        return c < n ? c : period-c;
+    }
+public:
+    halo_image(void){}
+    // the interior and the halo start at the border value
+    halo_image(const shape_type& geo_,unsigned int halo,halo_mode mode_ = halo_zero,vtype value = vtype()):
+        geo(geo_),k(halo),mode(mode_),border_value(mode_ == halo_constant ? value : vtype())
+    {
+        allocate();
+        if(!(border_value == vtype()))
+            std::fill(padded_.begin(),padded_.end(),border_value);
+    }
+    template<typename image_type>
+    halo_image(const image_type& I,unsigned int halo,halo_mode mode_ = halo_zero,vtype value = vtype()):
+        geo(I.shape()),k(halo),mode(mode_),border_value(mode_ == halo_constant ? value : vtype())
+    {
+        allocate();
+        load_from_image(I);
+    }
+public:
+    const shape_type& shape(void) const{return geo;}
+    int width(void) const{return geo.width();}
+    int height(void) const{return geo.height();}
+    int depth(void) const{return geo.depth();}
+    size_t plane_size(void) const{return geo.plane_size();}
+    size_t size(void) const{return geo.size();}
+    bool empty(void) const{return geo.size() == 0;}
+    unsigned int halo(void) const{return k;}
+    halo_mode border_mode(void) const{return mode;}
+    size_t stride(unsigned int d) const{return strides[d];}
+    padded_type& padded(void){return padded_;}
+    const padded_type& padded(void) const{return padded_;}
+    void swap(halo_image& rhs)
+    {
+        padded_.swap(rhs.padded_);
+        geo.swap(rhs.geo);
+        std::swap(k,rhs.k);
+        std::swap(mode,rhs.mode);
+        std::swap(border_value,rhs.border_value);
+        std::swap(strides,rhs.strides);
+        std::swap(origin,rhs.origin);
+    }
+public:
+    // padded offset of a voxel
+    size_t index(const pixel_index<dim>& pos) const
+    {
+        size_t i = origin;
+        for(int d = 0;d < dim;++d)
+            i += size_t(pos[d])*strides[d];
+        return i;
+    }
+    size_t index(int x,int y) const
+    {
+        return size_t(int64_t(origin)+int64_t(x)+int64_t(y)*int64_t(strides[1]));
+    }
+    size_t index(int x,int y,int z) const
+    {
+        return size_t(int64_t(origin)+int64_t(x)+int64_t(y)*int64_t(strides[1])+int64_t(z)*int64_t(strides[2]));
+    }
+    // padded offset
+    template<typename index_type>
+    const vtype& operator[](index_type i) const{return padded_[i];}
+    template<typename index_type>
+    typename padded_type::reference operator[](index_type i){return padded_[i];}
+    // x,y,z may be in [-halo(),n+halo())
+    const vtype& at(int x,int y) const{return padded_[index(x,y)];}
+    typename padded_type::reference at(int x,int y){return padded_[index(x,y)];}
+    const vtype& at(int x,int y,int z) const{return padded_[index(x,y,z)];}
+    typename padded_type::reference at(int x,int y,int z){return padded_[index(x,y,z)];}
+public:
+    // f(padded_offset,offset) for the first voxel of every interior row
+    template<typename Func>
+    void for_each_row_mt(Func&& f,unsigned int thread_count = std::thread::hardware_concurrency()) const
+    {
+        size_t w = geo[0];
+        size_t rows = w ? geo.size()/w : 0;
+        par_for(rows,[&](size_t row)
+        {
+            size_t p = origin;
+            for(size_t d = 1,r = row;d < dim;++d)
+            {
+                p += (r % geo[d])*strides[d];
+                r /= geo[d];
+            }
+            f(p,row*w);
+        },thread_count);
+    }
+    // copy I into the interior and fill the halo
+    template<typename image_type>
+    void load_from_image(const image_type& I)
+    {
+        if(I.shape() != geo)
+        {
+            geo = I.shape();
+            allocate();
+        }
+        size_t w = geo[0];
+        for_each_row_mt([&](size_t p,size_t i)
+        {
+            std::copy(I.begin()+i,I.begin()+i+w,padded_.begin()+p);
+        });
+        fill_halo();
+    }
+    template<typename image_type>
+    void save_to_image(image_type& I) const
+    {
+        I.resize(geo);
+        size_t w = geo[0];
+        for_each_row_mt([&](size_t p,size_t i)
+        {
+            std::copy(padded_.begin()+p,padded_.begin()+p+w,I.begin()+i);
+        });
+    }
+    // widen the halo to at least width halo, keeping the interior
+    void require_halo(unsigned int halo)
+    {
+        if(halo <= k)
+            return;
+        image<dim,vtype> I;
+        save_to_image(I);
+        k = halo;
+        allocate();
+        load_from_image(I);
+    }
+    /*
+     * fills the border one dimension at a time, so that the corners of the
+     * padded image take the border values of both dimensions
+     */
+    void fill_halo(void)
+    {
+        if(!k || empty())
+            return;
+        const shape_type& padded_geo = padded_.shape();
+        for(int d = 0;d < dim;++d)
+        {
+            int n = int(geo[d]);
+            size_t line_count = padded_.size()/padded_geo[d];
+            size_t s = strides[d];
+            par_for(line_count,[&](size_t line)
+            {
+                // base offset of the line with coordinate 0 along d
+                size_t base = 0;
+                for(int j = 0;j < dim;++j)
+                {
+                    if(j == d)
+                        continue;
+                    base += (line % padded_geo[j])*strides[j];
+                    line /= padded_geo[j];
+                }
+                auto p = padded_.begin()+base;
+                for(int c = -int(k);c < 0;++c)
+                    p[size_t(c+int(k))*s] = (mode == halo_zero || mode == halo_constant) ?
+                                            border_value : p[size_t(source_of(c,n)+int(k))*s];
+                for(int c = n;c < n+int(k);++c)
+                    p[size_t(c+int(k))*s] = (mode == halo_zero || mode == halo_constant) ?
+                                            border_value : p[size_t(source_of(c,n)+int(k))*s];
+            });
+        }
+    }
+};
+
+// a copy of I with a border of width halo for stencil code
+template<typename image_type>
+halo_image<image_type::dimension,typename image_type::value_type>
+    make_halo(const image_type& I,unsigned int halo,halo_mode mode = halo_replicate)
+{
+    return halo_image<image_type::dimension,typename image_type::value_type>(I,halo,mode);
+}
+
+}
+#endif//HALO_IMAGE_HPP
@@ -0,0 +1,221 @@
+#ifndef MASKED_IMAGE_HPP
+#define MASKED_IMAGE_HPP
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "basic_image.hpp"
+#include "multi_thread.hpp"
+
+namespace tipl
+{
+
+/*
+ * masked_image stores only the in-mask voxels of an image: a sorted list of
+ * voxel indices and the compact values. begin()/end() run over the stored
+ * values, so iterator-based algorithms (mean, variance, histogram...) skip
+ * the background, and for_each_mt gives the pixel_index of each stored voxel,
+ * so resample_mt can resample into the mask directly.
+ *
+ * The index list is shared between images built with the same mask
+ * (set_mask, copies), e.g. the subjects of a group analysis.
+ */
+template<int dim,typename vtype = float>
+class masked_image
+{
+public:
+    using value_type        = vtype;
+    using storage_type      = std::vector<vtype>;
+    using iterator          = typename storage_type::iterator;
+    using const_iterator    = typename storage_type::const_iterator;
+    using reference         = typename storage_type::reference;
+    using index_container   = std::vector<uint32_t>;
+    using shape_type        = tipl::shape<dim>;
+    static const int dimension = dim;
+    template<int,typename> friend class masked_image;
+protected:
+    storage_type data;
+    std::shared_ptr<const index_container> index_list;
+    shape_type geo;
+public:
+    masked_image(void):index_list(std::make_shared<index_container>()){}
+    // mask voxels are those with nonzero values
+    template<typename mask_value_type,typename mask_storage_type>
+    masked_image(const image<dim,mask_value_type,mask_storage_type>& mask):geo(mask.shape())
+    {
+        if(mask.size() > std::numeric_limits<uint32_t>::max())
+            throw std::runtime_error("Image too large for masked_image");
+        auto new_index = std::make_shared<index_container>();
+        for(size_t i = 0;i < mask.size();++i)
+            if(mask[i])
+                new_index->push_back(uint32_t(i));
+        index_list = new_index;
+        data.resize(index_list->size());
+    }
+    template<typename image_type,typename mask_value_type,typename mask_storage_type>
+    masked_image(const image_type& I,const image<dim,mask_value_type,mask_storage_type>& mask):masked_image(mask)
+    {
+        load_from_image(I);
+    }
+    template<typename rhs_value_type>
+    masked_image(const masked_image<dim,rhs_value_type>& rhs):
+        data(rhs.begin(),rhs.end()),index_list(rhs.index_list),geo(rhs.shape()){}
+public:
+    // share the mask of rhs, all values set to zero
+    template<typename rhs_value_type>
+    void set_mask(const masked_image<dim,rhs_value_type>& rhs)
+    {
+        index_list = rhs.index_list;
+        geo = rhs.shape();
+        storage_type(index_list->size()).swap(data);
+    }
+    template<typename rhs_value_type>
+    bool same_mask(const masked_image<dim,rhs_value_type>& rhs) const
+    {
+        return index_list == rhs.index_list || (geo == rhs.shape() && *index_list == *rhs.index_list);
+    }
+    // gather the in-mask values from a dense image
+    template<typename image_type>
+    void load_from_image(const image_type& I)
+    {
+        const auto& index = *index_list;
+        par_for_block(index.size(),[&](size_t i)
+        {
+            data[i] = I[index[i]];
+        });
+    }
+    // scatter into a dense image, background set to zero
+    template<typename image_type>
+    void save_to_image(image_type& I) const
+    {
+        I.resize(geo);
+        std::fill(I.begin(),I.end(),typename image_type::value_type());
+        const auto& index = *index_list;
+        par_for_block(index.size(),[&](size_t i)
+        {
+            I[index[i]] = data[i];
+        });
+    }
+public:
+    const shape_type& shape(void) const{return geo;}
+    int width(void) const{return geo.width();}
+    int height(void) const{return geo.height();}
+    int depth(void) const{return geo.depth();}
+    size_t plane_size(void) const{return geo.plane_size();}
+    // number of stored (in-mask) voxels
+    size_t size(void) const{return data.size();}
+    bool empty(void) const{return data.empty();}
+    const index_container& indices(void) const{return *index_list;}
+    size_t index(size_t i) const{return (*index_list)[i];}
+    template<typename index_type>
+    const value_type& operator[](index_type i) const{return data[i];}
+    template<typename index_type>
+    reference operator[](index_type i){return data[i];}
+    const_iterator begin(void) const{return data.begin();}
+    const_iterator end(void) const{return data.end();}
+    iterator begin(void){return data.begin();}
+    iterator end(void){return data.end();}
+    void swap(masked_image& rhs)
+    {
+        data.swap(rhs.data);
+        index_list.swap(rhs.index_list);
+        geo.swap(rhs.geo);
+    }
+public:
+    template<typename Func>
+    void for_each(Func&& f)
+    {
+        const auto& index = *index_list;
+        for(size_t i = 0;i < index.size();++i)
+            f(data[i],pixel_index<dim>(size_t(index[i]),geo));
+    }
+    template<typename Func>
+    void for_each(Func&& f) const
+    {
+        const auto& index = *index_list;
+        for(size_t i = 0;i < index.size();++i)
+            f(data[i],pixel_index<dim>(size_t(index[i]),geo));
+    }
+    template<typename Func>
+    void for_each_mt(Func&& f,unsigned int thread_count = std::thread::hardware_concurrency())
+    {
+        const auto& index = *index_list;
+        par_for_block(index.size(),[&](size_t i)
+        {
+            f(data[i],pixel_index<dim>(size_t(index[i]),geo));
+        },thread_count);
+    }
+    template<typename Func>
+    void for_each_mt(Func&& f,unsigned int thread_count = std::thread::hardware_concurrency()) const
+    {
+        const auto& index = *index_list;
+        par_for_block(index.size(),[&](size_t i)
+        {
+            f(data[i],pixel_index<dim>(size_t(index[i]),geo));
+        },thread_count);
+    }
+public:
+    template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
+    const masked_image& operator+=(T value)
+    {
+        for(auto& v : data)
+            v += value;
+        return *this;
+    }
+    template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
+    const masked_image& operator-=(T value)
+    {
+        for(auto& v : data)
+            v -= value;
+        return *this;
+    }
+    template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
+    const masked_image& operator*=(T value)
+    {
+        for(auto& v : data)
+            v *= value;
+        return *this;
+    }
+    template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
+    const masked_image& operator/=(T value)
+    {
+        for(auto& v : data)
+            v /= value;
+        return *this;
+    }
+    // elementwise operations with an image of the same mask
+    template<typename rhs_value_type>
+    const masked_image& operator+=(const masked_image<dim,rhs_value_type>& rhs)
+    {
+        assert(same_mask(rhs));
+        std::transform(data.begin(),data.end(),rhs.begin(),data.begin(),[](vtype a,rhs_value_type b){return a+b;});
+        return *this;
+    }
+    template<typename rhs_value_type>
+    const masked_image& operator-=(const masked_image<dim,rhs_value_type>& rhs)
+    {
+        assert(same_mask(rhs));
+        std::transform(data.begin(),data.end(),rhs.begin(),data.begin(),[](vtype a,rhs_value_type b){return a-b;});
+        return *this;
+    }
+    template<typename rhs_value_type>
+    const masked_image& operator*=(const masked_image<dim,rhs_value_type>& rhs)
+    {
+        assert(same_mask(rhs));
+        std::transform(data.begin(),data.end(),rhs.begin(),data.begin(),[](vtype a,rhs_value_type b){return a*b;});
+        return *this;
+    }
+    template<typename rhs_value_type>
+    const masked_image& operator/=(const masked_image<dim,rhs_value_type>& rhs)
+    {
+        assert(same_mask(rhs));
+        std::transform(data.begin(),data.end(),rhs.begin(),data.begin(),[](vtype a,rhs_value_type b){return a/b;});
+        return *this;
+    }
+};
+
+}
+#endif//MASKED_IMAGE_HPP
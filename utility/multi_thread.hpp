@@ -2,6 +2,14 @@
 #define MULTI_THREAD_HPP
 #include <future>
 #include <iostream>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 namespace tipl{
 
 class time
@@ -42,6 +50,89 @@ public:
     }
 };
 
+/*
+ * Optional cap on the number of threads that the par_for family may use when
+ * called from the current thread (0: no cap). The cap is split among the
+ * workers, so nested parallel loops stay within the same budget.
+ */
+inline unsigned int& max_thread_count(void)
+{
+    static thread_local unsigned int cap = 0;
+    return cap;
+}
+
+// apply the cap to thread_count and return the cap for each of its workers
+template<typename T>
+unsigned int worker_thread_count(T& thread_count)
+{
+    unsigned int cap = max_thread_count();
+    if(!cap)
+        return 0;
+    if(thread_count > T(cap))
+        thread_count = T(cap);
+    return thread_count > 0 ? std::max<unsigned int>(1,cap/(unsigned int)thread_count) : cap;
+}
+
+// the first core of the current thread's budget, see thread_affinity_scope
+inline unsigned int& core_offset(void)
+{
+    static thread_local unsigned int offset = 0;
+    return offset;
+}
+
+class thread_count_scope{
+    unsigned int previous,previous_core;
+public:
+    thread_count_scope(unsigned int cap):previous(max_thread_count()),previous_core(core_offset()){max_thread_count() = cap;}
+    // the budget of worker id of a loop started at first_core = core_offset(), with worker_cap = cap
+    thread_count_scope(unsigned int cap,unsigned int first_core,unsigned int id):
+        previous(max_thread_count()),previous_core(core_offset())
+    {
+        max_thread_count() = cap;
+        core_offset() = first_core+id*std::max<unsigned int>(1,cap);
+    }
+    ~thread_count_scope(void){max_thread_count() = previous;core_offset() = previous_core;}
+};
+
+/*
+ * When enabled, the threads of par_for_block, par_for_block2, and image::for_each_mt
+ * (the calling thread included) are pinned to the first core of their budget while
+ * they run their block, so that a block partition (and the pages first touched by it,
+ * see aligned_container) stays on one NUMA node. Concurrent loops get distinct cores
+ * only when they run under a thread budget (thread_count_scope), as in reg::batch_reg;
+ * without one, every top-level loop starts at core 0.
+ */
+inline bool& thread_affinity(void)
+{
+    static bool enabled = false;
+    return enabled;
+}
+
+class thread_affinity_scope{
+#if defined(__linux__)
+    cpu_set_t previous;
+    bool pinned = false;
+public:
+    thread_affinity_scope(void)
+    {
+        if(!thread_affinity() || pthread_getaffinity_np(pthread_self(),sizeof(previous),&previous))
+            return;
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(core_offset() % std::max<unsigned int>(1,std::thread::hardware_concurrency()),&cpu_set);
+        pinned = !pthread_setaffinity_np(pthread_self(),sizeof(cpu_set),&cpu_set);
+    }
+    ~thread_affinity_scope(void)
+    {
+        if(pinned)
+            pthread_setaffinity_np(pthread_self(),sizeof(previous),&previous);
+    }
+#else
+public:
+    thread_affinity_scope(void){}
+#endif
+};
+
 template <typename T,typename Func>
 void par_for(T size, Func&& f, unsigned int thread_count = std::thread::hardware_concurrency())
 {
@@ -54,14 +145,18 @@ void par_for(T size, Func&& f, unsigned int thread_count = std::thread::hardware
     std::vector<std::future<void> > futures;
     if(thread_count > size)
         thread_count = int(size);
+    unsigned int worker_cap = worker_thread_count(thread_count);
+    unsigned int first_core = core_offset();
     for(unsigned int id = 1; id < thread_count; id++)
     {
-        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f]
+        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f,worker_cap,first_core]
         {
+            thread_count_scope scope(worker_cap,first_core,id);
             for(T i = id; i < size; i += thread_count)
                 f(i);
         })));
     }
+    thread_count_scope scope(worker_cap);
     for(T i = 0; i < size; i += thread_count)
         f(i);
     for(auto &future : futures)
@@ -75,17 +170,22 @@ void par_for_asyn(T size,Func&& f, unsigned int thread_count = std::thread::hard
     std::vector<std::future<void> > futures;
     if(thread_count > size)
         thread_count = int(size);
+    unsigned int worker_cap = worker_thread_count(thread_count);
+    unsigned int first_core = core_offset();
     T now = 0;
     std::mutex read_now;
     for(unsigned int id = 1; id < thread_count; id++)
     {
-        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f,&now,&read_now]
+        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f,&now,&read_now,worker_cap,first_core]
         {
-            while(now < size)
+            thread_count_scope scope(worker_cap,first_core,id);
+            while(true)
             {
                 T i;
                 {
                     std::lock_guard<std::mutex> lock(read_now);
+                    if(now >= size)
+                        break;
                     i = now;
                     ++now;
                 }
@@ -93,11 +193,14 @@ void par_for_asyn(T size,Func&& f, unsigned int thread_count = std::thread::hard
             }
         })));
     }
-    while(now < size)
+    thread_count_scope scope(worker_cap);
+    while(true)
     {
         T i;
         {
             std::lock_guard<std::mutex> lock(read_now);
+            if(now >= size)
+                break;
             i = now;
             ++now;
         }
@@ -120,14 +223,18 @@ void par_for2(T size,Func&& f, unsigned int thread_count = std::thread::hardware
     std::vector<std::future<void> > futures;
     if(thread_count > size)
         thread_count = size;
+    unsigned int worker_cap = worker_thread_count(thread_count);
+    unsigned int first_core = core_offset();
     for(uint16_t id = 1; id < thread_count; id++)
     {
-        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f]
+        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f,worker_cap,first_core]
         {
+            thread_count_scope scope(worker_cap,first_core,id);
             for(T i = id; i < size; i += thread_count)
                 f(i,id);
         })));
     }
+    thread_count_scope scope(worker_cap);
     for(T i = 0; i < size; i += thread_count)
         f(i,0);
     for(auto &future : futures)
@@ -141,17 +248,22 @@ void par_for_asyn2(T size,Func&& f, unsigned int thread_count = std::thread::har
     std::vector<std::future<void> > futures;
     if(thread_count > size)
         thread_count = int(size);
+    unsigned int worker_cap = worker_thread_count(thread_count);
+    unsigned int first_core = core_offset();
     T now = 0;
     std::mutex read_now;
     for(unsigned int id = 1; id < thread_count; id++)
     {
-        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f,&now,&read_now]
+        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f,&now,&read_now,worker_cap,first_core]
         {
-            while(now < size)
+            thread_count_scope scope(worker_cap,first_core,id);
+            while(true)
             {
                 T i;
                 {
                     std::lock_guard<std::mutex> lock(read_now);
+                    if(now >= size)
+                        break;
                     i = now;
                     ++now;
                 }
@@ -159,11 +271,14 @@ void par_for_asyn2(T size,Func&& f, unsigned int thread_count = std::thread::har
             }
         })));
     }
-    while(now < size)
+    thread_count_scope scope(worker_cap);
+    while(true)
     {
         T i;
         {
             std::lock_guard<std::mutex> lock(read_now);
+            if(now >= size)
+                break;
             i = now;
             ++now;
         }
@@ -180,19 +295,25 @@ void par_for_block(T size,Func&& f, unsigned int thread_count = std::thread::har
     std::vector<std::future<void> > futures;
     if(thread_count > size)
         thread_count = size;
+    unsigned int worker_cap = worker_thread_count(thread_count);
+    unsigned int first_core = core_offset();
 
     size_t block_size = size/thread_count;
     size_t pos = 0;
     for(unsigned int id = 1; id < thread_count; id++)
     {
         size_t end = pos + block_size;
-        futures.push_back(std::move(std::async(std::launch::async, [pos,end,&f]
+        futures.push_back(std::move(std::async(std::launch::async, [id,pos,end,&f,worker_cap,first_core]
         {
+            thread_count_scope scope(worker_cap,first_core,id);
+            thread_affinity_scope pin;
             for(size_t i = pos; i < end;++i)
                 f(i);
         })));
         pos = end;
     }
+    thread_count_scope scope(worker_cap);
+    thread_affinity_scope pin;
     for(size_t i = pos; i < size;++i)
         f(i);
     for(auto &future : futures)
@@ -207,25 +328,104 @@ void par_for_block2(T size,Func&& f, unsigned int thread_count = std::thread::ha
     std::vector<std::future<void> > futures;
     if(thread_count > size)
         thread_count = size;
+    unsigned int worker_cap = worker_thread_count(thread_count);
+    unsigned int first_core = core_offset();
 
     size_t block_size = size/thread_count;
     size_t pos = 0;
     for(unsigned int id = 1; id < thread_count; id++)
     {
         size_t end = pos + block_size;
-        futures.push_back(std::move(std::async(std::launch::async, [id,pos,end,&f]
+        futures.push_back(std::move(std::async(std::launch::async, [id,pos,end,&f,worker_cap,first_core]
         {
+            thread_count_scope scope(worker_cap,first_core,id);
+            thread_affinity_scope pin;
             for(size_t i = pos; i < end;++i)
                 f(i,id);
         })));
         pos = end;
     }
+    thread_count_scope scope(worker_cap);
+    thread_affinity_scope pin;
     for(size_t i = pos; i < size;++i)
         f(i,0);
     for(auto &future : futures)
         future.wait();
 }
 
+/*
+ * Deterministic parallel reduction. The range is cut into chunks of
+ * reduce_chunk_size that do not depend on the thread count. Each chunk is
+ * reduced over reduce_lanes interleaved partials (independent, so simple
+ * reductions vectorize), and the chunk results are combined in order, so the
+ * result is bitwise the same from run to run and for any thread count.
+ * init is reduced once with the result.
+ */
+const size_t reduce_chunk_size = 16384;
+const unsigned int reduce_lanes = 8;
+
+// reduce(init,transform(*from),...) over [from,to)
+template<typename iterator_type,typename value_type,typename reduce_type,typename transform_type>
+value_type par_transform_reduce(iterator_type from,iterator_type to,value_type init,
+                                reduce_type&& reduce,transform_type&& transform,
+                                unsigned int thread_count = std::thread::hardware_concurrency())
+{
+    size_t size = size_t(to-from);
+    auto reduce_chunk = [&](size_t chunk)
+    {
+        size_t pos = chunk*reduce_chunk_size;
+        size_t end = std::min<size_t>(size,pos+reduce_chunk_size);
+        iterator_type iter = from+pos;
+        // each lane starts at its first element, so that init is not needed here
+        unsigned int lane_count = uint32_t(std::min<size_t>(reduce_lanes,end-pos));
+        value_type lane[reduce_lanes];
+        for(unsigned int k = 0;k < lane_count;++k,++pos,++iter)
+            lane[k] = transform(*iter);
+        for(;pos+reduce_lanes <= end;pos += reduce_lanes)
+            for(unsigned int k = 0;k < reduce_lanes;++k,++iter)
+                lane[k] = reduce(lane[k],transform(*iter));
+        for(unsigned int k = 0;pos < end;++pos,++k,++iter)
+            lane[k] = reduce(lane[k],transform(*iter));
+        for(unsigned int k = 1;k < lane_count;++k)
+            lane[0] = reduce(lane[0],lane[k]);
+        return lane[0];
+    };
+    if(size <= reduce_chunk_size)
+        return size ? reduce(init,reduce_chunk(0)) : init;
+    std::vector<value_type> partial((size+reduce_chunk_size-1)/reduce_chunk_size);
+    par_for(partial.size(),[&](size_t chunk)
+    {
+        partial[chunk] = reduce_chunk(chunk);
+    },thread_count);
+    for(const auto& each : partial)
+        init = reduce(init,each);
+    return init;
+}
+
+// reduce(init,transform(i),...) for i in [0,size)
+template<typename T,typename value_type,typename reduce_type,typename transform_type>
+value_type par_transform_reduce(T size,value_type init,reduce_type&& reduce,transform_type&& transform,
+                                unsigned int thread_count = std::thread::hardware_concurrency())
+{
+    struct index_iterator{
+        size_t i;
+        size_t operator*(void) const{return i;}
+        index_iterator& operator++(void){++i;return *this;}
+        index_iterator operator+(size_t n) const{return index_iterator{i+n};}
+        size_t operator-(const index_iterator& rhs) const{return i-rhs.i;}
+    };
+    return par_transform_reduce(index_iterator{0},index_iterator{size_t(size)},init,reduce,
+                                [&](size_t i){return transform(T(i));},thread_count);
+}
+
+template<typename iterator_type,typename value_type,typename reduce_type>
+value_type par_reduce(iterator_type from,iterator_type to,value_type init,reduce_type&& reduce,
+                      unsigned int thread_count = std::thread::hardware_concurrency())
+{
+    using input_type = typename std::iterator_traits<iterator_type>::value_type;
+    return par_transform_reduce(from,to,init,reduce,[](const input_type& v){return value_type(v);},thread_count);
+}
+
 
 class thread{
 private:
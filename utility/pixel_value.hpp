@@ -2,6 +2,12 @@
 #define PIXEL_VALUE_HPP
 #include <cmath>
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
 namespace tipl
 {
 
@@ -231,5 +237,119 @@ struct rgb
 
 };
 //---------------------------------------------------------------------------
+/*
+ * IEEE 754 half precision (binary16) pixel, stored in 16 bits and computed
+ * in float. Conversions round to nearest even and use the F16C instructions
+ * when the compiler targets them (e.g. -mf16c or -march=native).
+ */
+struct half
+{
+    uint16_t bits = 0;
+public:
+    static float to_float(uint16_t h)
+    {
+#if defined(__F16C__)
+        return _cvtsh_ss(h);
+#else
+        uint32_t sign = uint32_t(h & 0x8000) << 16;
+        uint32_t e = (h >> 10) & 0x1f;
+        uint32_t m = h & 0x3ff;
+        uint32_t x;
+        if(e == 0)
+        {
+            if(m == 0)
+                x = sign;
+            else
+            {
+                // subnormal, normalize the mantissa
+                e = 113;
+                while(!(m & 0x400))
+                {
+                    m <<= 1;
+                    --e;
+                }
+                x = sign | (e << 23) | ((m & 0x3ff) << 13);
+            }
+        }
+        else
+            if(e == 31)
+                x = sign | 0x7f800000 | (m << 13);
+            else
+                x = sign | ((e+112) << 23) | (m << 13);
+        float f;
+        std::memcpy(&f,&x,4);
+        return f;
+#endif
+    }
+    static uint16_t from_float(float f)
+    {
+#if defined(__F16C__)
+        return _cvtss_sh(f,0);
+#else
+        uint32_t x;
+        std::memcpy(&x,&f,4);
+        uint32_t sign = (x >> 16) & 0x8000;
+        uint32_t a = x & 0x7fffffff;
+        if(a >= 0x7f800000) // inf, nan
+            return uint16_t(sign | 0x7c00 | (a > 0x7f800000 ? 0x200 : 0));
+        if(a >= 0x477ff000) // rounds beyond 65504
+            return uint16_t(sign | 0x7c00);
+        if(a < 0x38800000) // subnormal
+        {
+            if(a < 0x33000001)
+                return uint16_t(sign);
+            uint32_t m = (a & 0x007fffff) | 0x00800000;
+            uint32_t shift = 126-(a >> 23);
+            uint32_t r = m >> shift;
+            uint32_t rem = m & ((1u << shift)-1);
+            uint32_t halfway = 1u << (shift-1);
+            if(rem > halfway || (rem == halfway && (r & 1)))
+                ++r;
+            return uint16_t(sign | r);
+        }
+        uint32_t r = (a-0x38000000) >> 13;
+        uint32_t rem = a & 0x1fff;
+        if(rem > 0x1000 || (rem == 0x1000 && (r & 1)))
+            ++r;
+        return uint16_t(sign | r);
+#endif
+    }
+public:
+    half(void){}
+    template<typename T,typename std::enable_if<std::is_arithmetic<T>::value,bool>::type = true>
+    half(T v):bits(from_float(float(v))){}
+    operator float() const{return to_float(bits);}
+    template<typename T>
+    half& operator+=(T v){return *this = half(float(*this)+float(v));}
+    template<typename T>
+    half& operator-=(T v){return *this = half(float(*this)-float(v));}
+    template<typename T>
+    half& operator*=(T v){return *this = half(float(*this)*float(v));}
+    template<typename T>
+    half& operator/=(T v){return *this = half(float(*this)/float(v));}
+};
+
+// bulk conversions, eight values at a time with F16C
+inline void half_to_float(const half* from,float* to,size_t size)
+{
+    size_t i = 0;
+#if defined(__F16C__)
+    for(;i+8 <= size;i += 8)
+        _mm256_storeu_ps(to+i,_mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(from+i))));
+#endif
+    for(;i < size;++i)
+        to[i] = from[i];
+}
+inline void float_to_half(const float* from,half* to,size_t size)
+{
+    size_t i = 0;
+#if defined(__F16C__)
+    for(;i+8 <= size;i += 8)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(to+i),_mm256_cvtps_ph(_mm256_loadu_ps(from+i),_MM_FROUND_TO_NEAREST_INT));
+#endif
+    for(;i < size;++i)
+        to[i] = from[i];
+}
+//---------------------------------------------------------------------------
 }
 #endif
@@ -0,0 +1,285 @@
+#ifndef TIPL_POOL_HPP
+#define TIPL_POOL_HPP
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include "basic_image.hpp"
+#include "multi_thread.hpp"
+
+namespace tipl
+{
+
+/*
+ * Thread-safe cache of large 64-byte aligned buffers. Requests are rounded up to
+ * size classes (eight per power of two) and released buffers are kept for reuse,
+ * so repeated temporaries skip the allocation, page faults, and zeroing.
+ */
+class buffer_pool{
+public:
+    static const size_t alignment = 64;
+    static const size_t min_pooled_size = 1 << 16;
+    size_t max_cached_size = size_t(1) << 30;
+private:
+    std::mutex lock;
+    std::map<size_t,std::vector<void*> > cached;
+    size_t cached_size = 0;
+public:
+    static void* aligned_malloc(size_t bytes)
+    {
+        void* raw = std::malloc(bytes+alignment);
+        if(!raw)
+            throw std::bad_alloc();
+        void* p = reinterpret_cast<void*>((reinterpret_cast<uintptr_t>(raw)+alignment) & ~uintptr_t(alignment-1));
+        reinterpret_cast<void**>(p)[-1] = raw;
+        return p;
+    }
+    static void aligned_free(void* p)
+    {
+        std::free(reinterpret_cast<void**>(p)[-1]);
+    }
+public:
+    static size_t size_class(size_t bytes)
+    {
+        if(bytes < min_pooled_size)
+            return (bytes+alignment-1)/alignment*alignment;
+        size_t step = 1;
+        while((step << 3) <= bytes)
+            step <<= 1;
+        return (bytes+step-1)/step*step;
+    }
+    static buffer_pool& instance(void)
+    {
+        // never destroyed so that static images can still release their buffers at exit
+        static buffer_pool* pool = new buffer_pool;
+        return *pool;
+    }
+    void* allocate(size_t bytes)
+    {
+        bytes = size_class(bytes);
+        if(bytes >= min_pooled_size)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto iter = cached.find(bytes);
+            if(iter != cached.end() && !iter->second.empty())
+            {
+                void* p = iter->second.back();
+                iter->second.pop_back();
+                cached_size -= bytes;
+                return p;
+            }
+        }
+        return aligned_malloc(bytes);
+    }
+    void deallocate(void* p,size_t bytes)
+    {
+        if(!p)
+            return;
+        bytes = size_class(bytes);
+        if(bytes >= min_pooled_size)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(cached_size + bytes <= max_cached_size)
+            {
+                cached[bytes].push_back(p);
+                cached_size += bytes;
+                return;
+            }
+        }
+        aligned_free(p);
+    }
+    // free all cached buffers
+    void release(void)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for(auto& each : cached)
+            for(auto p : each.second)
+                aligned_free(p);
+        cached.clear();
+        cached_size = 0;
+    }
+};
+
+/*
+ * storage_type for tipl::image backed by buffer_pool. With initialize = false,
+ * resize leaves new elements uninitialized, for buffers that are fully written anyway.
+ * e.g. tipl::image<3,float,tipl::aligned_container<float> >
+ *
+ * With first_touch = true, large buffers bypass the pool and are first written by
+ * par_for_block, which partitions them exactly as par_for_block and image::for_each_mt
+ * do later. On NUMA machines each block's pages then land on the node of the thread
+ * that processes it (see also tipl::thread_affinity).
+ */
+template<typename vtype,bool initialize = true,bool first_touch = false>
+class aligned_container
+{
+    static_assert(std::is_trivially_destructible<vtype>::value,"aligned_container requires a trivially destructible type");
+public:
+    using value_type        = vtype;
+    using iterator          = vtype*;
+    using const_iterator    = const vtype*;
+    using reference         = vtype&;
+    using const_reference   = const vtype&;
+private:
+    vtype* from = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+private:
+    bool parallel_touch(size_t n) const
+    {
+        return first_touch && n*sizeof(vtype) >= buffer_pool::min_pooled_size;
+    }
+    void allocate(size_t n)
+    {
+        if(!n)
+            from = nullptr;
+        else
+            from = reinterpret_cast<vtype*>(parallel_touch(n) ?
+                    buffer_pool::aligned_malloc(buffer_pool::size_class(n*sizeof(vtype))) :
+                    buffer_pool::instance().allocate(n*sizeof(vtype)));
+        capacity_ = n;
+    }
+    void deallocate(void)
+    {
+        if(parallel_touch(capacity_))
+            buffer_pool::aligned_free(from);
+        else
+            buffer_pool::instance().deallocate(from,capacity_*sizeof(vtype));
+        from = nullptr;
+        size_ = capacity_ = 0;
+    }
+    // value-initialize [size_,n), writing the whole buffer in parallel for first touch
+    template<typename any_iterator_type>
+    void assign(any_iterator_type src,size_t src_size,size_t n)
+    {
+        if(parallel_touch(n))
+        {
+            par_for_block(n,[&](size_t i)
+            {
+                from[i] = (i < src_size ? vtype(src[i]) : vtype());
+            });
+            return;
+        }
+        std::copy(src,src+src_size,from);
+        if(initialize)
+            std::fill(from+src_size,from+n,vtype());
+    }
+public:
+    aligned_container(void){}
+    aligned_container(size_t n)
+    {
+        allocate(n);
+        size_ = n;
+        assign(from,0,n);
+    }
+    template<typename any_iterator_type>
+    aligned_container(any_iterator_type from_,any_iterator_type to_)
+    {
+        allocate(size_t(std::distance(from_,to_)));
+        size_ = capacity_;
+        assign(from_,size_,size_);
+    }
+    aligned_container(const aligned_container& rhs):aligned_container(rhs.begin(),rhs.end()){}
+    aligned_container(aligned_container&& rhs) noexcept{swap(rhs);}
+    ~aligned_container(void){deallocate();}
+public:
+    aligned_container& operator=(const aligned_container& rhs)
+    {
+        if(this != &rhs)
+        {
+            aligned_container new_data(rhs);
+            swap(new_data);
+        }
+        return *this;
+    }
+    aligned_container& operator=(aligned_container&& rhs) noexcept
+    {
+        if(this != &rhs)
+        {
+            deallocate();
+            swap(rhs);
+        }
+        return *this;
+    }
+public:
+    void swap(aligned_container& rhs) noexcept
+    {
+        std::swap(from,rhs.from);
+        std::swap(size_,rhs.size_);
+        std::swap(capacity_,rhs.capacity_);
+    }
+    void resize(size_t new_size)
+    {
+        if(new_size > capacity_)
+        {
+            aligned_container new_data;
+            new_data.allocate(new_size);
+            new_data.assign(static_cast<const vtype*>(from),size_,new_size);
+            new_data.size_ = new_size;
+            swap(new_data);
+            return;
+        }
+        if(initialize && new_size > size_)
+            std::fill(from+size_,from+new_size,vtype());
+        size_ = new_size;
+    }
+    void clear(void)
+    {
+        size_ = 0;
+    }
+    size_t size(void) const{return size_;}
+    bool empty(void) const{return size_ == 0;}
+    vtype* data(void){return from;}
+    const vtype* data(void) const{return from;}
+public:
+    template<typename index_type>
+    const_reference operator[](index_type index) const{return from[index];}
+    template<typename index_type>
+    reference operator[](index_type index){return from[index];}
+    const_reference front(void) const{return from[0];}
+    const_reference back(void) const{return from[size_-1];}
+    iterator begin(void){return from;}
+    iterator end(void){return from+size_;}
+    const_iterator begin(void) const{return from;}
+    const_iterator end(void) const{return from+size_;}
+};
+
+// 64-byte aligned storage first-touched with the par_for_block partitioning
+template<typename vtype>
+using first_touch_container = aligned_container<vtype,true,true>;
+
+/*
+ * scoped arena for temporaries inside an algorithm: buffers are taken from
+ * buffer_pool and all go back to it when the arena goes out of scope.
+ */
+class buffer_arena{
+    std::vector<std::pair<void*,size_t> > buffers;
+public:
+    buffer_arena(void){}
+    buffer_arena(const buffer_arena&) = delete;
+    buffer_arena& operator=(const buffer_arena&) = delete;
+    ~buffer_arena(void)
+    {
+        for(auto& each : buffers)
+            buffer_pool::instance().deallocate(each.first,each.second);
+    }
+    template<typename T>
+    pointer_container<T> get(size_t n,bool zero = true)
+    {
+        static_assert(std::is_trivially_destructible<T>::value,"buffer_arena requires a trivially destructible type");
+        if(!n)
+            return pointer_container<T>();
+        T* p = reinterpret_cast<T*>(buffer_pool::instance().allocate(n*sizeof(T)));
+        buffers.push_back(std::make_pair(reinterpret_cast<void*>(p),n*sizeof(T)));
+        if(zero)
+            std::fill(p,p+n,T());
+        return pointer_container<T>(p,p+n);
+    }
+};
+
+}
+#endif//TIPL_POOL_HPP
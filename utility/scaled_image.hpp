@@ -0,0 +1,86 @@
+#ifndef SCALED_IMAGE_HPP
+#define SCALED_IMAGE_HPP
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include "basic_image.hpp"
+#include "multi_thread.hpp"
+
+namespace tipl
+{
+
+/*
+ * 16-bit quantized image, value = slope*x + inter for a stored int16_t x.
+ * This is the NIfTI int16 layout with scl_slope/scl_inter, and it halves the
+ * memory of a float image. operator[] and iterators give the stored x; use
+ * value(i) or save_to_image for the scaled values. tipl::estimate on a
+ * scaled_image interpolates x and then applies the scaling.
+ */
+template<int dim>
+class scaled_image : public image<dim,int16_t>
+{
+public:
+    using base_type         = image<dim,int16_t>;
+    using shape_type        = tipl::shape<dim>;
+    static const int dimension = dim;
+public:
+    float slope = 1.0f;
+    float inter = 0.0f;
+public:
+    scaled_image(void){}
+    scaled_image(const shape_type& geo_):base_type(geo_){}
+    template<typename T,typename S>
+    scaled_image(const image<dim,T,S>& I){load_from_image(I);}
+public:
+    float value(size_t i) const{return slope*float(base_type::data[i])+inter;}
+    // quantize I with the slope and intercept that cover its value range
+    template<typename T,typename S>
+    void load_from_image(const image<dim,T,S>& I)
+    {
+        base_type::resize(I.shape());
+        if(I.empty())
+            return;
+        auto range = std::minmax_element(I.begin(),I.end());
+        float min_v = float(*range.first);
+        float max_v = float(*range.second);
+        inter = (max_v+min_v)*0.5f;
+        slope = (max_v-min_v)/65534.0f;
+        if(slope == 0.0f)
+            slope = 1.0f;
+        load_from_image(I,slope,inter);
+    }
+    // quantize I with a given slope and intercept, values out of range are clamped
+    template<typename T,typename S>
+    void load_from_image(const image<dim,T,S>& I,float slope_,float inter_)
+    {
+        base_type::resize(I.shape());
+        slope = slope_;
+        inter = inter_;
+        float inv_slope = 1.0f/slope;
+        int16_t* out = base_type::data.data();
+        par_for_block(I.size(),[&](size_t i)
+        {
+            float x = std::round((float(I[i])-inter)*inv_slope);
+            out[i] = int16_t(std::min(32767.0f,std::max(-32768.0f,x)));
+        });
+    }
+    template<typename T,typename S>
+    void save_to_image(image<dim,T,S>& I) const
+    {
+        I.resize(base_type::shape());
+        const int16_t* in = base_type::data.data();
+        par_for_block(I.size(),[&](size_t i)
+        {
+            I[i] = T(slope*float(in[i])+inter);
+        });
+    }
+    void swap(scaled_image& rhs)
+    {
+        base_type::swap(rhs);
+        std::swap(slope,rhs.slope);
+        std::swap(inter,rhs.inter);
+    }
+};
+
+}
+#endif//SCALED_IMAGE_HPP
@@ -0,0 +1,233 @@
+#ifndef SERIES_IMAGE_HPP
+#define SERIES_IMAGE_HPP
+#include <algorithm>
+#include <vector>
+#include "basic_image.hpp"
+#include "multi_thread.hpp"
+#include "sub_image.hpp"
+
+namespace tipl
+{
+
+// out[c*rows+r] = in[r*cols+c], copied in tiles so that reads and writes both stay in cache
+template<typename T>
+void transpose_mt(const T* in,T* out,size_t rows,size_t cols,
+                  unsigned int thread_count = std::thread::hardware_concurrency())
+{
+    const size_t tile = 32;
+    size_t row_tiles = (rows+tile-1)/tile;
+    size_t col_tiles = (cols+tile-1)/tile;
+    par_for(row_tiles*col_tiles,[&](size_t i)
+    {
+        size_t r0 = (i/col_tiles)*tile;
+        size_t c0 = (i%col_tiles)*tile;
+        size_t r1 = std::min(rows,r0+tile);
+        size_t c1 = std::min(cols,c0+tile);
+        for(size_t c = c0;c < c1;++c)
+            for(size_t r = r0;r < r1;++r)
+                out[c*rows+r] = in[r*cols+c];
+    },thread_count);
+}
+
+enum series_layout {volume_major,voxel_major};
+
+/*
+ * series_image holds a 4D image (e.g. DWI or fMRI) as volume_count() volumes
+ * of volume_shape(), in one of two layouts:
+ *
+ *   volume_major   volume by volume, as image<4> and NIfTI store it
+ *   voxel_major    the series of each voxel is contiguous
+ *
+ * Per-volume work (registration, smoothing) runs best on volume_major and
+ * voxelwise model fitting on voxel_major. set_layout converts between them
+ * with a tiled transpose. volume(t) and series(i) are views in either layout,
+ * and for_each_series_mt gives each voxel's series as a contiguous array,
+ * gathering it first when the layout is volume_major.
+ */
+template<typename vtype = float>
+class series_image
+{
+public:
+    using value_type        = vtype;
+    using storage_type      = std::vector<vtype>;
+    using iterator          = typename storage_type::iterator;
+    using const_iterator    = typename storage_type::const_iterator;
+    using volume_shape_type = tipl::shape<3>;
+    using volume_type       = sub_image<3,vtype>;
+    using const_volume_type = const_sub_image<3,vtype>;
+    using series_type       = sub_image<1,vtype>;
+    using const_series_type = const_sub_image<1,vtype>;
+    static const int dimension = 4;
+private:
+    storage_type data;
+    volume_shape_type geo;
+    size_t n = 0;
+    series_layout layout_ = volume_major;
+public:
+    series_image(void){}
+    series_image(const volume_shape_type& geo_,size_t volume_count,series_layout layout = volume_major)
+    {
+        resize(geo_,volume_count,layout);
+    }
+    template<typename T,typename S>
+    series_image(const image<4,T,S>& I,series_layout layout = volume_major)
+    {
+        load_from_image(I,layout);
+    }
+    template<typename T,typename S>
+    series_image(const std::vector<image<3,T,S> >& I,series_layout layout = volume_major)
+    {
+        load_from_image(I,layout);
+    }
+public:
+    tipl::shape<4> shape(void) const{return tipl::shape<4>(geo[0],geo[1],geo[2],uint32_t(n));}
+    const volume_shape_type& volume_shape(void) const{return geo;}
+    size_t volume_count(void) const{return n;}
+    size_t voxel_count(void) const{return geo.size();}
+    size_t size(void) const{return data.size();}
+    bool empty(void) const{return data.empty();}
+    series_layout layout(void) const{return layout_;}
+    // storage order follows layout()
+    iterator begin(void){return data.begin();}
+    iterator end(void){return data.end();}
+    const_iterator begin(void) const{return data.begin();}
+    const_iterator end(void) const{return data.end();}
+    void resize(const volume_shape_type& geo_,size_t volume_count,series_layout layout = volume_major)
+    {
+        geo = geo_;
+        n = volume_count;
+        layout_ = layout;
+        data.resize(geo.size()*n);
+    }
+    void clear(void)
+    {
+        storage_type().swap(data);
+        geo = volume_shape_type();
+        n = 0;
+    }
+    void swap(series_image& rhs)
+    {
+        data.swap(rhs.data);
+        geo.swap(rhs.geo);
+        std::swap(n,rhs.n);
+        std::swap(layout_,rhs.layout_);
+    }
+    // element offsets between consecutive voxels and consecutive volumes
+    size_t voxel_stride(void) const{return layout_ == volume_major ? 1 : n;}
+    size_t volume_stride(void) const{return layout_ == volume_major ? geo.size() : 1;}
+    size_t offset(size_t voxel,size_t t) const{return voxel*voxel_stride()+t*volume_stride();}
+    vtype& at(size_t voxel,size_t t){return data[offset(voxel,t)];}
+    const vtype& at(size_t voxel,size_t t) const{return data[offset(voxel,t)];}
+public:
+    volume_type volume(size_t t)
+    {
+        size_t s = voxel_stride();
+        size_t strides[3] = {s,s*geo[0],s*geo.plane_size()};
+        return volume_type(&data[0]+t*volume_stride(),geo,strides);
+    }
+    const_volume_type volume(size_t t) const
+    {
+        size_t s = voxel_stride();
+        size_t strides[3] = {s,s*geo[0],s*geo.plane_size()};
+        return const_volume_type(&data[0]+t*volume_stride(),geo,strides);
+    }
+    series_type series(size_t voxel)
+    {
+        size_t strides[1] = {volume_stride()};
+        return series_type(&data[0]+voxel*voxel_stride(),tipl::shape<1>(uint32_t(n)),strides);
+    }
+    const_series_type series(size_t voxel) const
+    {
+        size_t strides[1] = {volume_stride()};
+        return const_series_type(&data[0]+voxel*voxel_stride(),tipl::shape<1>(uint32_t(n)),strides);
+    }
+    // f(const vtype* series,size_t voxel) for every voxel
+    template<typename Func>
+    void for_each_series_mt(Func&& f,unsigned int thread_count = std::thread::hardware_concurrency()) const
+    {
+        if(layout_ == voxel_major)
+        {
+            par_for_block(geo.size(),[&](size_t i)
+            {
+                f(&data[0]+i*n,i);
+            },thread_count);
+            return;
+        }
+        size_t block_size = 64;
+        size_t V = geo.size();
+        par_for((V+block_size-1)/block_size,[&](size_t block)
+        {
+            // gather a block of series so that each volume is read one cache line at a time
+            size_t from = block*block_size;
+            size_t to = std::min(V,from+block_size);
+            std::vector<vtype> buf((to-from)*n);
+            for(size_t t = 0;t < n;++t)
+            {
+                const vtype* in = &data[0]+t*V;
+                for(size_t i = from;i < to;++i)
+                    buf[(i-from)*n+t] = in[i];
+            }
+            for(size_t i = from;i < to;++i)
+                f(&buf[0]+(i-from)*n,i);
+        },thread_count);
+    }
+public:
+    void set_layout(series_layout layout)
+    {
+        if(layout == layout_)
+            return;
+        if(!data.empty())
+        {
+            storage_type new_data(data.size());
+            if(layout_ == volume_major)
+                transpose_mt(&data[0],&new_data[0],n,geo.size());
+            else
+                transpose_mt(&data[0],&new_data[0],geo.size(),n);
+            data.swap(new_data);
+        }
+        layout_ = layout;
+    }
+    template<typename T,typename S>
+    void load_from_image(const image<4,T,S>& I,series_layout layout = volume_major)
+    {
+        resize(volume_shape_type(I.shape().begin()),I.shape()[3],volume_major);
+        std::copy(I.begin(),I.end(),data.begin());
+        set_layout(layout);
+    }
+    template<typename T,typename S>
+    void load_from_image(const std::vector<image<3,T,S> >& I,series_layout layout = volume_major)
+    {
+        if(I.empty())
+        {
+            clear();
+            return;
+        }
+        resize(I[0].shape(),I.size(),volume_major);
+        for(size_t t = 0;t < n;++t)
+            std::copy(I[t].begin(),I[t].end(),data.begin()+t*geo.size());
+        set_layout(layout);
+    }
+    template<typename T,typename S>
+    void save_to_image(image<4,T,S>& I) const
+    {
+        I.resize(shape());
+        if(layout_ == volume_major)
+            std::copy(data.begin(),data.end(),I.begin());
+        else
+            par_for(n,[&](size_t t)
+            {
+                auto v = volume(t);
+                std::copy(v.begin(),v.end(),I.begin()+t*geo.size());
+            });
+    }
+    template<typename T,typename S>
+    void save_to_image(std::vector<image<3,T,S> >& I) const
+    {
+        I.resize(n);
+        for(size_t t = 0;t < n;++t)
+            volume(t).save_to_image(I[t]);
+    }
+};
+
+}
+#endif//SERIES_IMAGE_HPP
@@ -0,0 +1,176 @@
+#ifndef SOA_IMAGE_HPP
+#define SOA_IMAGE_HPP
+#include <type_traits>
+#include "basic_image.hpp"
+#include "multi_thread.hpp"
+
+namespace tipl
+{
+
+/*
+ * soa_image stores a vector-valued image (e.g. a displacement field) as one
+ * scalar plane per component instead of an image of tipl::vector, so that
+ * kernels can run over contiguous x, y, and z components.
+ *
+ * operator[] returns a proxy that reads and writes the components of one
+ * voxel like a tipl::vector. Per-component work (filters, scaling, sums)
+ * should go through plane(k), which is a plain tipl::image. The planes must
+ * keep the same shape; use resize() on the soa_image instead of on a plane.
+ */
+template<int dim,typename vtype = float>
+class soa_image
+{
+public:
+    using value_type        = tipl::vector<dim,vtype>;
+    using component_type    = vtype;
+    using plane_type        = image<dim,vtype>;
+    using shape_type        = tipl::shape<dim>;
+    static const int dimension = dim;
+protected:
+    plane_type planes[dim];
+public:
+    class reference{
+        soa_image* I;
+        size_t i;
+    public:
+        reference(soa_image* I_,size_t i_):I(I_),i(i_){}
+        vtype& operator[](unsigned int k) const{return I->planes[k][i];}
+        operator value_type() const
+        {
+            value_type v;
+            for(int k = 0;k < dim;++k)
+                v[k] = I->planes[k][i];
+            return v;
+        }
+        // assigns the values, a proxy never rebinds
+        const reference& operator=(const reference& rhs) const
+        {
+            for(int k = 0;k < dim;++k)
+                I->planes[k][i] = rhs[k];
+            return *this;
+        }
+        const reference& operator=(const value_type& rhs) const
+        {
+            for(int k = 0;k < dim;++k)
+                I->planes[k][i] = rhs[k];
+            return *this;
+        }
+        const reference& operator+=(const value_type& rhs) const
+        {
+            for(int k = 0;k < dim;++k)
+                I->planes[k][i] += rhs[k];
+            return *this;
+        }
+        const reference& operator-=(const value_type& rhs) const
+        {
+            for(int k = 0;k < dim;++k)
+                I->planes[k][i] -= rhs[k];
+            return *this;
+        }
+        template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
+        const reference& operator*=(T rhs) const
+        {
+            for(int k = 0;k < dim;++k)
+                I->planes[k][i] *= rhs;
+            return *this;
+        }
+        value_type operator-(void) const{return -value_type(*this);}
+        bool operator==(const value_type& rhs) const{return value_type(*this) == rhs;}
+        bool operator!=(const value_type& rhs) const{return !(*this == rhs);}
+        double length(void) const{return value_type(*this).length();}
+    };
+public:
+    soa_image(void){}
+    soa_image(const shape_type& geo){resize(geo);}
+    template<typename T,typename S>
+    soa_image(const image<dim,tipl::vector<dim,T>,S>& rhs){load_from_image(rhs);}
+public:
+    // AoS to SoA
+    template<typename T,typename S>
+    void load_from_image(const image<dim,tipl::vector<dim,T>,S>& rhs)
+    {
+        resize(rhs.shape());
+        vtype* p[dim];
+        for(int k = 0;k < dim;++k)
+            p[k] = &planes[k][0];
+        par_for_block(rhs.size(),[&](size_t i)
+        {
+            for(int k = 0;k < dim;++k)
+                p[k][i] = vtype(rhs[i][k]);
+        });
+    }
+    // SoA to AoS
+    template<typename T,typename S>
+    void save_to_image(image<dim,tipl::vector<dim,T>,S>& rhs) const
+    {
+        rhs.resize(shape());
+        const vtype* p[dim];
+        for(int k = 0;k < dim;++k)
+            p[k] = &planes[k][0];
+        par_for_block(rhs.size(),[&](size_t i)
+        {
+            for(int k = 0;k < dim;++k)
+                rhs[i][k] = T(p[k][i]);
+        });
+    }
+public:
+    const shape_type& shape(void) const{return planes[0].shape();}
+    int width(void) const{return planes[0].width();}
+    int height(void) const{return planes[0].height();}
+    int depth(void) const{return planes[0].depth();}
+    size_t plane_size(void) const{return planes[0].plane_size();}
+    size_t size(void) const{return planes[0].size();}
+    bool empty(void) const{return planes[0].empty();}
+    void resize(const shape_type& geo)
+    {
+        for(int k = 0;k < dim;++k)
+            planes[k].resize(geo);
+    }
+    void clear(void)
+    {
+        for(int k = 0;k < dim;++k)
+            planes[k].clear();
+    }
+    void swap(soa_image& rhs)
+    {
+        for(int k = 0;k < dim;++k)
+            planes[k].swap(rhs.planes[k]);
+    }
+    plane_type& plane(unsigned int k){return planes[k];}
+    const plane_type& plane(unsigned int k) const{return planes[k];}
+    template<typename index_type>
+    value_type operator[](index_type i) const
+    {
+        value_type v;
+        for(int k = 0;k < dim;++k)
+            v[k] = planes[k][i];
+        return v;
+    }
+    template<typename index_type>
+    reference operator[](index_type i){return reference(this,size_t(i));}
+public:
+    template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
+    const soa_image& operator*=(T value)
+    {
+        for(int k = 0;k < dim;++k)
+            planes[k] *= value;
+        return *this;
+    }
+    template<typename T>
+    const soa_image& operator+=(const soa_image<dim,T>& rhs)
+    {
+        for(int k = 0;k < dim;++k)
+            planes[k] += rhs.plane(k);
+        return *this;
+    }
+    template<typename T>
+    const soa_image& operator-=(const soa_image<dim,T>& rhs)
+    {
+        for(int k = 0;k < dim;++k)
+            planes[k] -= rhs.plane(k);
+        return *this;
+    }
+};
+
+}
+#endif//SOA_IMAGE_HPP
@@ -0,0 +1,326 @@
+#ifndef SUB_IMAGE_HPP
+#define SUB_IMAGE_HPP
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include "basic_image.hpp"
+#include "multi_thread.hpp"
+
+namespace tipl
+{
+
+/*
+ * sub_image is a view of a region of an existing image: an origin pointer,
+ * the extents of the region, and the stride (in elements) of each dimension
+ * in the underlying storage. Nothing is copied, so an algorithm that only
+ * needs begin()/end(), operator[], at(), or for_each can run on a region of
+ * interest in place, e.g.
+ *
+ *     auto roi = tipl::make_sub_image(I,from,to);
+ *     float m = tipl::mean(roi.begin(),roi.end());
+ *     roi *= 2.0f;
+ *     tipl::image<3> J;
+ *     roi.save_to_image(J);   // crop
+ *
+ * The view does not own the storage and must not outlive it. Rows are copied
+ * with std::copy when they are contiguous (stride(0) == 1), and the whole view
+ * is one block when it spans full rows and planes (is_contiguous()).
+ */
+template<int dim,typename vtype = float,typename pointer_type = vtype*>
+class sub_image
+{
+public:
+    using value_type        = vtype;
+    using reference         = typename std::iterator_traits<pointer_type>::reference;
+    using shape_type        = tipl::shape<dim>;
+    using slice_type        = sub_image<dim-1,vtype,pointer_type>;
+    static const int dimension = dim;
+public:
+    class iterator{
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type        = vtype;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = pointer_type;
+        using reference         = typename sub_image::reference;
+    private:
+        const sub_image* view = nullptr;
+        pointer_type row_ptr = nullptr;
+        size_t i = 0;   // position in the view
+        size_t x = 0;   // position in the row
+        void seek(size_t i_)
+        {
+            i = i_;
+            if(i < view->size())
+            {
+                x = i % size_t(view->width());
+                row_ptr = view->row_pointer(i/size_t(view->width()));
+            }
+            else
+                x = 0;
+        }
+    public:
+        iterator(void){}
+        iterator(const sub_image* view_,size_t i_):view(view_){seek(i_);}
+        reference operator*(void) const{return row_ptr[x*view->stride(0)];}
+        reference operator[](difference_type n) const{return *(*this+n);}
+        iterator& operator++(void)
+        {
+            ++i;
+            if(++x == size_t(view->width()))
+                seek(i);
+            return *this;
+        }
+        iterator operator++(int)
+        {
+            iterator tmp(*this);
+            ++(*this);
+            return tmp;
+        }
+        iterator& operator--(void)
+        {
+            seek(i-1);
+            return *this;
+        }
+        iterator& operator+=(difference_type n)
+        {
+            seek(size_t(difference_type(i)+n));
+            return *this;
+        }
+        iterator& operator-=(difference_type n){return *this += -n;}
+        iterator operator+(difference_type n) const
+        {
+            iterator tmp(*this);
+            return tmp += n;
+        }
+        iterator operator-(difference_type n) const{return *this + (-n);}
+        difference_type operator-(const iterator& rhs) const{return difference_type(i)-difference_type(rhs.i);}
+        bool operator==(const iterator& rhs) const{return i == rhs.i;}
+        bool operator!=(const iterator& rhs) const{return i != rhs.i;}
+        bool operator<(const iterator& rhs) const{return i < rhs.i;}
+        bool operator>(const iterator& rhs) const{return i > rhs.i;}
+        bool operator<=(const iterator& rhs) const{return i <= rhs.i;}
+        bool operator>=(const iterator& rhs) const{return i >= rhs.i;}
+    };
+    using const_iterator = iterator;
+private:
+    pointer_type origin = nullptr;
+    shape_type geo;
+    size_t strides[dim] = {};
+public:
+    sub_image(void){}
+    template<typename stride_type>
+    sub_image(pointer_type origin_,const shape_type& geo_,const stride_type& strides_):origin(origin_),geo(geo_)
+    {
+        for(int d = 0;d < dim;++d)
+            strides[d] = size_t(strides_[d]);
+    }
+    // the region [from,to) of an image
+    template<typename image_type,typename pos_type>
+    sub_image(image_type& I,const pos_type& from,const pos_type& to)
+    {
+        size_t offset = 0,s = 1;
+        for(int d = 0;d < dim;++d)
+        {
+            geo[d] = (to[d] > from[d] ? size_t(to[d]-from[d]) : 0);
+            strides[d] = s;
+            offset += size_t(from[d])*s;
+            s *= I.shape()[d];
+        }
+        if(!I.empty())
+            origin = &*I.begin()+offset;
+    }
+public:
+    const shape_type& shape(void) const{return geo;}
+    int width(void) const{return geo.width();}
+    int height(void) const{return geo.height();}
+    int depth(void) const{return geo.depth();}
+    size_t plane_size(void) const{return geo.plane_size();}
+    size_t size(void) const{return geo.size();}
+    bool empty(void) const{return geo.size() == 0;}
+    size_t stride(unsigned int d) const{return strides[d];}
+    pointer_type data(void) const{return origin;}
+    // the view covers one block of memory, e.g. whole slices of a volume
+    bool is_contiguous(void) const
+    {
+        size_t s = 1;
+        for(int d = 0;d < dim;++d)
+        {
+            if(geo[d] > 1 && strides[d] != s)
+                return false;
+            s *= geo[d];
+        }
+        return true;
+    }
+public:
+    size_t row_count(void) const{return geo[0] ? geo.size()/geo[0] : 0;}
+    pointer_type row_pointer(size_t row) const
+    {
+        size_t offset = 0;
+        for(int d = 1;d < dim;++d)
+        {
+            offset += (row % geo[d])*strides[d];
+            row /= geo[d];
+        }
+        return origin+offset;
+    }
+    // iterators refer to this view object, keep it alive while iterating
+    iterator begin(void) const{return iterator(this,0);}
+    iterator end(void) const{return iterator(this,size());}
+    template<typename index_type>
+    reference operator[](index_type index) const
+    {
+        size_t i = size_t(index);
+        return row_pointer(i/geo[0])[(i%geo[0])*strides[0]];
+    }
+    reference at(unsigned int x,unsigned int y) const
+    {
+        return origin[x*strides[0]+y*strides[1]];
+    }
+    reference at(unsigned int x,unsigned int y,unsigned int z) const
+    {
+        return origin[x*strides[0]+y*strides[1]+z*strides[2]];
+    }
+    slice_type slice_at(unsigned int pos) const
+    {
+        return slice_type(origin+pos*strides[dim-1],tipl::shape<dim-1>(geo.begin()),strides);
+    }
+public:
+    // f(value,pixel_index), the pixel_index is in the coordinates of the view
+    template<typename Func>
+    void for_each(Func&& f) const
+    {
+        for(size_t row = 0,w = geo[0];row < row_count();++row)
+        {
+            pointer_type p = row_pointer(row);
+            pixel_index<dim> index(size_t(row*w),geo);
+            for(size_t x = 0;x < w;++x,++index)
+                f(p[x*strides[0]],index);
+        }
+    }
+    template<typename Func>
+    void for_each_mt(Func&& f,unsigned int thread_count = std::thread::hardware_concurrency()) const
+    {
+        size_t w = geo[0];
+        par_for(row_count(),[&](size_t row)
+        {
+            pointer_type p = row_pointer(row);
+            pixel_index<dim> index(size_t(row*w),geo);
+            for(size_t x = 0;x < w;++x,++index)
+                f(p[x*strides[0]],index);
+        },thread_count);
+    }
+public:
+    // copy the region into I (crop)
+    template<typename image_type>
+    void save_to_image(image_type& I) const
+    {
+        I.resize(geo);
+        if(empty())
+            return;
+        auto out = I.begin();
+        if(is_contiguous())
+        {
+            std::copy(origin,origin+size(),out);
+            return;
+        }
+        size_t w = geo[0];
+        for(size_t row = 0;row < row_count();++row,out += w)
+        {
+            pointer_type p = row_pointer(row);
+            if(strides[0] == 1)
+                std::copy(p,p+w,out);
+            else
+                for(size_t x = 0;x < w;++x)
+                    out[x] = p[x*strides[0]];
+        }
+    }
+    // write I into the region, I must have the shape of the view
+    template<typename image_type>
+    void load_from_image(const image_type& I) const
+    {
+        if(empty())
+            return;
+        auto in = I.begin();
+        if(is_contiguous())
+        {
+            std::copy(in,in+size(),origin);
+            return;
+        }
+        size_t w = geo[0];
+        for(size_t row = 0;row < row_count();++row,in += w)
+        {
+            pointer_type p = row_pointer(row);
+            if(strides[0] == 1)
+                std::copy(in,in+w,p);
+            else
+                for(size_t x = 0;x < w;++x)
+                    p[x*strides[0]] = in[x];
+        }
+    }
+    // region to region copy, rows of the two views are walked together
+    template<typename rhs_vtype,typename rhs_pointer_type>
+    void load_from_image(const sub_image<dim,rhs_vtype,rhs_pointer_type>& I) const
+    {
+        if(empty())
+            return;
+        size_t w = geo[0];
+        for(size_t row = 0;row < row_count();++row)
+        {
+            pointer_type p = row_pointer(row);
+            rhs_pointer_type in = I.row_pointer(row);
+            if(strides[0] == 1 && I.stride(0) == 1)
+                std::copy(in,in+w,p);
+            else
+                for(size_t x = 0;x < w;++x)
+                    p[x*strides[0]] = in[x*I.stride(0)];
+        }
+    }
+    template<typename value_type2>
+    void fill(value_type2 value) const
+    {
+        for(size_t row = 0,w = geo[0];row < row_count();++row)
+        {
+            pointer_type p = row_pointer(row);
+            for(size_t x = 0;x < w;++x)
+                p[x*strides[0]] = value;
+        }
+    }
+public:
+    template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
+    const sub_image& operator+=(T value) const
+    {
+        for_each([&](reference v,const pixel_index<dim>&){v += value;});
+        return *this;
+    }
+    template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
+    const sub_image& operator-=(T value) const
+    {
+        for_each([&](reference v,const pixel_index<dim>&){v -= value;});
+        return *this;
+    }
+    template<typename T,typename std::enable_if<std::is_fundamental<T>::value,bool>::type = true>
+    const sub_image& operator*=(T value) const
+    {
+        for_each([&](reference v,const pixel_index<dim>&){v *= value;});
+        return *this;
+    }
+};
+
+template<int dim,typename vtype>
+using const_sub_image = sub_image<dim,vtype,const vtype*>;
+
+// view of the region [from,to) of I
+template<int dim,typename vtype,typename storage_type,typename pos_type>
+sub_image<dim,vtype> make_sub_image(image<dim,vtype,storage_type>& I,const pos_type& from,const pos_type& to)
+{
+    return sub_image<dim,vtype>(I,from,to);
+}
+template<int dim,typename vtype,typename storage_type,typename pos_type>
+const_sub_image<dim,vtype> make_sub_image(const image<dim,vtype,storage_type>& I,const pos_type& from,const pos_type& to)
+{
+    return const_sub_image<dim,vtype>(I,from,to);
+}
+
+}
+#endif//SUB_IMAGE_HPP